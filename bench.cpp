@@ -0,0 +1,336 @@
+// Micro-benchmarks for the delivery system's hot paths: routing, dispatch,
+// JSON handling and storage reads. Fixtures are generated from a fixed seed
+// so runs are comparable between versions; results go to stdout as JSON or
+// CSV, progress to stderr.
+#define DELIVERY_SYSTEM_NO_MAIN
+#include "main.cpp"
+
+#include <random>
+
+namespace {
+
+struct BenchConfig {
+    std::string format = "json";
+    std::string filter;                 // run only benchmarks whose name contains this
+    double minTimeMs = 200;             // measuring time per benchmark
+    size_t maxIterations = 100000;
+    unsigned seed = 42;
+    bool quick = false;                 // skip the largest fixtures
+};
+
+struct BenchResult {
+    std::string name;
+    std::string params;
+    size_t iterations;
+    double meanNs;
+    double p50Ns;
+    double p90Ns;
+    double p99Ns;
+    double minNs;
+};
+
+double percentile(std::vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+// Nanoseconds spent in fn
+template <typename Fn>
+double timed(Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Keeps a result alive so the compiler cannot drop the work producing it
+volatile size_t sink;
+
+template <typename T>
+void consume(const T& value) {
+    sink = sink + value.size();
+}
+
+class BenchRunner {
+private:
+    BenchConfig config;
+    std::vector<BenchResult> results;
+
+public:
+    explicit BenchRunner(const BenchConfig& config) : config(config) {}
+
+    bool wanted(const std::string& name) const {
+        return config.filter.empty() || name.find(config.filter) != std::string::npos;
+    }
+
+    // iteration does any untimed setup itself and returns the nanoseconds of the timed part
+    void run(const std::string& name, const std::string& params, const std::function<double()>& iteration) {
+        if (!wanted(name)) {
+            return;
+        }
+        std::cerr << name << " " << params << " ..." << std::flush;
+        for (int warmup = 0; warmup < 3; ++warmup) {
+            iteration();
+        }
+        std::vector<double> samples;
+        double measured = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (samples.size() < config.maxIterations &&
+               (samples.size() < 5 ||
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() < config.minTimeMs)) {
+            double ns = iteration();
+            samples.push_back(ns);
+            measured += ns;
+        }
+        std::sort(samples.begin(), samples.end());
+        BenchResult result;
+        result.name = name;
+        result.params = params;
+        result.iterations = samples.size();
+        result.meanNs = measured / samples.size();
+        result.p50Ns = percentile(samples, 50);
+        result.p90Ns = percentile(samples, 90);
+        result.p99Ns = percentile(samples, 99);
+        result.minNs = samples.front();
+        results.push_back(result);
+        std::cerr << " " << samples.size() << " iterations, p50 " << result.p50Ns << " ns" << std::endl;
+    }
+
+    void write(std::ostream& out) const {
+        out << std::fixed << std::setprecision(1);
+        if (config.format == "csv") {
+            out << "name,params,iterations,mean_ns,p50_ns,p90_ns,p99_ns,min_ns\n";
+            for (const auto& r : results) {
+                out << r.name << ",\"" << r.params << "\"," << r.iterations << "," << r.meanNs << "," << r.p50Ns
+                    << "," << r.p90Ns << "," << r.p99Ns << "," << r.minNs << "\n";
+            }
+            return;
+        }
+        out << "{\"seed\":" << config.seed << ",\"benchmarks\":[";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto& r = results[i];
+            if (i > 0) out << ",";
+            out << "\n{\"name\":\"" << escape_json(r.name) << "\",\"params\":\"" << escape_json(r.params) << "\""
+                << ",\"iterations\":" << r.iterations << ",\"mean_ns\":" << r.meanNs << ",\"p50_ns\":" << r.p50Ns
+                << ",\"p90_ns\":" << r.p90Ns << ",\"p99_ns\":" << r.p99Ns << ",\"min_ns\":" << r.minNs << "}";
+        }
+        out << "\n]}\n";
+    }
+};
+
+// A city on a jittered side x side grid; each location has roads to its right
+// and lower neighbours and, now and then, a diagonal. Locations are 1..nodes.
+void buildGridCity(DeliverySystem& system, int nodes, std::mt19937& rng) {
+    int side = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(nodes))));
+    std::uniform_real_distribution<double> jitter(-0.3, 0.3);
+    std::uniform_real_distribution<double> unit(0, 1);
+    std::vector<std::pair<double, double>> points(nodes + 1);
+    for (int id = 1; id <= nodes; ++id) {
+        int cell = id - 1;
+        points[id] = {cell % side + jitter(rng), cell / side + jitter(rng)};
+        system.addLocation(id, "L" + std::to_string(id), points[id].first * 10, points[id].second * 10);
+    }
+    auto road = [&](int a, int b) {
+        if (b < 1 || b > nodes) return;
+        double dx = points[a].first - points[b].first;
+        double dy = points[a].second - points[b].second;
+        double length = std::sqrt(dx * dx + dy * dy) * 10 * (1.0 + 0.2 * unit(rng));
+        system.addEdge(a, b, length);
+        system.addEdge(b, a, length);
+    };
+    for (int id = 1; id <= nodes; ++id) {
+        int cell = id - 1;
+        if (cell % side + 1 < side) road(id, id + 1);
+        road(id, id + side);
+        if (cell % side + 1 < side && unit(rng) < 0.2) road(id, id + side + 1);
+    }
+}
+
+void benchRouting(BenchRunner& runner, const BenchConfig& config) {
+    std::vector<int> sizes = {1000, 10000};
+    if (!config.quick) sizes.push_back(100000);
+    for (int nodes : sizes) {
+        if (!runner.wanted("findShortestPath")) {
+            return;
+        }
+        std::mt19937 rng(config.seed);
+        std::cerr << "building " << nodes << "-node city" << std::endl;
+        DeliverySystem system(":memory:");
+        buildGridCity(system, nodes, rng);
+
+        std::uniform_int_distribution<int> anywhere(1, nodes);
+        std::vector<std::pair<int, int>> queries(256);
+        for (auto& query : queries) {
+            query = {anywhere(rng), anywhere(rng)};
+        }
+        for (RoutingAlgorithm algorithm : {RoutingAlgorithm::Dijkstra, RoutingAlgorithm::AStar}) {
+            size_t next = 0;
+            runner.run("findShortestPath", "nodes=" + std::to_string(nodes) + " algorithm=" + routingAlgorithmName(algorithm), [&] {
+                auto query = queries[next++ % queries.size()];
+                return timed([&] { consume(system.findShortestPath(query.first, query.second, algorithm)); });
+            });
+        }
+    }
+}
+
+void benchDispatch(BenchRunner& runner, const BenchConfig& config) {
+    if (!runner.wanted("assignDriverToOrder") && !runner.wanted("getDriverRoute")) {
+        return;
+    }
+    const int nodes = 10000;
+    for (int driverCount : {10, 100, 1000, 5000}) {
+        std::mt19937 rng(config.seed);
+        DeliverySystem system(":memory:");
+        system.setRouteOptimizationBudget(std::chrono::microseconds(0));
+        buildGridCity(system, nodes, rng);
+        std::uniform_int_distribution<int> anywhere(1, nodes);
+        std::vector<int> driverIds;
+        for (int i = 0; i < driverCount; ++i) {
+            driverIds.push_back(system.addDriver(1.0 + (i % 3), anywhere(rng)));
+        }
+        // Every driver starts with one order so insertion works on real routes
+        for (int i = 0; i < driverCount; ++i) {
+            int orderId = system.placeOrder(anywhere(rng), anywhere(rng));
+            system.assignDriverToOrder(orderId);
+        }
+
+        std::string params = "nodes=" + std::to_string(nodes) + " drivers=" + std::to_string(driverCount);
+        // Each iteration places an order, times its assignment, then completes it to keep loads steady
+        runner.run("assignDriverToOrder", params, [&] {
+            int orderId = system.placeOrder(anywhere(rng), anywhere(rng));
+            double ns = timed([&] { sink = sink + system.assignDriverToOrder(orderId); });
+            system.completeOrder(orderId);
+            return ns;
+        });
+
+        std::uniform_int_distribution<size_t> anyDriver(0, driverIds.size() - 1);
+        runner.run("getDriverRoute", params, [&] {
+            int driverId = driverIds[anyDriver(rng)];
+            return timed([&] { consume(system.getDriverRoute(driverId)); });
+        });
+    }
+}
+
+void benchJson(BenchRunner& runner, const BenchConfig& config) {
+    std::mt19937 rng(config.seed);
+
+    // The body of POST /api/orders, bound the way its handler binds it
+    std::string orderBody = "{\"restaurantId\": 17, \"customerLocationId\": 4242}";
+    runner.run("parseJson", "bytes=" + std::to_string(orderBody.size()), [&] {
+        int restaurantId = 0, customerLocationId = 0;
+        double ns = timed([&] {
+            JsonFields().required("restaurantId", restaurantId).required("customerLocationId", customerLocationId).parse(orderBody);
+        });
+        sink = sink + restaurantId + customerLocationId;
+        return ns;
+    });
+    std::ostringstream wide;
+    wide << "{";
+    for (int i = 0; i < 64; ++i) {
+        wide << (i > 0 ? ", " : "") << "\"field" << i << "\": \"value " << i << "\"";
+    }
+    wide << "}";
+    std::string wideBody = wide.str();
+    // One wanted field among 63 to skip
+    runner.run("parseJson", "bytes=" + std::to_string(wideBody.size()), [&] {
+        std::string value;
+        double ns = timed([&] { JsonFields().required("field63", value).parse(wideBody); });
+        consume(value);
+        return ns;
+    });
+
+    for (size_t length : {64, 4096}) {
+        std::uniform_int_distribution<int> character(0, 127);
+        std::string text;
+        for (size_t i = 0; i < length; ++i) {
+            text += static_cast<char>(character(rng));
+        }
+        runner.run("escape_json", "bytes=" + std::to_string(length), [&] {
+            return timed([&] { consume(escape_json(text)); });
+        });
+    }
+}
+
+void benchStorage(BenchRunner& runner, const BenchConfig& config) {
+    bool any = false;
+    for (const char* name : {"getAllOrders", "ordersToJson", "driversToJson", "locationsToJson", "edgesToJson"}) {
+        any = any || runner.wanted(name);
+    }
+    if (!any) {
+        return;
+    }
+    for (int orderCount : {1000, 10000}) {
+        std::mt19937 rng(config.seed);
+        DeliverySystem system(":memory:");
+        const int nodes = 1000;
+        buildGridCity(system, nodes, rng);
+        std::uniform_int_distribution<int> anywhere(1, nodes);
+        int driverCount = orderCount / 10;
+        for (int i = 0; i < driverCount; ++i) {
+            system.addDriver(1.0 + (i % 3), anywhere(rng));
+        }
+        // Orders go straight into the table; a third of them get a driver
+        for (int i = 0; i < orderCount; ++i) {
+            int orderId = system.placeOrder(anywhere(rng), anywhere(rng));
+            if (i % 3 == 0) {
+                system.assignDriverToOrder(orderId);
+            }
+        }
+
+        std::string params = "orders=" + std::to_string(orderCount) + " drivers=" + std::to_string(driverCount);
+        runner.run("getAllOrders", params, [&] {
+            return timed([&] { consume(system.getAllOrders()); });
+        });
+        runner.run("ordersToJson", params, [&] {
+            return timed([&] { consume(system.ordersToJson()); });
+        });
+        runner.run("driversToJson", params, [&] {
+            return timed([&] { consume(system.driversToJson()); });
+        });
+        runner.run("locationsToJson", "locations=" + std::to_string(nodes), [&] {
+            return timed([&] { consume(system.locationsToJson()); });
+        });
+        runner.run("edgesToJson", "locations=" + std::to_string(nodes), [&] {
+            return timed([&] { consume(system.edgesToJson()); });
+        });
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--format" && hasValue) {
+            config.format = argv[++i];
+        } else if (arg == "--filter" && hasValue) {
+            config.filter = argv[++i];
+        } else if (arg == "--min-time-ms" && hasValue) {
+            config.minTimeMs = std::stod(argv[++i]);
+        } else if (arg == "--max-iterations" && hasValue) {
+            config.maxIterations = std::max(5, std::stoi(argv[++i]));
+        } else if (arg == "--seed" && hasValue) {
+            config.seed = static_cast<unsigned>(std::stoul(argv[++i]));
+        } else if (arg == "--quick") {
+            config.quick = true;
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--format json|csv] [--filter NAME] [--min-time-ms MS] [--max-iterations N]"
+                      << " [--seed N] [--quick]" << std::endl;
+            return 1;
+        }
+    }
+    if (config.format != "json" && config.format != "csv") {
+        std::cerr << "Unknown format: " << config.format << std::endl;
+        return 1;
+    }
+
+    BenchRunner runner(config);
+    benchRouting(runner, config);
+    benchDispatch(runner, config);
+    benchJson(runner, config);
+    benchStorage(runner, config);
+    runner.write(std::cout);
+    return 0;
+}
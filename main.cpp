@@ -11,6 +11,25 @@
 #include <iomanip>
 #include <functional> // Added for std::function
 #include <set> 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <future>
+#include <memory>
+#include <unordered_map>
+#include <csignal>
+#include <cstring>
+#include <chrono>
+#include <shared_mutex>
+#include <tuple>
+#include <cctype>
+#include <array>
+#include <string_view>
+#include <charconv>
+#include <optional>
+#include <type_traits>
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -20,215 +39,4543 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include <sqlite3.h>
+
+// Append text to out as the inside of a JSON string. Runs of bytes that need no
+// escaping are copied in bulk; with SSE2, 16 bytes are checked at a time.
+inline void appendEscapedJson(std::string& out, std::string_view text) {
+    static const char hex[] = "0123456789abcdef";
+    const char* data = text.data();
+    size_t size = text.size();
+    size_t i = 0;
+    size_t clean = 0;   // start of the run not yet copied
+    auto escape = [&](size_t at) {
+        out.append(data + clean, at - clean);
+        unsigned char c = static_cast<unsigned char>(data[at]);
+        char sequence[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+        out.append(sequence, sizeof(sequence));
+        clean = at + 1;
+    };
+    out.reserve(out.size() + size + 2);
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i lastControl = _mm_set1_epi8(0x1F);
+    while (i + 16 <= size) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                       _mm_cmpeq_epi8(_mm_min_epu8(chunk, lastControl), chunk));   // byte <= 0x1F
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+        if (mask == 0) {
+            i += 16;
+            continue;
+        }
+        while (!(mask & 1)) {
+            mask >>= 1;
+            ++i;
+        }
+        escape(i++);
+    }
+#endif
+    for (; i < size; ++i) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c == '"' || c == '\\' || c <= 0x1F) {
+            escape(i);
+        }
+    }
+    out.append(data + clean, size - clean);
+}
+
+// Define simple JSON handling functions
+std::string escape_json(const std::string& s) {
+    std::string escaped;
+    appendEscapedJson(escaped, s);
+    return escaped;
+}
+
+// Helper function to check if string ends with a specific suffix (replacement for C++20's ends_with)
+bool ends_with(const std::string& str, const std::string& suffix) {
+    if (str.length() < suffix.length())
+        return false;
+    return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
+// Single-pass JSON tokenizer over a request body. Tokens are string_views into
+// the body, so nothing is copied until a value is bound; malformed input throws
+// std::invalid_argument naming the byte offset.
+class JsonCursor {
+private:
+    static constexpr int kMaxDepth = 64;
+
+    std::string_view text;
+    size_t pos = 0;
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    void skipNested(int depth) {
+        if (depth > kMaxDepth) {
+            fail("nesting too deep");
+        }
+        char open = peek();
+        if (open == '{' || open == '[') {
+            char close = open == '{' ? '}' : ']';
+            ++pos;
+            if (consume(close)) {
+                return;
+            }
+            do {
+                if (open == '{') {
+                    stringToken();
+                    expect(':');
+                }
+                skipNested(depth + 1);
+            } while (consume(','));
+            expect(close);
+        } else if (open == '"') {
+            stringToken();
+        } else if (open == '-' || (open >= '0' && open <= '9')) {
+            numberToken();
+        } else if (!literal("true") && !literal("false") && !literal("null")) {
+            fail("expected a value");
+        }
+    }
+
+public:
+    explicit JsonCursor(std::string_view text) : text(text) {}
+
+    [[noreturn]] void fail(const char* what) const {
+        throw std::invalid_argument(std::string("Invalid JSON at offset ") + std::to_string(pos) + ": " + what);
+    }
+
+    // Next significant character, or '\0' at the end of the text
+    char peek() {
+        while (pos < text.size() && isSpace(text[pos])) ++pos;
+        return pos < text.size() ? text[pos] : '\0';
+    }
+
+    bool consume(char c) {
+        if (peek() != c) {
+            return false;
+        }
+        ++pos;
+        return true;
+    }
+
+    void expect(char c) {
+        if (!consume(c)) {
+            char what[] = "expected ' '";
+            what[10] = c;
+            fail(what);
+        }
+    }
+
+    bool literal(std::string_view word) {
+        peek();
+        if (text.compare(pos, word.size(), word) != 0) {
+            return false;
+        }
+        pos += word.size();
+        return true;
+    }
+
+    bool atEnd() {
+        return peek() == '\0';
+    }
+
+    // Contents of a string between its quotes, escapes not yet decoded
+    std::string_view stringToken() {
+        expect('"');
+        size_t start = pos;
+        while (pos < text.size() && text[pos] != '"') {
+            if (static_cast<unsigned char>(text[pos]) < 0x20) {
+                fail("control character in string");
+            }
+            pos += text[pos] == '\\' ? 2 : 1;
+        }
+        if (pos >= text.size()) {
+            fail("unterminated string");
+        }
+        return text.substr(start, pos++ - start);
+    }
+
+    std::string_view numberToken() {
+        peek();
+        size_t start = pos;
+        while (pos < text.size() && (std::isdigit(static_cast<unsigned char>(text[pos])) || text[pos] == '-' ||
+                                     text[pos] == '+' || text[pos] == '.' || text[pos] == 'e' || text[pos] == 'E')) {
+            ++pos;
+        }
+        if (pos == start) {
+            fail("expected a number");
+        }
+        return text.substr(start, pos - start);
+    }
+
+    // Raw text of the next value of any type, checked for well-formedness
+    std::string_view skipValue() {
+        peek();
+        size_t start = pos;
+        skipNested(0);
+        return text.substr(start, pos - start);
+    }
+
+    // Call element(cursor) for each element of an array; element must consume exactly one value
+    template <typename Element>
+    void forEachElement(Element element) {
+        expect('[');
+        if (consume(']')) {
+            return;
+        }
+        do {
+            element(*this);
+        } while (consume(','));
+        expect(']');
+    }
+
+    // Decode the escapes of a string token into out
+    static void decodeString(std::string_view raw, std::string& out) {
+        out.clear();
+        out.reserve(raw.size());
+        for (size_t i = 0; i < raw.size(); ++i) {
+            if (raw[i] != '\\') {
+                out += raw[i];
+                continue;
+            }
+            char escaped = ++i < raw.size() ? raw[i] : '\0';
+            switch (escaped) {
+                case '"': case '\\': case '/': out += escaped; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    auto hex = [&](size_t at) {
+                        unsigned value = 0;
+                        if (at + 4 > raw.size() ||
+                            std::from_chars(raw.data() + at, raw.data() + at + 4, value, 16).ptr != raw.data() + at + 4) {
+                            throw std::invalid_argument("Invalid JSON: bad \\u escape");
+                        }
+                        return value;
+                    };
+                    unsigned code = hex(i + 1);
+                    i += 4;
+                    if (code >= 0xD800 && code < 0xDC00 && i + 2 < raw.size() && raw[i + 1] == '\\' && raw[i + 2] == 'u') {
+                        unsigned low = hex(i + 3);
+                        if (low >= 0xDC00 && low < 0xE000) {
+                            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                            i += 6;
+                        }
+                    }
+                    // UTF-8
+                    if (code < 0x80) {
+                        out += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        out += static_cast<char>(0xC0 | (code >> 6));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    } else if (code < 0x10000) {
+                        out += static_cast<char>(0xE0 | (code >> 12));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    } else {
+                        out += static_cast<char>(0xF0 | (code >> 18));
+                        out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default:
+                    throw std::invalid_argument("Invalid JSON: bad escape in string");
+            }
+        }
+    }
+};
+
+// Binds the members of a JSON object straight into typed variables, e.g.
+//
+//     JsonFields().required("id", id).optional("speed", driver.speed).parse(body);
+//
+// Supported targets are int, size_t, double, bool, std::string and
+// std::vector<int>. Numbers may also be sent as numeric strings, and booleans as
+// "true" or "false", as the earlier string-map parser accepted. optional()
+// leaves the target untouched when the member is absent, or binds a
+// std::optional to report whether it was present. Unknown members are skipped.
+// Bindings live in a fixed array, so parsing allocates only for the strings and
+// arrays it stores.
+class JsonFields {
+private:
+    static constexpr size_t kMaxFields = 16;
+
+    struct Binding {
+        std::string_view key;
+        void* target;
+        void (*read)(JsonCursor&, std::string_view key, void* target);
+        bool required;
+        bool seen;
+    };
+
+    std::array<Binding, kMaxFields> bindings;
+    size_t count = 0;
+
+    [[noreturn]] static void wrongType(std::string_view key, const char* expected) {
+        throw std::invalid_argument("Field " + std::string(key) + " must be " + expected);
+    }
+
+    // A number, or a string holding one
+    static std::string_view numberText(JsonCursor& cursor) {
+        return cursor.peek() == '"' ? cursor.stringToken() : cursor.numberToken();
+    }
+
+    template <typename Number>
+    static void readNumber(JsonCursor& cursor, std::string_view key, Number& target, const char* expected) {
+        if (cursor.literal("null")) {
+            wrongType(key, expected);
+        }
+        std::string_view text = numberText(cursor);
+        const char* end = text.data() + text.size();
+        auto parsed = std::from_chars(text.data(), end, target);
+        if (parsed.ec != std::errc() || parsed.ptr != end) {
+            wrongType(key, expected);
+        }
+    }
+
+    static void readValue(JsonCursor& cursor, std::string_view key, int& target) {
+        readNumber(cursor, key, target, "an integer");
+    }
+
+    static void readValue(JsonCursor& cursor, std::string_view key, size_t& target) {
+        readNumber(cursor, key, target, "a non-negative integer");
+    }
+
+    static void readValue(JsonCursor& cursor, std::string_view key, double& target) {
+        readNumber(cursor, key, target, "a number");
+        if (!std::isfinite(target)) {
+            wrongType(key, "a finite number");
+        }
+    }
+
+    static void readValue(JsonCursor& cursor, std::string_view key, bool& target) {
+        if (cursor.literal("true")) {
+            target = true;
+        } else if (cursor.literal("false")) {
+            target = false;
+        } else if (cursor.peek() == '"') {
+            std::string_view text = cursor.stringToken();
+            if (text != "true" && text != "false") {
+                wrongType(key, "true or false");
+            }
+            target = text == "true";
+        } else {
+            wrongType(key, "true or false");
+        }
+    }
+
+    static void readValue(JsonCursor& cursor, std::string_view key, std::string& target) {
+        if (cursor.peek() != '"') {
+            wrongType(key, "a string");
+        }
+        JsonCursor::decodeString(cursor.stringToken(), target);
+    }
+
+    static void readValue(JsonCursor& cursor, std::string_view key, std::vector<int>& target) {
+        if (cursor.peek() != '[') {
+            wrongType(key, "an array of integers");
+        }
+        target.clear();
+        cursor.forEachElement([&](JsonCursor& element) {
+            target.push_back(0);
+            readNumber(element, key, target.back(), "an array of integers");
+        });
+    }
+
+    template <typename T>
+    static void readInto(JsonCursor& cursor, std::string_view key, void* target) {
+        readValue(cursor, key, *static_cast<T*>(target));
+    }
+
+    template <typename T>
+    static void readOptional(JsonCursor& cursor, std::string_view key, void* target) {
+        auto& value = *static_cast<std::optional<T>*>(target);
+        value.emplace();
+        readValue(cursor, key, *value);
+    }
+
+    JsonFields& bind(std::string_view key, void* target, void (*read)(JsonCursor&, std::string_view, void*), bool required) {
+        if (count == kMaxFields) {
+            throw std::logic_error("Too many JSON fields bound");
+        }
+        bindings[count++] = Binding{key, target, read, required, false};
+        return *this;
+    }
+
+public:
+    template <typename T>
+    JsonFields& required(std::string_view key, T& target) {
+        return bind(key, &target, &readInto<T>, true);
+    }
+
+    template <typename T>
+    JsonFields& optional(std::string_view key, T& target) {
+        return bind(key, &target, &readInto<T>, false);
+    }
+
+    template <typename T>
+    JsonFields& optional(std::string_view key, std::optional<T>& target) {
+        target.reset();
+        return bind(key, &target, &readOptional<T>, false);
+    }
+
+    // Parse a JSON object into the bound targets. Keys are matched without
+    // decoding escapes; a repeated key binds its last value.
+    void parse(std::string_view body) {
+        JsonCursor cursor(body);
+        cursor.expect('{');
+        if (!cursor.consume('}')) {
+            do {
+                std::string_view key = cursor.stringToken();
+                cursor.expect(':');
+                Binding* match = nullptr;
+                for (size_t i = 0; i < count && !match; ++i) {
+                    if (bindings[i].key == key) match = &bindings[i];
+                }
+                if (match) {
+                    match->read(cursor, match->key, match->target);
+                    match->seen = true;
+                } else {
+                    cursor.skipValue();
+                }
+            } while (cursor.consume(','));
+            cursor.expect('}');
+        }
+        if (!cursor.atEnd()) {
+            cursor.fail("trailing characters");
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (bindings[i].required && !bindings[i].seen) {
+                throw std::invalid_argument("Missing field: " + std::string(bindings[i].key));
+            }
+        }
+    }
+};
+
+// Writes JSON into one growable buffer. Commas between members and elements
+// are inserted automatically, numbers are formatted with std::to_chars
+// (non-finite doubles become null), and strings are escaped in place. A
+// response opened with beginResponse() has its status line and headers in the
+// same buffer, ahead of the body; finishResponse() fills in Content-Length, so
+// the finished response is never copied.
+class JsonWriter {
+private:
+    static constexpr size_t kMaxDepth = 32;
+    static constexpr size_t kLengthWidth = 12;     // space-padded Content-Length digits
+
+    std::string out;
+    std::array<bool, kMaxDepth> hasElements{};     // per open container
+    size_t depth = 0;
+    bool afterKey = false;
+    size_t lengthField = std::string::npos;
+    size_t bodyStart = 0;
+
+    void separate() {
+        if (afterKey) {
+            afterKey = false;
+        } else if (depth > 0) {
+            if (hasElements[depth - 1]) out += ',';
+            hasElements[depth - 1] = true;
+        }
+    }
+
+    JsonWriter& open(char bracket) {
+        if (depth == kMaxDepth) {
+            throw std::logic_error("JSON nested too deeply");
+        }
+        separate();
+        out += bracket;
+        hasElements[depth++] = false;
+        return *this;
+    }
+
+    JsonWriter& close(char bracket) {
+        --depth;
+        out += bracket;
+        return *this;
+    }
+
+    template <typename Number>
+    JsonWriter& number(Number value) {
+        separate();
+        char digits[32];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        out.append(digits, result.ptr - digits);
+        return *this;
+    }
+
+public:
+    JsonWriter() = default;
+
+    explicit JsonWriter(size_t capacity) {
+        out.reserve(capacity);
+    }
+
+    void reserve(size_t bytes) {
+        out.reserve(out.size() + bytes);
+    }
+
+    JsonWriter& beginObject() { return open('{'); }
+    JsonWriter& endObject() { return close('}'); }
+    JsonWriter& beginArray() { return open('['); }
+    JsonWriter& endArray() { return close(']'); }
+
+    // Member name inside an object; the next value written is its value
+    JsonWriter& key(std::string_view name) {
+        separate();
+        out += '"';
+        appendEscapedJson(out, name);
+        out += "\":";
+        afterKey = true;
+        return *this;
+    }
+
+    template <typename Integer,
+              typename std::enable_if<std::is_integral<Integer>::value && !std::is_same<Integer, bool>::value, int>::type = 0>
+    JsonWriter& value(Integer integer) {
+        return number(integer);
+    }
+
+    JsonWriter& value(double real) {
+        if (!std::isfinite(real)) {
+            return null();
+        }
+        return number(real);
+    }
+
+    JsonWriter& value(bool flag) {
+        separate();
+        out += flag ? "true" : "false";
+        return *this;
+    }
+
+    JsonWriter& value(std::string_view text) {
+        separate();
+        out += '"';
+        appendEscapedJson(out, text);
+        out += '"';
+        return *this;
+    }
+
+    JsonWriter& value(const char* text) {
+        return value(std::string_view(text));
+    }
+
+    JsonWriter& null() {
+        separate();
+        out += "null";
+        return *this;
+    }
+
+    template <typename T>
+    JsonWriter& member(std::string_view name, const T& memberValue) {
+        return key(name).value(memberValue);
+    }
+
+    template <typename T>
+    JsonWriter& array(const std::vector<T>& values) {
+        beginArray();
+        for (const T& element : values) {
+            value(element);
+        }
+        return endArray();
+    }
+
+    // Status line and headers (each ending in CRLF) of a JSON response; write the body next
+    void beginResponse(std::string_view status, std::string_view headers) {
+        out.clear();
+        out += "HTTP/1.1 ";
+        out += status;
+        out += "\r\n";
+        out += headers;
+        out += "Content-Type: application/json\r\nContent-Length:";
+        lengthField = out.size();
+        out.append(kLengthWidth, ' ');
+        out += "\r\n\r\n";
+        bodyStart = out.size();
+    }
+
+    // The complete response, leaving the writer empty
+    std::string finishResponse() {
+        char digits[kLengthWidth];
+        auto result = std::to_chars(digits, digits + sizeof(digits), out.size() - bodyStart);
+        size_t length = result.ptr - digits;
+        out.replace(lengthField + kLengthWidth - length, length, digits, length);
+        lengthField = std::string::npos;
+        std::string response;
+        response.swap(out);
+        return response;
+    }
+
+    std::string_view body() const {
+        return std::string_view(out).substr(bodyStart);
+    }
+
+    // The JSON written so far, leaving the writer empty
+    std::string take() {
+        std::string json;
+        json.swap(out);
+        return json;
+    }
+};
+
+// Process-wide counters for the /metrics endpoint, in Prometheus text format.
+// Every recording thread gets its own shard of counters that only it writes,
+// with relaxed loads and stores, so recording takes no lock and never
+// contends with other threads; a scrape sums the shards. Histograms are
+// log-linear: bucket bounds run 1, 2, 3, 4, 6, 8, 12, 16, ... (two per power of two).
+class Metrics {
+public:
+    // Searches whose settled-node counts are tracked
+    enum class Search { Dijkstra, AStar, ContractionHierarchy, OneToMany, Count };
+
+private:
+    static constexpr size_t kBounds = 50;                  // up to 2^25, ~33 s in microseconds
+    static constexpr const char* kRoutes[] = {
+        "/api/locations", "/api/orders", "/api/orders/assign", "/api/orders/complete", "/api/drivers",
+        "/api/drivers/limits", "/api/drivers/route", "/api/edges", "/api/route", "/api/matrix",
+        "/api/dispatch", "/api/dispatch/flush", "/api/dispatch/regions", "/api/stats/statements",
+        "/api/stats/queries", "/api/trace", "/api/events", "/metrics", "static", "other"};
+    static constexpr size_t kRouteCount = sizeof(kRoutes) / sizeof(kRoutes[0]);
+    static constexpr const char* kMethods[] = {"GET", "POST", "PUT", "DELETE", "OPTIONS", "other"};
+    static constexpr size_t kMethodCount = sizeof(kMethods) / sizeof(kMethods[0]);
+    static constexpr int kStatuses[] = {200, 201, 204, 400, 404, 405, 413, 500, 503, 0};     // 0 = other
+    static constexpr size_t kStatusCount = sizeof(kStatuses) / sizeof(kStatuses[0]);
+    static constexpr const char* kSearchNames[] = {"dijkstra", "astar", "ch", "one_to_many"};
+    static constexpr size_t kSearchCount = static_cast<size_t>(Search::Count);
+
+    static const std::array<uint64_t, kBounds>& bounds() {
+        static const std::array<uint64_t, kBounds> values = [] {
+            std::array<uint64_t, kBounds> result{};
+            uint64_t power = 1;
+            result[0] = 1;
+            for (size_t i = 1; i < kBounds; i += 2) {
+                power *= 2;
+                result[i] = power;
+                if (i + 1 < kBounds) result[i + 1] = power + power / 2;
+            }
+            return result;
+        }();
+        return values;
+    }
+
+    // Written only by the shard's thread
+    static void bump(std::atomic<uint64_t>& cell, uint64_t amount) {
+        cell.store(cell.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    struct Histogram {
+        std::array<std::atomic<uint64_t>, kBounds + 1> buckets{};  // the last is above every bound
+        std::atomic<uint64_t> sum{0};
+
+        void record(uint64_t value) {
+            const auto& limits = bounds();
+            size_t bucket = std::lower_bound(limits.begin(), limits.end(), value) - limits.begin();
+            bump(buckets[bucket], 1);
+            bump(sum, value);
+        }
+    };
+
+    // Plain copy of a histogram, for summing shards
+    struct Totals {
+        std::array<uint64_t, kBounds + 1> buckets{};
+        uint64_t sum = 0;
+        uint64_t count = 0;
+
+        void add(const Histogram& histogram) {
+            for (size_t i = 0; i <= kBounds; ++i) {
+                uint64_t value = histogram.buckets[i].load(std::memory_order_relaxed);
+                buckets[i] += value;
+                count += value;
+            }
+            sum += histogram.sum.load(std::memory_order_relaxed);
+        }
+    };
+
+    struct Shard {
+        // Request histograms by (route, method, status), created by the owning thread on first use
+        std::array<std::atomic<Histogram*>, kRouteCount * kMethodCount * kStatusCount> requests{};
+        std::atomic<int64_t> inFlight{0};
+        Histogram statementMicros;
+        std::array<Histogram, kSearchCount> settledNodes;
+        Histogram candidatesScored;
+
+        ~Shard() {
+            for (auto& histogram : requests) {
+                delete histogram.load();
+            }
+        }
+    };
+
+    std::mutex registryMutex;       // only taken when a thread first records, and by scrapes
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    Shard& local() {
+        static thread_local Shard* shard = nullptr;
+        if (!shard) {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            shards.emplace_back(new Shard());
+            shard = shards.back().get();
+        }
+        return *shard;
+    }
+
+    static size_t routeIndex(const std::string& path) {
+        std::string route = path.substr(0, path.find('?'));
+        if (route.compare(0, 5, "/api/") != 0 && route != "/metrics") {
+            return kRouteCount - 2;     // static files
+        }
+        for (size_t i = 0; i < kRouteCount - 2; ++i) {
+            if (route == kRoutes[i]) return i;
+        }
+        return kRouteCount - 1;
+    }
+
+    static size_t methodIndex(const std::string& method) {
+        for (size_t i = 0; i < kMethodCount - 1; ++i) {
+            if (method == kMethods[i]) return i;
+        }
+        return kMethodCount - 1;
+    }
+
+    // Status code from a response's status line
+    static size_t statusIndex(const std::string& response) {
+        int code = response.size() >= 12 ? std::atoi(response.c_str() + 9) : 0;
+        for (size_t i = 0; i < kStatusCount - 1; ++i) {
+            if (code == kStatuses[i]) return i;
+        }
+        return kStatusCount - 1;
+    }
+
+    // Shortest decimal that reads back as value, so bucket labels name their bounds exactly
+    static void writeNumber(std::ostream& out, double value) {
+        char text[32];
+        auto result = std::to_chars(text, text + sizeof(text), value);
+        out.write(text, result.ptr - text);
+    }
+
+    static void writeHistogram(std::ostream& out, const std::string& name, const std::string& labels,
+                               const Totals& totals, double scale) {
+        std::string separator = labels.empty() ? "" : ",";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < kBounds; ++i) {
+            cumulative += totals.buckets[i];
+            out << name << "_bucket{" << labels << separator << "le=\"";
+            writeNumber(out, bounds()[i] * scale);
+            out << "\"} " << cumulative << "\n";
+        }
+        out << name << "_bucket{" << labels << separator << "le=\"+Inf\"} " << totals.count << "\n";
+        std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        out << name << "_sum" << braces << " ";
+        writeNumber(out, totals.sum * scale);
+        out << "\n";
+        out << name << "_count" << braces << " " << totals.count << "\n";
+    }
+
+public:
+    // Counts a request as in flight for its lifetime
+    class InFlight {
+    private:
+        std::atomic<int64_t>& gauge;
+
+    public:
+        explicit InFlight(Metrics& metrics) : gauge(metrics.local().inFlight) {
+            gauge.store(gauge.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        ~InFlight() {
+            gauge.store(gauge.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        }
+        InFlight(const InFlight&) = delete;
+        InFlight& operator=(const InFlight&) = delete;
+    };
+
+    void recordRequest(const std::string& method, const std::string& path, const std::string& response,
+                       std::chrono::steady_clock::duration elapsed) {
+        Shard& shard = local();
+        size_t slot = (routeIndex(path) * kMethodCount + methodIndex(method)) * kStatusCount + statusIndex(response);
+        Histogram* histogram = shard.requests[slot].load(std::memory_order_acquire);
+        if (!histogram) {
+            histogram = new Histogram();
+            shard.requests[slot].store(histogram, std::memory_order_release);
+        }
+        histogram->record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+
+    void recordStatement(std::chrono::steady_clock::duration elapsed) {
+        local().statementMicros.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+
+    void recordSettledNodes(Search search, size_t nodes) {
+        local().settledNodes[static_cast<size_t>(search)].record(nodes);
+    }
+
+    void recordCandidatesScored(size_t drivers) {
+        local().candidatesScored.record(drivers);
+    }
+
+    // Every metric in Prometheus text exposition format
+    std::string render() {
+        std::vector<Totals> requests(kRouteCount * kMethodCount * kStatusCount);
+        Totals statements, candidates;
+        std::vector<Totals> settled(kSearchCount);
+        int64_t inFlight = 0;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            for (const auto& shard : shards) {
+                for (size_t slot = 0; slot < requests.size(); ++slot) {
+                    Histogram* histogram = shard->requests[slot].load(std::memory_order_acquire);
+                    if (histogram) requests[slot].add(*histogram);
+                }
+                inFlight += shard->inFlight.load(std::memory_order_relaxed);
+                statements.add(shard->statementMicros);
+                for (size_t i = 0; i < kSearchCount; ++i) {
+                    settled[i].add(shard->settledNodes[i]);
+                }
+                candidates.add(shard->candidatesScored);
+            }
+        }
+
+        auto labelsOf = [](size_t slot) {
+            size_t status = slot % kStatusCount;
+            size_t method = slot / kStatusCount % kMethodCount;
+            size_t route = slot / kStatusCount / kMethodCount;
+            return std::string("route=\"") + kRoutes[route] + "\",method=\"" + kMethods[method] + "\",status=\"" +
+                   (kStatuses[status] ? std::to_string(kStatuses[status]) : std::string("other")) + "\"";
+        };
+
+        std::ostringstream out;
+        out << "# HELP delivery_http_requests_total HTTP requests handled.\n"
+            << "# TYPE delivery_http_requests_total counter\n";
+        for (size_t slot = 0; slot < requests.size(); ++slot) {
+            if (requests[slot].count > 0) {
+                out << "delivery_http_requests_total{" << labelsOf(slot) << "} " << requests[slot].count << "\n";
+            }
+        }
+        out << "# HELP delivery_http_requests_in_flight HTTP requests being handled.\n"
+            << "# TYPE delivery_http_requests_in_flight gauge\n"
+            << "delivery_http_requests_in_flight " << inFlight << "\n";
+        out << "# HELP delivery_http_request_duration_seconds Time spent in the request handler.\n"
+            << "# TYPE delivery_http_request_duration_seconds histogram\n";
+        for (size_t slot = 0; slot < requests.size(); ++slot) {
+            if (requests[slot].count > 0) {
+                writeHistogram(out, "delivery_http_request_duration_seconds", labelsOf(slot), requests[slot], 1e-6);
+            }
+        }
+        out << "# HELP delivery_sqlite_statement_duration_seconds Time a prepared statement is in use, from acquire to reset.\n"
+            << "# TYPE delivery_sqlite_statement_duration_seconds histogram\n";
+        writeHistogram(out, "delivery_sqlite_statement_duration_seconds", "", statements, 1e-6);
+        out << "# HELP delivery_route_settled_nodes Nodes settled per road-network search.\n"
+            << "# TYPE delivery_route_settled_nodes histogram\n";
+        for (size_t i = 0; i < kSearchCount; ++i) {
+            writeHistogram(out, "delivery_route_settled_nodes", std::string("search=\"") + kSearchNames[i] + "\"", settled[i], 1);
+        }
+        out << "# HELP delivery_dispatch_candidates_scored Drivers scored per order per dispatch attempt.\n"
+            << "# TYPE delivery_dispatch_candidates_scored histogram\n";
+        writeHistogram(out, "delivery_dispatch_candidates_scored", "", candidates, 1);
+        return out.str();
+    }
+};
+
+// Never destroyed, so threads still running at exit can keep recording
+inline Metrics& metrics() {
+    static Metrics* instance = new Metrics();
+    return *instance;
+}
+
+// Sampled tracing of nested spans, exported as Chrome trace-event JSON (open in
+// Perfetto or chrome://tracing). A span opened with no span already open on
+// its thread starts a trace, which is kept with the configured probability;
+// spans nested inside it follow that decision. When a trace is not sampled, a
+// span costs a thread-local check. Finished spans go to a ring buffer owned by
+// the recording thread, so recording never waits on other threads; only a dump
+// reads the buffers.
+class Tracer;
+Tracer& tracer();
+
+class Tracer {
+private:
+    static constexpr size_t kBufferSpans = 4096;        // per thread; the oldest are overwritten
+    static constexpr size_t kDetailLength = 64;
+
+    struct Event {
+        const char* name;                                // string literal
+        char detail[kDetailLength];
+        uint64_t trace;
+        int64_t startNs;
+        int64_t durationNs;
+    };
+
+    struct Buffer {
+        std::mutex mutex;                                // uncontended except during a dump
+        std::vector<Event> events;
+        size_t next = 0;
+        int threadId;
+    };
+
+    struct ThreadState {
+        Buffer* buffer = nullptr;
+        int depth = 0;
+        bool sampled = false;
+        uint64_t trace = 0;
+        uint64_t random = 0;
+    };
+
+    std::atomic<uint32_t> ratePerMillion{0};
+    std::atomic<uint64_t> nextTrace{1};
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex registryMutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+
+    static ThreadState& state() {
+        static thread_local ThreadState current;
+        return current;
+    }
+
+    bool sample(ThreadState& current) {
+        uint32_t rate = ratePerMillion.load(std::memory_order_relaxed);
+        if (rate == 0) {
+            return false;
+        }
+        if (current.random == 0) {
+            current.random = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+        }
+        // xorshift64
+        current.random ^= current.random << 13;
+        current.random ^= current.random >> 7;
+        current.random ^= current.random << 17;
+        return current.random % 1000000 < rate;
+    }
+
+    int64_t sinceEpoch(std::chrono::steady_clock::time_point time) const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time - epoch).count();
+    }
+
+    void record(ThreadState& current, const char* name, const char* detail, size_t detailLength,
+                std::chrono::steady_clock::time_point start) {
+        auto end = std::chrono::steady_clock::now();
+        if (!current.buffer) {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            buffers.emplace_back(new Buffer());
+            current.buffer = buffers.back().get();
+            current.buffer->threadId = static_cast<int>(buffers.size());
+            current.buffer->events.resize(kBufferSpans);
+        }
+        Buffer& buffer = *current.buffer;
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        Event& event = buffer.events[buffer.next % kBufferSpans];
+        buffer.next++;
+        event.name = name;
+        size_t length = std::min(detailLength, kDetailLength - 1);
+        std::memcpy(event.detail, detail, length);
+        event.detail[length] = '\0';
+        event.trace = current.trace;
+        event.startNs = sinceEpoch(start);
+        event.durationNs = sinceEpoch(end) - event.startNs;
+    }
+
+public:
+    // Traces a scope. name must outlive the tracer (use a string literal).
+    class Span {
+    private:
+        const char* name;
+        std::string detailText;
+        std::chrono::steady_clock::time_point start;
+        bool recording;
+
+    public:
+        explicit Span(const char* name) : name(name) {
+            open();
+        }
+
+        // A span about one entity, e.g. an order or driver ID
+        Span(const char* name, long long id) : name(name) {
+            open();
+            if (recording) {
+                detailText = std::to_string(id);
+            }
+        }
+
+        ~Span() {
+            ThreadState& current = state();
+            if (recording) {
+                tracer().record(current, name, detailText.data(), detailText.size(), start);
+            }
+            current.depth--;
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+        bool active() const {
+            return recording;
+        }
+
+        // Free-form annotation shown with the span, e.g. a path or an ID
+        void detail(const std::string& text) {
+            if (recording) {
+                detailText = text;
+            }
+        }
+
+    private:
+        void open() {
+            ThreadState& current = state();
+            if (current.depth++ == 0) {
+                current.sampled = tracer().sample(current);
+                if (current.sampled) {
+                    current.trace = tracer().nextTrace.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            recording = current.sampled;
+            if (recording) {
+                start = std::chrono::steady_clock::now();
+            }
+        }
+    };
+
+    // Record a finished span that could not be scoped, if its thread's trace is sampled
+    void recordSpan(const char* name, const char* detail, std::chrono::steady_clock::time_point start) {
+        ThreadState& current = state();
+        if (current.depth > 0 && current.sampled) {
+            record(current, name, detail, detail ? std::strlen(detail) : 0, start);
+        }
+    }
+
+    // Probability in [0, 1] that a new trace is recorded
+    void setRate(double rate) {
+        rate = std::min(1.0, std::max(0.0, rate));
+        ratePerMillion.store(static_cast<uint32_t>(rate * 1000000 + 0.5), std::memory_order_relaxed);
+    }
+
+    double rate() const {
+        return ratePerMillion.load(std::memory_order_relaxed) / 1000000.0;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (auto& buffer : buffers) {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            buffer->next = 0;
+        }
+    }
+
+    // Every buffered span in Chrome trace-event format
+    std::string dumpJson() {
+        std::ostringstream json;
+        json << std::fixed << std::setprecision(3); // microseconds
+        json << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (auto& buffer : buffers) {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            size_t count = std::min(buffer->next, kBufferSpans);
+            for (size_t i = buffer->next - count; i < buffer->next; ++i) {
+                const Event& event = buffer->events[i % kBufferSpans];
+                json << (first ? "" : ",") << "\n{\"name\":\"" << escape_json(event.name) << "\""
+                     << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+                     << ",\"ts\":" << event.startNs / 1000.0 << ",\"dur\":" << event.durationNs / 1000.0
+                     << ",\"args\":{\"trace\":" << event.trace;
+                if (event.detail[0]) {
+                    json << ",\"detail\":\"" << escape_json(event.detail) << "\"";
+                }
+                json << "}}";
+                first = false;
+            }
+        }
+        json << "\n]}";
+        return json.str();
+    }
+};
+
+// Never destroyed, so threads still running at exit can keep recording
+inline Tracer& tracer() {
+    static Tracer* instance = new Tracer();
+    return *instance;
+}
+
+// Fixed-size pool of worker threads fed from a shared FIFO task queue
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex queueMutex;
+    std::condition_variable queueCv;
+    bool stopping = false;
+
+    void workerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    // A thread count of 0 means one worker per hardware thread
+    explicit ThreadPool(size_t threadCount = 0) {
+        if (threadCount == 0) {
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i < threadCount; ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueCv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    void enqueue(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            tasks.push_back(std::move(task));
+        }
+        queueCv.notify_one();
+    }
+
+    // Run a callable on the pool and get its result through a future
+    template <typename F>
+    auto submit(F&& func) -> std::future<decltype(func())> {
+        auto task = std::make_shared<std::packaged_task<decltype(func())()>>(std::forward<F>(func));
+        auto result = task->get_future();
+        enqueue([task] { (*task)(); });
+        return result;
+    }
+};
+
+// Close a socket on any platform
+inline void closeSocket(int fd) {
+#ifdef _WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Case-insensitive ASCII comparison for header names and tokens
+inline bool iequals(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Incremental HTTP/1.x request framer. Bytes are appended to a connection buffer
+// and parse() pulls complete requests off its front, so pipelined requests are
+// handled one after another. Bodies are framed by Content-Length or chunked encoding.
+class HttpRequestParser {
+public:
+    enum class Status { Incomplete, Complete, BadRequest, PayloadTooLarge };
+
+    struct Request {
+        std::string method;
+        std::string path;
+        std::string body;
+        std::string lastEventId;    // sent by EventSource clients when they reconnect
+        bool keepAlive = true;
+    };
+
+    // Requests whose headers grow past this are rejected
+    static constexpr size_t kMaxHeaderBytes = 64 * 1024;
+
+    explicit HttpRequestParser(size_t maxBodySize = 8 * 1024 * 1024) : maxBodySize(maxBodySize) {}
+
+    // On Complete, the request is moved into `request` and its bytes are removed from `buffer`
+    Status parse(std::string& buffer, Request& request) {
+        if (!haveHeaders) {
+            Status status = parseHeaders(buffer);
+            if (status != Status::Complete) {
+                return status;
+            }
+        }
+
+        size_t consumed = 0;
+        if (chunked) {
+            Status status = decodeChunks(buffer, consumed);
+            if (status != Status::Complete) {
+                return status;
+            }
+        } else {
+            if (buffer.size() - headerLength < contentLength) {
+                return Status::Incomplete;
+            }
+            current.body.assign(buffer, headerLength, contentLength);
+            consumed = headerLength + contentLength;
+        }
+
+        buffer.erase(0, consumed);
+        request = std::move(current);
+        reset();
+        return Status::Complete;
+    }
+
+    // True once the headers of a request asking for "Expect: 100-continue" have been read
+    // and its body has not arrived yet. Cleared by acknowledgeContinue().
+    bool wantsContinue() const {
+        return haveHeaders && expectContinue;
+    }
+
+    void acknowledgeContinue() {
+        expectContinue = false;
+    }
+
+private:
+    enum class ChunkState { Size, Data, DataEnd, Trailers };
+
+    size_t maxBodySize;
+    bool haveHeaders = false;
+    size_t headerLength = 0;
+    size_t contentLength = 0;
+    bool chunked = false;
+    bool expectContinue = false;
+    Request current;
+
+    ChunkState chunkState = ChunkState::Size;
+    size_t chunkOffset = 0;     // next unread byte of the buffer while decoding chunks
+    size_t chunkRemaining = 0;
+
+    void reset() {
+        haveHeaders = false;
+        headerLength = 0;
+        contentLength = 0;
+        chunked = false;
+        expectContinue = false;
+        current = Request();
+        chunkState = ChunkState::Size;
+        chunkOffset = 0;
+        chunkRemaining = 0;
+    }
+
+    static std::string trim(const std::string& s) {
+        size_t begin = s.find_first_not_of(" \t");
+        if (begin == std::string::npos) return "";
+        size_t end = s.find_last_not_of(" \t");
+        return s.substr(begin, end - begin + 1);
+    }
+
+    Status parseHeaders(const std::string& buffer) {
+        // Tolerate stray CRLFs between pipelined requests
+        size_t start = 0;
+        while (start + 1 < buffer.size() && buffer[start] == '\r' && buffer[start + 1] == '\n') {
+            start += 2;
+        }
+
+        size_t header_end = buffer.find("\r\n\r\n", start);
+        if (header_end == std::string::npos) {
+            return buffer.size() > kMaxHeaderBytes ? Status::BadRequest : Status::Incomplete;
+        }
+
+        size_t line_end = buffer.find("\r\n", start);
+        std::string requestLine = buffer.substr(start, line_end - start);
+        size_t method_end = requestLine.find(' ');
+        if (method_end == std::string::npos) {
+            return Status::BadRequest;
+        }
+        size_t path_end = requestLine.find(' ', method_end + 1);
+        if (path_end == std::string::npos) {
+            return Status::BadRequest;
+        }
+        current.method = requestLine.substr(0, method_end);
+        current.path = requestLine.substr(method_end + 1, path_end - method_end - 1);
+        std::string version = requestLine.substr(path_end + 1);
+        current.keepAlive = (version != "HTTP/1.0");
+
+        bool haveContentLength = false;
+        size_t pos = line_end + 2;
+        while (pos < header_end + 2) {
+            size_t next = buffer.find("\r\n", pos);
+            std::string line = buffer.substr(pos, next - pos);
+            pos = next + 2;
+
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                return Status::BadRequest;
+            }
+            std::string name = line.substr(0, colon);
+            std::string value = trim(line.substr(colon + 1));
+
+            if (iequals(name, "Content-Length")) {
+                if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.size() > 18) {
+                    return Status::BadRequest;
+                }
+                size_t length = std::stoull(value);
+                if (haveContentLength && length != contentLength) {
+                    return Status::BadRequest;
+                }
+                contentLength = length;
+                haveContentLength = true;
+            } else if (iequals(name, "Transfer-Encoding")) {
+                if (!iequals(value, "chunked")) {
+                    return Status::BadRequest; // Only chunked is supported
+                }
+                chunked = true;
+            } else if (iequals(name, "Connection")) {
+                if (iequals(value, "close")) {
+                    current.keepAlive = false;
+                } else if (iequals(value, "keep-alive")) {
+                    current.keepAlive = true;
+                }
+            } else if (iequals(name, "Expect")) {
+                expectContinue = iequals(value, "100-continue");
+            } else if (iequals(name, "Last-Event-ID")) {
+                current.lastEventId = value;
+            }
+        }
+
+        // A message with both framings is ambiguous (request smuggling); refuse it
+        if (chunked && haveContentLength) {
+            return Status::BadRequest;
+        }
+        if (contentLength > maxBodySize) {
+            return Status::PayloadTooLarge;
+        }
+
+        headerLength = header_end + 4;
+        chunkOffset = headerLength;
+        haveHeaders = true;
+        return Status::Complete;
+    }
+
+    Status decodeChunks(const std::string& buffer, size_t& consumed) {
+        while (true) {
+            if (chunkState == ChunkState::Size) {
+                size_t line_end = buffer.find("\r\n", chunkOffset);
+                if (line_end == std::string::npos) {
+                    return buffer.size() - chunkOffset > 1024 ? Status::BadRequest : Status::Incomplete;
+                }
+                std::string sizeLine = buffer.substr(chunkOffset, line_end - chunkOffset);
+                size_t extension = sizeLine.find(';');
+                if (extension != std::string::npos) {
+                    sizeLine.erase(extension);
+                }
+                sizeLine = trim(sizeLine);
+                if (sizeLine.empty() || sizeLine.size() > 15 ||
+                    sizeLine.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+                    return Status::BadRequest;
+                }
+                chunkRemaining = std::stoull(sizeLine, nullptr, 16);
+                chunkOffset = line_end + 2;
+                if (current.body.size() + chunkRemaining > maxBodySize) {
+                    return Status::PayloadTooLarge;
+                }
+                chunkState = chunkRemaining == 0 ? ChunkState::Trailers : ChunkState::Data;
+            } else if (chunkState == ChunkState::Data) {
+                size_t available = std::min(chunkRemaining, buffer.size() - chunkOffset);
+                current.body.append(buffer, chunkOffset, available);
+                chunkOffset += available;
+                chunkRemaining -= available;
+                if (chunkRemaining > 0) {
+                    return Status::Incomplete;
+                }
+                chunkState = ChunkState::DataEnd;
+            } else if (chunkState == ChunkState::DataEnd) {
+                if (buffer.size() - chunkOffset < 2) {
+                    return Status::Incomplete;
+                }
+                if (buffer.compare(chunkOffset, 2, "\r\n") != 0) {
+                    return Status::BadRequest;
+                }
+                chunkOffset += 2;
+                chunkState = ChunkState::Size;
+            } else {
+                // Trailer fields are ignored; the message ends at the first empty line
+                size_t line_end = buffer.find("\r\n", chunkOffset);
+                if (line_end == std::string::npos) {
+                    return buffer.size() - chunkOffset > kMaxHeaderBytes ? Status::BadRequest : Status::Incomplete;
+                }
+                bool emptyLine = (line_end == chunkOffset);
+                chunkOffset = line_end + 2;
+                if (emptyLine) {
+                    consumed = chunkOffset;
+                    return Status::Complete;
+                }
+            }
+        }
+    }
+};
+
+// Recent changes to the delivery state, for clients that follow them as
+// server-sent events instead of polling. Each change is formatted once into an
+// SSE frame and shared by every subscriber. Sequence numbers double as resume
+// tokens: they start from the wall-clock time in microseconds, so a token from
+// an earlier run of the server is always older than anything retained, and a
+// client resuming from a change no longer retained is told to reload instead.
+// Changes are formatted and retained only while a stream is subscribed; with
+// none, a change just advances the sequence, so any client that resumes from
+// before it is told to reload.
+class ChangeFeed {
+private:
+    static constexpr size_t kRetained = 4096;
+
+    mutable std::mutex mutex;
+    mutable std::condition_variable changed;
+    std::deque<std::string> frames;         // frames[i] has sequence firstSequence + i
+    uint64_t firstSequence;
+    std::function<void()> listener;
+    std::atomic<bool> recording{false};     // a listener is attached and a stream is subscribed
+    size_t subscribers = 0;
+
+    uint64_t latestLocked() const {
+        return firstSequence + frames.size() - 1;
+    }
+
+    // Drop what is retained and advance the sequence past an unrecorded change
+    void skipLocked() {
+        firstSequence = latestLocked() + 2;
+        frames.clear();
+    }
+
+public:
+    ChangeFeed()
+        : firstSequence(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::system_clock::now().time_since_epoch()).count()) {}
+
+    ChangeFeed(const ChangeFeed&) = delete;
+    ChangeFeed& operator=(const ChangeFeed&) = delete;
+
+    // Called, with the feed locked, after every change; keep it short. An empty function detaches.
+    void setListener(std::function<void()> callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        listener = std::move(callback);
+        recording = listener && subscribers > 0;
+    }
+
+    // Streams call these as they open and close
+    void subscribe() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++subscribers;
+        recording = static_cast<bool>(listener);
+    }
+
+    void unsubscribe() {
+        std::lock_guard<std::mutex> lock(mutex);
+        recording = listener && --subscribers > 0;
+    }
+
+    // Cheap check for publishers, so a change is not formatted when nothing records it
+    bool active() const {
+        return recording.load(std::memory_order_relaxed);
+    }
+
+    // Count a change that is not recorded, so tokens from before it get a reset
+    void skip() {
+        std::lock_guard<std::mutex> lock(mutex);
+        skipLocked();
+    }
+
+    // Record a change; data is a single-line JSON object
+    void publish(std::string_view type, std::string_view data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!recording) {
+            skipLocked();
+            return;
+        }
+        std::string frame;
+        frame.reserve(32 + type.size() + data.size());
+        frame += "id: ";
+        frame += std::to_string(latestLocked() + 1);
+        frame += "\nevent: ";
+        frame += type;
+        frame += "\ndata: ";
+        frame += data;
+        frame += "\n\n";
+        frames.push_back(std::move(frame));
+        if (frames.size() > kRetained) {
+            frames.pop_front();
+            firstSequence++;
+        }
+        listener();
+        changed.notify_all();
+    }
+
+    // Sequence of the newest change; a new subscriber starts here
+    uint64_t latest() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return latestLocked();
+    }
+
+    // Append the frames of every change after cursor to out and advance cursor.
+    // If changes after cursor are no longer retained (or cursor is not a token
+    // of this feed), a "reset" frame is appended instead. Returns whether
+    // anything was appended.
+    bool appendSince(uint64_t& cursor, std::string& out) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t latest = latestLocked();
+        if (cursor == latest) {
+            return false;
+        }
+        if (cursor + 1 < firstSequence || cursor > latest) {
+            out += "id: " + std::to_string(latest) + "\nevent: reset\ndata: {}\n\n";
+            cursor = latest;
+            return true;
+        }
+        for (size_t i = cursor + 1 - firstSequence; i < frames.size(); ++i) {
+            out += frames[i];
+        }
+        cursor = latest;
+        return true;
+    }
+
+    // Block until there are changes after cursor or the timeout passes
+    void waitForChanges(uint64_t cursor, std::chrono::milliseconds timeout) const {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait_for(lock, timeout, [&] { return latestLocked() != cursor; });
+    }
+};
+
+// HTTP server: one event-loop thread multiplexes every connection (epoll on Linux)
+// and hands complete requests to a worker pool that runs the handler.
+// Connections are persistent (HTTP/1.1 keep-alive) and pipelined requests are
+// answered in order, one at a time per connection.
+class SimpleHttpServer {
+private:
+    int server_fd;
+    struct sockaddr_in address;
+    int port;
+    std::atomic<bool> running;
+    size_t workerThreads;
+    size_t maxBodySize = 8 * 1024 * 1024;
+    int keepAliveTimeoutSeconds = 60;
+    std::unique_ptr<ThreadPool> workers;
+    
+    // Handler function type
+    typedef std::function<std::string(const std::string&, const std::string&, const std::string&)> HandlerFunction;
+    HandlerFunction handler;
+
+    // GETs of streamPath are answered with a server-sent event stream of streamFeed
+    std::string streamPath;
+    ChangeFeed* streamFeed = nullptr;
+    static constexpr int kStreamHeartbeatSeconds = 15;
+
+    bool isStreamRequest(const HttpRequestParser::Request& request) const {
+        return streamFeed && request.method == "GET" && request.path.substr(0, request.path.find('?')) == streamPath;
+    }
+
+    // Where a new subscriber starts: after the change named by Last-Event-ID or
+    // ?since=, else at the newest change. Returns the stream's opening bytes.
+    std::string openStream(const HttpRequestParser::Request& request, uint64_t& cursor) const {
+        std::string token = request.lastEventId;
+        size_t since = request.path.find("since=");
+        if (token.empty() && since != std::string::npos) {
+            token = request.path.substr(since + 6, request.path.find('&', since) - since - 6);
+        }
+        std::string opening = "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/event-stream\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Access-Control-Allow-Origin: *\r\n"
+                              "Connection: keep-alive\r\n"
+                              "\r\n"
+                              "retry: 2000\n\n";
+        const char* end = token.data() + token.size();
+        if (token.empty() || std::from_chars(token.data(), end, cursor).ptr != end) {
+            cursor = streamFeed->latest();
+            opening += "id: " + std::to_string(cursor) + "\nevent: ready\ndata: {}\n\n";
+        }
+        return opening;
+    }
+
+    // Run the handler, turning an escaped exception into a 500, and record it in the metrics and trace
+    std::string handleRequest(const HttpRequestParser::Request& request) {
+        auto started = std::chrono::steady_clock::now();
+        Metrics::InFlight inFlight(metrics());
+        Tracer::Span span("request");
+        if (span.active()) {
+            span.detail(request.method + " " + request.path);
+        }
+        std::string response;
+        try {
+            response = handler(request.method, request.path, request.body);
+        } catch (const std::exception& e) {
+            std::cerr << "Handler error on " << request.method << " " << request.path << ": " << e.what() << std::endl;
+            response = "HTTP/1.1 500 Internal Server Error\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: 21\r\n"
+                       "\r\n"
+                       "Internal Server Error";
+        }
+        metrics().recordRequest(request.method, request.path, response, std::chrono::steady_clock::now() - started);
+        return response;
+    }
+
+    static std::string errorResponse(HttpRequestParser::Status status) {
+        if (status == HttpRequestParser::Status::PayloadTooLarge) {
+            return "HTTP/1.1 413 Payload Too Large\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Content-Length: 17\r\n"
+                   "Connection: close\r\n"
+                   "\r\n"
+                   "Payload Too Large";
+        }
+        return "HTTP/1.1 400 Bad Request\r\n"
+               "Content-Type: text/plain\r\n"
+               "Content-Length: 11\r\n"
+               "Connection: close\r\n"
+               "\r\n"
+               "Bad Request";
+    }
+
+    // Reconcile the handler's response with the connection's keep-alive state.
+    // Returns whether the connection stays open after this response.
+    static bool applyConnectionHeader(std::string& response, bool requestKeepAlive) {
+        size_t header_end = response.find("\r\n\r\n");
+        size_t status_end = response.find("\r\n");
+        if (header_end == std::string::npos || status_end == std::string::npos) {
+            return false;
+        }
+
+        // Look for a Connection header the handler already set
+        size_t pos = status_end + 2;
+        while (pos < header_end) {
+            size_t next = response.find("\r\n", pos);
+            size_t colon = response.find(':', pos);
+            if (colon != std::string::npos && colon < next &&
+                iequals(response.substr(pos, colon - pos), "Connection")) {
+                return requestKeepAlive && response.find("close", colon) >= next;
+            }
+            pos = next + 2;
+        }
+
+        response.insert(status_end + 2, requestKeepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+        return requestKeepAlive;
+    }
+
+#ifdef __linux__
+    int epoll_fd = -1;
+    int wake_fd = -1;   // eventfd used by workers to wake the event loop
+
+    struct Connection {
+        int fd;
+        uint64_t id;                    // distinguishes reuses of the same fd
+        std::string in;
+        std::string out;
+        size_t outOffset = 0;
+        HttpRequestParser parser;
+        bool busy = false;              // a worker is running the handler for this connection
+        bool readClosed = false;        // peer shut down its sending side
+        bool closeAfterWrite = false;
+        bool streaming = false;         // following the change feed; no further requests are read
+        uint64_t streamCursor = 0;      // last change written to the stream
+        std::chrono::steady_clock::time_point lastActivity;
+    };
+
+    // A finished handler result waiting to be written by the event loop
+    struct Completion {
+        int fd;
+        uint64_t connId;
+        std::string response;
+        bool keepAlive;
+    };
+
+    std::unordered_map<int, Connection> connections;
+    uint64_t nextConnectionId = 1;
+    std::mutex completionMutex;
+    std::vector<Completion> completions;
+    std::atomic<bool> streamWake{false};    // the change feed has news for the event loop
+    // A stream whose client reads slower than changes arrive is dropped past this much unsent output
+    static constexpr size_t kMaxStreamBacklog = 1024 * 1024;
+
+    static bool setNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    void updateInterest(Connection& conn) {
+        epoll_event ev{};
+        ev.data.fd = conn.fd;
+        if (!conn.busy && !conn.readClosed && !conn.closeAfterWrite) {
+            ev.events |= EPOLLIN;
+        }
+        if (conn.outOffset < conn.out.size()) {
+            ev.events |= EPOLLOUT;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+    }
+
+    void closeConnection(int fd) {
+        auto it = connections.find(fd);
+        if (it != connections.end() && it->second.streaming) {
+            streamFeed->unsubscribe();
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(fd);
+    }
+
+    // Close once everything queued has been written; closing now would drop a
+    // response the peer is still reading after shutting down its sending side
+    void closeWhenWritten(Connection& conn) {
+        conn.closeAfterWrite = true;
+        if (conn.outOffset < conn.out.size()) {
+            updateInterest(conn);
+        } else {
+            closeConnection(conn.fd);
+        }
+    }
+
+    void acceptConnections() {
+        while (true) {
+            int new_socket = accept4(server_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (new_socket < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    std::cerr << "Accept failed: " << strerror(errno) << std::endl;
+                }
+                return;
+            }
+
+            int nodelay = 1;
+            setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = new_socket;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &ev) < 0) {
+                close(new_socket);
+                continue;
+            }
+
+            Connection& conn = connections[new_socket];
+            conn = Connection();
+            conn.fd = new_socket;
+            conn.id = nextConnectionId++;
+            conn.parser = HttpRequestParser(maxBodySize);
+            conn.lastActivity = std::chrono::steady_clock::now();
+        }
+    }
+
+    // Drain the socket into the connection buffer. Returns false if the connection should be dropped.
+    bool readFromConnection(Connection& conn) {
+        char buffer[16384];
+        conn.lastActivity = std::chrono::steady_clock::now();
+        while (true) {
+            ssize_t valread = recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (valread > 0) {
+                conn.in.append(buffer, valread);
+                continue;
+            }
+            if (valread == 0) {
+                conn.readClosed = true;
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+
+    // Queue a response on the connection and start writing it
+    void sendResponse(Connection& conn, std::string response, bool keepAlive) {
+        if (!keepAlive) {
+            conn.closeAfterWrite = true;
+        }
+        conn.out += response;
+        flushConnection(conn);
+    }
+
+    // If a complete request is buffered, hand it to the worker pool
+    void dispatchRequest(Connection& conn) {
+        HttpRequestParser::Request request;
+        HttpRequestParser::Status status = conn.parser.parse(conn.in, request);
+
+        if (status == HttpRequestParser::Status::Incomplete) {
+            if (conn.readClosed) {
+                closeWhenWritten(conn);
+            } else if (conn.parser.wantsContinue()) {
+                conn.parser.acknowledgeContinue();
+                conn.out += "HTTP/1.1 100 Continue\r\n\r\n";
+                flushConnection(conn);
+            }
+            return;
+        }
+        if (status != HttpRequestParser::Status::Complete) {
+            sendResponse(conn, errorResponse(status), false);
+            return;
+        }
+        if (isStreamRequest(request)) {
+            conn.streaming = true;
+            streamFeed->subscribe();
+            conn.in.clear();
+            conn.out += openStream(request, conn.streamCursor);
+            pumpStream(conn);
+            return;
+        }
+
+        conn.busy = true;
+        updateInterest(conn);
+
+        int fd = conn.fd;
+        uint64_t connId = conn.id;
+        workers->enqueue([this, fd, connId, request = std::move(request)] {
+            std::string response = handleRequest(request);
+            bool keepAlive = applyConnectionHeader(response, request.keepAlive);
+            {
+                std::lock_guard<std::mutex> lock(completionMutex);
+                completions.push_back({fd, connId, std::move(response), keepAlive});
+            }
+            uint64_t one = 1;
+            ssize_t ignored = write(wake_fd, &one, sizeof(one));
+            (void)ignored;
+        });
+    }
+
+    // Write as much pending output as the socket accepts
+    void flushConnection(Connection& conn) {
+        while (conn.outOffset < conn.out.size()) {
+            ssize_t sent = send(conn.fd, conn.out.data() + conn.outOffset, conn.out.size() - conn.outOffset, MSG_NOSIGNAL);
+            if (sent > 0) {
+                conn.outOffset += sent;
+                continue;
+            }
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                updateInterest(conn);
+                return;
+            }
+            closeConnection(conn.fd);
+            return;
+        }
+
+        conn.out.clear();
+        conn.outOffset = 0;
+        conn.lastActivity = std::chrono::steady_clock::now();
+        if (conn.closeAfterWrite) {
+            closeConnection(conn.fd);
+            return;
+        }
+        updateInterest(conn);
+    }
+
+    // Queue the stream's unsent changes and write them
+    void pumpStream(Connection& conn) {
+        streamFeed->appendSince(conn.streamCursor, conn.out);
+        if (conn.out.size() - conn.outOffset > kMaxStreamBacklog) {
+            closeConnection(conn.fd); // The client reconnects and resumes, or is told to reload
+            return;
+        }
+        flushConnection(conn);
+    }
+
+    void pumpStreams() {
+        std::vector<int> streams;
+        for (const auto& entry : connections) {
+            if (entry.second.streaming && !entry.second.closeAfterWrite) streams.push_back(entry.first);
+        }
+        for (int fd : streams) {
+            auto it = connections.find(fd);
+            if (it != connections.end()) pumpStream(it->second);
+        }
+    }
+
+    void deliverCompletions() {
+        uint64_t counter;
+        while (read(wake_fd, &counter, sizeof(counter)) > 0) {
+        }
+        if (streamWake.exchange(false)) {
+            pumpStreams();
+        }
+
+        std::vector<Completion> ready;
+        {
+            std::lock_guard<std::mutex> lock(completionMutex);
+            ready.swap(completions);
+        }
+
+        for (auto& completion : ready) {
+            auto it = connections.find(completion.fd);
+            if (it == connections.end() || it->second.id != completion.connId) {
+                continue; // Client went away while the handler was running
+            }
+            Connection& conn = it->second;
+            conn.busy = false;
+            sendResponse(conn, std::move(completion.response), completion.keepAlive);
+
+            // Move on to the next pipelined request, if one is already buffered
+            it = connections.find(completion.fd);
+            if (it != connections.end() && it->second.id == completion.connId && !it->second.closeAfterWrite) {
+                dispatchRequest(it->second);
+            }
+        }
+    }
+
+    // Close keep-alive connections that have been idle for too long, and send
+    // quiet streams a comment line so proxies and clients keep them open
+    void closeIdleConnections() {
+        auto now = std::chrono::steady_clock::now();
+        auto cutoff = now - std::chrono::seconds(keepAliveTimeoutSeconds);
+        auto heartbeat = now - std::chrono::seconds(kStreamHeartbeatSeconds);
+        std::vector<int> idle, quiet;
+        for (const auto& entry : connections) {
+            const Connection& conn = entry.second;
+            if (conn.streaming) {
+                if (conn.out.empty() && conn.lastActivity < heartbeat) quiet.push_back(entry.first);
+            } else if (!conn.busy && conn.out.empty() && conn.lastActivity < cutoff) {
+                idle.push_back(entry.first);
+            }
+        }
+        for (int fd : quiet) {
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            it->second.out += ":\n\n";
+            flushConnection(it->second);
+        }
+        for (int fd : idle) {
+            closeConnection(fd);
+        }
+    }
+
+    void runEventLoop() {
+        std::vector<epoll_event> events(1024);
+        auto lastSweep = std::chrono::steady_clock::now();
+
+        while (running) {
+            int count = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 1000);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+                break;
+            }
+
+            for (int i = 0; i < count; ++i) {
+                int fd = events[i].data.fd;
+                uint32_t flags = events[i].events;
+
+                if (fd == server_fd) {
+                    acceptConnections();
+                    continue;
+                }
+                if (fd == wake_fd) {
+                    deliverCompletions();
+                    continue;
+                }
+
+                auto it = connections.find(fd);
+                if (it == connections.end()) {
+                    continue;
+                }
+                Connection& conn = it->second;
+
+                if (flags & EPOLLERR) {
+                    closeConnection(fd);
+                    continue;
+                }
+                if (flags & EPOLLOUT) {
+                    flushConnection(conn);
+                    if (connections.find(fd) == connections.end()) continue;
+                }
+                if (flags & (EPOLLIN | EPOLLHUP)) {
+                    if (!readFromConnection(conn)) {
+                        closeConnection(fd);
+                        continue;
+                    }
+                    if (conn.streaming) {
+                        conn.in.clear(); // Nothing more is expected from a stream's client
+                        if (conn.readClosed) closeWhenWritten(conn);
+                    } else if (!conn.busy && !conn.closeAfterWrite) {
+                        dispatchRequest(conn);
+                    } else if (conn.readClosed) {
+                        updateInterest(conn);
+                    }
+                }
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastSweep >= std::chrono::seconds(1)) {
+                closeIdleConnections();
+                lastSweep = now;
+            }
+        }
+    }
+#else
+    static bool sendAll(int fd, const std::string& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            int sent = send(fd, data.data() + offset, static_cast<int>(data.size() - offset), 0);
+            if (sent <= 0) return false;
+            offset += sent;
+        }
+        return true;
+    }
+
+    // Portable fallback: blocking accept loop, one worker task per connection.
+    // Waiting for a keep-alive client's next request would hold the worker, so
+    // the connection stays open only for requests it has already pipelined.
+    void serveConnection(int new_socket) {
+#ifdef _WIN32
+        DWORD timeout = keepAliveTimeoutSeconds * 1000;
+        setsockopt(new_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+#else
+        struct timeval timeout = {keepAliveTimeoutSeconds, 0};
+        setsockopt(new_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+        HttpRequestParser parser(maxBodySize);
+        std::string buffered;
+        char buffer[16384];
+
+        while (running) {
+            HttpRequestParser::Request request;
+            HttpRequestParser::Status status = parser.parse(buffered, request);
+            if (status == HttpRequestParser::Status::Incomplete) {
+                if (parser.wantsContinue()) {
+                    parser.acknowledgeContinue();
+                    sendAll(new_socket, "HTTP/1.1 100 Continue\r\n\r\n");
+                }
+                int valread = recv(new_socket, buffer, sizeof(buffer), 0);
+                if (valread <= 0) break;
+                buffered.append(buffer, valread);
+                continue;
+            }
+            if (status != HttpRequestParser::Status::Complete) {
+                sendAll(new_socket, errorResponse(status));
+                break;
+            }
+            if (isStreamRequest(request)) {
+                if (streamWorkers.fetch_add(1) + 1 < workers->size()) {
+                    serveStream(new_socket, request);
+                } else {
+                    sendAll(new_socket, "HTTP/1.1 503 Service Unavailable\r\n"
+                                        "Content-Type: text/plain\r\n"
+                                        "Content-Length: 19\r\n"
+                                        "Retry-After: 5\r\n"
+                                        "Connection: close\r\n"
+                                        "\r\n"
+                                        "Service Unavailable");
+                }
+                streamWorkers--;
+                break;
+            }
+
+            std::string response = handleRequest(request);
+            bool keepAlive = applyConnectionHeader(response, request.keepAlive && !buffered.empty());
+            if (!sendAll(new_socket, response) || !keepAlive) break;
+        }
+        closeSocket(new_socket);
+    }
+
+    // Each stream holds a worker until its client goes away. They may take all
+    // but one, so ordinary requests are still served; further streams get a 503.
+    std::atomic<size_t> streamWorkers{0};
+
+    // Follow the change feed on this worker thread until the client goes away
+    void serveStream(int new_socket, const HttpRequestParser::Request& request) {
+        streamFeed->subscribe();
+        uint64_t cursor;
+        std::string out = openStream(request, cursor);
+        while (running) {
+            streamFeed->appendSince(cursor, out);
+            if (out.empty()) {
+                out = ":\n\n"; // Heartbeat
+            }
+            if (!sendAll(new_socket, out)) break;
+            out.clear();
+            streamFeed->waitForChanges(cursor, std::chrono::seconds(kStreamHeartbeatSeconds));
+        }
+        streamFeed->unsubscribe();
+    }
+
+    void runAcceptLoop() {
+        while (running) {
+            int new_socket = static_cast<int>(accept(server_fd, nullptr, nullptr));
+            if (new_socket < 0) {
+                std::cerr << "Accept failed" << std::endl;
+                continue;
+            }
+            workers->enqueue([this, new_socket] { serveConnection(new_socket); });
+        }
+    }
+#endif
+
+public:
+    // workerThreads == 0 sizes the handler pool to the number of hardware threads
+    SimpleHttpServer(int port = 8080, size_t workerThreads = 0)
+        : port(port), running(false), workerThreads(workerThreads) {
+#ifdef _WIN32
+        // Initialize Winsock
+        WSADATA wsaData;
+        int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+        if (result != 0) {
+            std::cerr << "WSAStartup failed: " << result << std::endl;
+            return;
+        }
+#endif
+
+        // Create socket
+        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+            std::cerr << "Socket creation failed" << std::endl;
+            return;
+        }
+
+        // Set socket options
+        int opt = 1;
+#ifdef _WIN32
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) < 0) {
+#else
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+#endif
+            std::cerr << "Setsockopt failed" << std::endl;
+            return;
+        }
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+
+        // Bind socket
+        if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            std::cerr << "Bind failed" << std::endl;
+            return;
+        }
+
+        // Listen
+        if (listen(server_fd, SOMAXCONN) < 0) {
+            std::cerr << "Listen failed" << std::endl;
+            return;
+        }
+
+#ifdef __linux__
+        // Register the listening socket and the worker wake-up eventfd with epoll
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0 || !setNonBlocking(server_fd)) {
+            std::cerr << "Event loop setup failed: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = server_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+#endif
+
+        running = true;
+    }
+
+    ~SimpleHttpServer() {
+        // The feed may outlive the server; stop it waking an event loop that is gone
+        if (streamFeed) {
+            streamFeed->setListener(nullptr);
+        }
+        // Join the workers before tearing down the sockets they may still report to
+        workers.reset();
+#ifdef _WIN32
+        closesocket(server_fd);
+        WSACleanup();
+#else
+#ifdef __linux__
+        for (auto& entry : connections) {
+            if (entry.second.streaming) {
+                streamFeed->unsubscribe();
+            }
+            close(entry.first);
+        }
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (wake_fd >= 0) close(wake_fd);
+#endif
+        close(server_fd);
+#endif
+    }
+
+    void start(HandlerFunction handlerFunc) {
+        handler = handlerFunc;
+#ifndef _WIN32
+        signal(SIGPIPE, SIG_IGN);
+#endif
+        workers.reset(new ThreadPool(workerThreads));
+        std::cout << "HTTP server started on port " << port
+                  << " with " << workers->size() << " worker threads" << std::endl;
+
+#ifdef __linux__
+        runEventLoop();
+#else
+        runAcceptLoop();
+#endif
+    }
+
+    // Port the server is listening on; differs from the requested one when that was 0
+    int boundPort() const {
+        struct sockaddr_in bound{};
+        socklen_t length = sizeof(bound);
+        if (getsockname(server_fd, (struct sockaddr*)&bound, &length) < 0) {
+            return port;
+        }
+        return ntohs(bound.sin_port);
+    }
+
+    // Largest accepted request body; bigger requests get 413 Payload Too Large
+    void setMaxBodySize(size_t bytes) {
+        maxBodySize = bytes;
+    }
+
+    // Idle keep-alive connections are closed after this many seconds
+    void setKeepAliveTimeout(int seconds) {
+        keepAliveTimeoutSeconds = seconds;
+    }
+
+    // Serve GET path as a server-sent event stream of feed's changes. Call before start().
+    void setEventStream(const std::string& path, ChangeFeed& feed) {
+        streamPath = path;
+        streamFeed = &feed;
+#ifdef __linux__
+        feed.setListener([this] {
+            if (!streamWake.exchange(true)) {
+                uint64_t one = 1;
+                ssize_t ignored = write(wake_fd, &one, sizeof(one));
+                (void)ignored;
+            }
+        });
+#else
+        feed.setListener([] {}); // Streams wait on the feed itself
+#endif
+    }
+
+    void stop() {
+        running = false;
+#ifdef __linux__
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+#endif
+    }
+};
+
+// Location structure
+struct Location {
+    int id;
+    std::string name;
+    double x, y;
+};
+
+// Order structure
+struct Order {
+    int id;
+    int restaurantId;
+    int customerLocationId;
+    int assignedDriverId = -1;
+    std::string status;
+};
+
+// Driver structure
+struct Driver {
+    int id;
+    int currentLocation;
+    std::vector<int> assignedOrders;
+    double speed;
+    size_t maxOrders = 3;           // orders the driver may hold at once
+    double detourLimit = 1.5;       // longest allowed route growth, as a multiple of the current route
+};
+
+// One stop on a driver's planned route
+struct RouteStop {
+    int orderId;
+    int locationId;
+    bool isPickup;      // true at the restaurant, false at the customer
+};
+
+inline bool operator==(const RouteStop& a, const RouteStop& b) {
+    return a.orderId == b.orderId && a.locationId == b.locationId && a.isPickup == b.isPickup;
+}
+
+// Cheapest place to fit an order's pickup and drop-off into a stop sequence.
+// Gaps are numbered by the stop they precede; gap stops.size() is the end.
+struct RouteInsertion {
+    double routeDistance = 0;       // length of the route before the insertion
+    double addedDistance = std::numeric_limits<double>::infinity();
+    size_t pickupGap = 0;
+    size_t dropoffGap = 0;          // never before pickupGap
+};
+
+// What a scoring policy sees about one candidate driver for one order
+struct ScoringInput {
+    size_t load;                    // orders the driver already holds
+    double speed;
+    bool hasRoute;                  // whether the driver has planned stops
+    double routeDistance;           // planned route length before the order
+    double addedDistance;           // growth of the route from inserting the order
+    double distanceToRestaurant;    // straight line from the driver's location
+    double deliveryDistance;        // straight line from restaurant to customer
+};
+
+// Driver scoring policies for dispatch; lower scores win. Each is a type with a
+// static score() so the candidate loop is compiled once per policy.
+enum class ScoringPolicy {
+    Default,        // load, speed and detour, as the dispatcher always weighed them
+    Eta,            // time to finish the route including the order
+    LoadBalanced    // fewest orders first, ETA breaks ties
+};
+
+struct DefaultScoring {
+    static double score(const ScoringInput& input) {
+        double loadFactor = input.load * 2.0; // Each order adds 2.0 to the score
+        double speedBonus = 10.0 / input.speed; // Faster drivers get lower scores
+        // Detour for drivers with a route, direct distance otherwise
+        double routeCompatibilityScore = input.hasRoute
+            ? input.addedDistance / 2.0
+            : (input.distanceToRestaurant + input.deliveryDistance) / input.speed;
+        return loadFactor + speedBonus + routeCompatibilityScore;
+    }
+};
+
+struct EtaScoring {
+    static double score(const ScoringInput& input) {
+        double distance = input.hasRoute
+            ? input.routeDistance + input.addedDistance
+            : input.distanceToRestaurant + input.deliveryDistance;
+        return distance / input.speed;
+    }
+};
+
+struct LoadBalancedScoring {
+    static double score(const ScoringInput& input) {
+        double eta = EtaScoring::score(input);
+        return input.load + eta / (1.0 + eta); // The ETA term stays below 1
+    }
+};
+
+inline const char* scoringPolicyName(ScoringPolicy policy) {
+    switch (policy) {
+        case ScoringPolicy::Eta: return "eta";
+        case ScoringPolicy::LoadBalanced: return "load";
+        default: return "default";
+    }
+}
+
+// Parse a policy name; unknown names throw std::invalid_argument
+inline ScoringPolicy parseScoringPolicy(const std::string& name) {
+    if (name.empty() || name == "default") return ScoringPolicy::Default;
+    if (name == "eta") return ScoringPolicy::Eta;
+    if (name == "load") return ScoringPolicy::LoadBalanced;
+    throw std::invalid_argument("Unknown scoring policy: " + name);
+}
+
+// Search strategy for point-to-point routes
+enum class RoutingAlgorithm {
+    Dijkstra,
+    AStar,                  // Dijkstra guided by straight-line distance to the target
+    ContractionHierarchy    // bidirectional search over a preprocessed shortcut hierarchy
+};
+
+inline const char* routingAlgorithmName(RoutingAlgorithm algorithm) {
+    switch (algorithm) {
+        case RoutingAlgorithm::AStar: return "astar";
+        case RoutingAlgorithm::ContractionHierarchy: return "ch";
+        default: return "dijkstra";
+    }
+}
+
+// Parse an algorithm name from a request; unknown names throw std::invalid_argument
+inline RoutingAlgorithm parseRoutingAlgorithm(const std::string& name) {
+    if (name.empty() || name == "dijkstra") return RoutingAlgorithm::Dijkstra;
+    if (name == "astar") return RoutingAlgorithm::AStar;
+    if (name == "ch") return RoutingAlgorithm::ContractionHierarchy;
+    throw std::invalid_argument("Unknown routing algorithm: " + name);
+}
+
+// Euclidean distances from one point to count points stored as separate x/y
+// arrays. Uses AVX (4 lanes) or SSE2 (2 lanes) when the compiler targets them,
+// with a scalar loop for the remainder and for other platforms.
+inline void distancesFromPoint(double originX, double originY, const double* xs, const double* ys,
+                               size_t count, double* out) {
+    size_t i = 0;
+#if defined(__AVX__)
+    __m256d ox = _mm256_set1_pd(originX);
+    __m256d oy = _mm256_set1_pd(originY);
+    for (; i + 4 <= count; i += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(xs + i), ox);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(ys + i), oy);
+        __m256d squared = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+        _mm256_storeu_pd(out + i, _mm256_sqrt_pd(squared));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128d ox = _mm_set1_pd(originX);
+    __m128d oy = _mm_set1_pd(originY);
+    for (; i + 2 <= count; i += 2) {
+        __m128d dx = _mm_sub_pd(_mm_loadu_pd(xs + i), ox);
+        __m128d dy = _mm_sub_pd(_mm_loadu_pd(ys + i), oy);
+        __m128d squared = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+        _mm_storeu_pd(out + i, _mm_sqrt_pd(squared));
+    }
+#endif
+    for (; i < count; ++i) {
+        double dx = xs[i] - originX;
+        double dy = ys[i] - originY;
+        out[i] = std::sqrt(dx * dx + dy * dy);
+    }
+}
+
+// In-memory copy of location coordinates, so straight-line distances never touch
+// SQLite. IDs below a bound index flat x/y arrays directly; larger or negative
+// IDs go through a hash map. Unknown locations sit at the origin.
+class LocationStore {
+private:
+    static constexpr int kMaxDenseId = 1 << 24;
+
+    mutable std::shared_mutex mutex;
+    std::vector<double> denseX;
+    std::vector<double> denseY;
+    std::unordered_map<int, std::pair<double, double>> sparsePoints;
+
+    // Per-thread structure-of-arrays copies of the coordinates a batch query works on
+    struct Scratch {
+        std::vector<double> x;
+        std::vector<double> y;
+    };
+
+    void lookup(int id, double& x, double& y) const {
+        if (id >= 0 && id < kMaxDenseId) {
+            bool known = id < static_cast<int>(denseX.size());
+            x = known ? denseX[id] : 0;
+            y = known ? denseY[id] : 0;
+            return;
+        }
+        auto it = sparsePoints.find(id);
+        x = it == sparsePoints.end() ? 0 : it->second.first;
+        y = it == sparsePoints.end() ? 0 : it->second.second;
+    }
+
+    // Copy the coordinates of ids into scratch.x/scratch.y
+    void gather(const std::vector<int>& ids, Scratch& scratch) const {
+        scratch.x.resize(ids.size());
+        scratch.y.resize(ids.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            lookup(ids[i], scratch.x[i], scratch.y[i]);
+        }
+    }
+
+    void setLocked(int id, double x, double y) {
+        if (id >= 0 && id < kMaxDenseId) {
+            if (id >= static_cast<int>(denseX.size())) {
+                denseX.resize(id + 1, 0);
+                denseY.resize(id + 1, 0);
+            }
+            denseX[id] = x;
+            denseY[id] = y;
+        } else {
+            sparsePoints[id] = {x, y};
+        }
+    }
+
+public:
+    // Replace all coordinates, e.g. from the locations table at startup
+    void load(const std::vector<Location>& locations) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        denseX.clear();
+        denseY.clear();
+        sparsePoints.clear();
+        for (const auto& location : locations) {
+            setLocked(location.id, location.x, location.y);
+        }
+    }
+
+    void set(int id, double x, double y) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        setLocked(id, x, y);
+    }
+
+    // Coordinates of a location; the origin if it is unknown
+    void position(int id, double& x, double& y) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        lookup(id, x, y);
+    }
+
+    double distance(int from, int to) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        double fromX, fromY, toX, toY;
+        lookup(from, fromX, fromY);
+        lookup(to, toX, toY);
+        double dx = fromX - toX;
+        double dy = fromY - toY;
+        return std::sqrt(dx * dx + dy * dy);
+    }
+
+    // Distance from one location to each of many
+    std::vector<double> distancesFrom(int from, const std::vector<int>& to) const {
+        static thread_local Scratch scratch;
+        double originX, originY;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            lookup(from, originX, originY);
+            gather(to, scratch);
+        }
+        std::vector<double> result(to.size());
+        distancesFromPoint(originX, originY, scratch.x.data(), scratch.y.data(), to.size(), result.data());
+        return result;
+    }
+
+    // Straight-line length of each hop along a sequence of locations
+    std::vector<double> legLengths(const std::vector<int>& path) const {
+        if (path.size() < 2) {
+            return {};
+        }
+        static thread_local Scratch scratch;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            gather(path, scratch);
+        }
+        std::vector<double> legs(path.size() - 1);
+        for (size_t i = 0; i + 1 < path.size(); ++i) {
+            double dx = scratch.x[i + 1] - scratch.x[i];
+            double dy = scratch.y[i + 1] - scratch.y[i];
+            legs[i] = std::sqrt(dx * dx + dy * dy);
+        }
+        return legs;
+    }
+
+    // Sum of straight-line hops along a sequence of locations
+    double pathLength(const std::vector<int>& path) const {
+        if (path.size() < 2) {
+            return 0;
+        }
+        static thread_local Scratch scratch;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            gather(path, scratch);
+        }
+        double length = 0;
+        for (size_t i = 0; i + 1 < path.size(); ++i) {
+            double dx = scratch.x[i + 1] - scratch.x[i];
+            double dy = scratch.y[i + 1] - scratch.y[i];
+            length += std::sqrt(dx * dx + dy * dy);
+        }
+        return length;
+    }
+};
+
+// Uniform grid over driver positions for nearest-driver queries. Each driver is
+// filed under the cell containing its location's coordinates; a query scans
+// rings of cells outward from the query point until the k nearest are known.
+// The cell size is re-derived from the drivers' bounding box whenever the
+// driver count has doubled or halved since the last layout.
+class DriverIndex {
+private:
+    struct Entry {
+        int locationId;
+        double x;
+        double y;
+        int64_t cell;
+        size_t slot;        // position in cells[cell]
+    };
+
+    mutable std::mutex mutex;
+    std::unordered_map<int, Entry> drivers;
+    std::unordered_map<int64_t, std::vector<int>> cells;
+    double cellSize = 1.0;
+    size_t layoutCount = 0;
+    // Range of cell coordinates that has ever held a driver since the last layout
+    int minCellX = 0, maxCellX = -1, minCellY = 0, maxCellY = -1;
+
+    int cellCoordinate(double value) const {
+        return static_cast<int>(std::floor(value / cellSize));
+    }
+
+    static int64_t cellKey(int cx, int cy) {
+        return (static_cast<int64_t>(cx) << 32) ^ static_cast<uint32_t>(cy);
+    }
+
+    void insertLocked(int driverId, Entry entry) {
+        int cx = cellCoordinate(entry.x);
+        int cy = cellCoordinate(entry.y);
+        if (maxCellX < minCellX) {
+            minCellX = maxCellX = cx;
+            minCellY = maxCellY = cy;
+        } else {
+            minCellX = std::min(minCellX, cx);
+            maxCellX = std::max(maxCellX, cx);
+            minCellY = std::min(minCellY, cy);
+            maxCellY = std::max(maxCellY, cy);
+        }
+        entry.cell = cellKey(cx, cy);
+        auto& cell = cells[entry.cell];
+        entry.slot = cell.size();
+        cell.push_back(driverId);
+        drivers[driverId] = entry;
+    }
+
+    void eraseLocked(int driverId) {
+        auto it = drivers.find(driverId);
+        if (it == drivers.end()) {
+            return;
+        }
+        auto cellIt = cells.find(it->second.cell);
+        auto& cell = cellIt->second;
+        int moved = cell.back();
+        cell[it->second.slot] = moved;
+        drivers[moved].slot = it->second.slot;
+        cell.pop_back();
+        if (cell.empty()) {
+            cells.erase(cellIt);
+        }
+        drivers.erase(it);
+    }
+
+    // Choose a cell size giving about two drivers per cell and refile everyone
+    void layoutLocked() {
+        double minX = std::numeric_limits<double>::infinity(), maxX = -minX;
+        double minY = minX, maxY = -minX;
+        for (const auto& driver : drivers) {
+            minX = std::min(minX, driver.second.x);
+            maxX = std::max(maxX, driver.second.x);
+            minY = std::min(minY, driver.second.y);
+            maxY = std::max(maxY, driver.second.y);
+        }
+        double area = drivers.empty() ? 0 : (maxX - minX) * (maxY - minY);
+        double extent = drivers.empty() ? 0 : std::max(maxX - minX, maxY - minY);
+        if (area > 0) {
+            cellSize = std::sqrt(2.0 * area / drivers.size());
+        } else {
+            cellSize = extent > 0 ? extent / std::max<size_t>(1, drivers.size() / 2) : 1.0;
+        }
+
+        std::vector<std::pair<int, Entry>> entries(drivers.begin(), drivers.end());
+        drivers.clear();
+        cells.clear();
+        minCellX = minCellY = 0;
+        maxCellX = maxCellY = -1;
+        for (const auto& entry : entries) {
+            insertLocked(entry.first, entry.second);
+        }
+        layoutCount = drivers.size();
+    }
+
+    double boundingCellCount() const {
+        return (static_cast<double>(maxCellX) - minCellX + 1) * (static_cast<double>(maxCellY) - minCellY + 1);
+    }
+
+    // Re-layout when the driver count has drifted, or drivers have wandered so far that the grid is mostly empty
+    void relayoutIfNeeded() {
+        if (drivers.size() > 2 * layoutCount + 8 || drivers.size() * 2 + 8 < layoutCount ||
+            boundingCellCount() > 16.0 * (drivers.size() + 8)) {
+            layoutLocked();
+        }
+    }
+
+public:
+    // Replace the whole index; entries are (driver ID, location ID, x, y)
+    void load(const std::vector<std::tuple<int, int, double, double>>& positions) {
+        std::lock_guard<std::mutex> lock(mutex);
+        drivers.clear();
+        cells.clear();
+        for (const auto& position : positions) {
+            drivers[std::get<0>(position)] = {std::get<1>(position), std::get<2>(position), std::get<3>(position), 0, 0};
+        }
+        layoutLocked();
+    }
+
+    // Add a driver or move it to a new location
+    void update(int driverId, int locationId, double x, double y) {
+        std::lock_guard<std::mutex> lock(mutex);
+        eraseLocked(driverId);
+        insertLocked(driverId, {locationId, x, y, 0, 0});
+        relayoutIfNeeded();
+    }
+
+    // Coordinates of a location became known (or changed); move the drivers standing there
+    void relocate(int locationId, double x, double y) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<int> moved;
+        for (const auto& driver : drivers) {
+            if (driver.second.locationId == locationId) moved.push_back(driver.first);
+        }
+        for (int driverId : moved) {
+            eraseLocked(driverId);
+            insertLocked(driverId, {locationId, x, y, 0, 0});
+        }
+    }
+
+    void remove(int driverId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        eraseLocked(driverId);
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return drivers.size();
+    }
+
+    // Up to k driver IDs ordered by straight-line distance from (x, y); ties by driver ID
+    std::vector<int> nearest(double x, double y, size_t k) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::pair<double, int>> found;    // (squared distance, driver ID)
+        if (k == 0 || drivers.empty()) {
+            return {};
+        }
+
+        int cx = cellCoordinate(x);
+        int cy = cellCoordinate(y);
+        auto scanCell = [&](int cellX, int cellY) {
+            auto it = cells.find(cellKey(cellX, cellY));
+            if (it == cells.end()) return;
+            for (int driverId : it->second) {
+                const Entry& entry = drivers.at(driverId);
+                double dx = entry.x - x;
+                double dy = entry.y - y;
+                found.push_back({dx * dx + dy * dy, driverId});
+            }
+        };
+
+        if (boundingCellCount() > 4.0 * drivers.size()) {
+            // Mostly empty grid (e.g. after relocate); a linear scan is cheaper than the rings
+            for (const auto& driver : drivers) {
+                double dx = driver.second.x - x;
+                double dy = driver.second.y - y;
+                found.push_back({dx * dx + dy * dy, driver.first});
+            }
+        } else {
+            // Rings before firstRing miss the occupied cells entirely; past lastRing everything has been scanned
+            int firstRing = std::max({0, minCellX - cx, cx - maxCellX, minCellY - cy, cy - maxCellY});
+            int lastRing = std::max({cx - minCellX, maxCellX - cx, cy - minCellY, maxCellY - cy});
+            for (int ring = firstRing; ring <= lastRing; ++ring) {
+                // Walk the ring's perimeter, clipped to the occupied cells
+                int fromX = std::max(cx - ring, minCellX), toX = std::min(cx + ring, maxCellX);
+                int fromY = std::max(cy - ring + 1, minCellY), toY = std::min(cy + ring - 1, maxCellY);
+                for (int cellX = fromX; cellX <= toX; ++cellX) {
+                    if (cy - ring >= minCellY) scanCell(cellX, cy - ring);
+                    if (ring > 0 && cy + ring <= maxCellY) scanCell(cellX, cy + ring);
+                }
+                for (int cellY = fromY; cellY <= toY; ++cellY) {
+                    if (cx - ring >= minCellX) scanCell(cx - ring, cellY);
+                    if (ring > 0 && cx + ring <= maxCellX) scanCell(cx + ring, cellY);
+                }
+
+                // Anything outside the scanned square is at least ring * cellSize away
+                if (found.size() >= k) {
+                    std::nth_element(found.begin(), found.begin() + (k - 1), found.end());
+                    double reach = ring * cellSize;
+                    if (found[k - 1].first <= reach * reach) break;
+                }
+            }
+        }
+
+        std::sort(found.begin(), found.end());
+        if (found.size() > k) found.resize(k);
+        std::vector<int> result;
+        result.reserve(found.size());
+        for (const auto& candidate : found) {
+            result.push_back(candidate.second);
+        }
+        return result;
+    }
+};
+
+// In-memory road network in compressed-sparse-row (CSR) form.
+// Location IDs are mapped to dense node indices so searches can keep their
+// distance/parent labels in flat arrays. Edges added after the last rebuild
+// go to a small per-node overflow list and are merged into the CSR arrays
+// once that list grows large enough.
+class RoadGraph {
+public:
+    struct Arc {
+        int target;         // dense node index
+        double distance;
+        double traffic;
+
+        double cost() const {
+            return distance * traffic;
+        }
+    };
+
+    // Result of a point-to-point search
+    struct PathResult {
+        std::vector<int> path;      // location IDs, start to end; empty if unreachable
+        double cost = std::numeric_limits<double>::infinity();
+        size_t settledNodes = 0;
+        RoutingAlgorithm algorithm = RoutingAlgorithm::Dijkstra;   // what actually ran
+    };
+
+    // Directed edge between dense node indices, with its current cost
+    struct EdgeRecord {
+        int from;
+        int to;
+        double cost;
+    };
+
+    // Consistent copy of the graph for preprocessing engines
+    struct Snapshot {
+        std::vector<int> nodeIds;       // indexed by dense node index
+        std::vector<EdgeRecord> edges;
+        uint64_t topologyVersion;
+        uint64_t metricVersion;
+    };
+
+private:
+    // IDs below this bound are mapped through a flat array, larger ones through a hash map
+    static constexpr int kMaxDenseId = 1 << 24;
+
+    mutable std::shared_mutex mutex;
+    std::vector<int> indexToId;
+    std::vector<int> idToIndex;                 // -1 for unknown IDs
+    std::unordered_map<int, int> sparseIdToIndex;
+    std::vector<size_t> firstArc;               // node i's arcs are arcs[firstArc[i] .. firstArc[i + 1])
+    std::vector<Arc> arcs;
+    std::vector<std::vector<Arc>> overflowArcs; // per-node arcs added since the last rebuild
+    size_t overflowCount = 0;
+
+    // Node coordinates for the A* heuristic. Nodes only known from the edges table have none.
+    std::vector<double> nodeX;
+    std::vector<double> nodeY;
+    std::vector<char> hasCoordinates;
+    // Arcs cheaper than the straight line between their endpoints; A* is only exact when this is 0
+    size_t inadmissibleArcs = 0;
+
+    // Bumped when nodes/arcs are added, and when any arc cost changes, respectively
+    std::atomic<uint64_t> topologyVersion{0};
+    std::atomic<uint64_t> metricVersion{0};
+
+    // Per-thread search labels, reset lazily with a round stamp instead of refilling
+    struct SearchSpace {
+        std::vector<double> distance;
+        std::vector<int> parent;
+        std::vector<uint32_t> stamp;
+        uint32_t round = 0;
+
+        void prepare(size_t nodeCount) {
+            if (stamp.size() < nodeCount) {
+                distance.resize(nodeCount);
+                parent.resize(nodeCount);
+                stamp.resize(nodeCount, 0);
+            }
+            if (++round == 0) {
+                std::fill(stamp.begin(), stamp.end(), 0);
+                round = 1;
+            }
+        }
+
+        double get(int node) const {
+            return stamp[node] == round ? distance[node] : std::numeric_limits<double>::infinity();
+        }
+
+        void set(int node, double dist, int from) {
+            stamp[node] = round;
+            distance[node] = dist;
+            parent[node] = from;
+        }
+    };
+
+    int lookupIndex(int id) const {
+        if (id >= 0 && id < kMaxDenseId) {
+            return id < static_cast<int>(idToIndex.size()) ? idToIndex[id] : -1;
+        }
+        auto it = sparseIdToIndex.find(id);
+        return it == sparseIdToIndex.end() ? -1 : it->second;
+    }
+
+    int ensureNode(int id) {
+        int index = lookupIndex(id);
+        if (index >= 0) {
+            return index;
+        }
+        index = static_cast<int>(indexToId.size());
+        indexToId.push_back(id);
+        topologyVersion++;
+        if (id >= 0 && id < kMaxDenseId) {
+            if (id >= static_cast<int>(idToIndex.size())) {
+                idToIndex.resize(id + 1, -1);
+            }
+            idToIndex[id] = index;
+        } else {
+            sparseIdToIndex[id] = index;
+        }
+        firstArc.push_back(arcs.size());
+        overflowArcs.emplace_back();
+        nodeX.push_back(0);
+        nodeY.push_back(0);
+        hasCoordinates.push_back(0);
+        return index;
+    }
+
+    double straightLine(int from, int to) const {
+        double dx = nodeX[from] - nodeX[to];
+        double dy = nodeY[from] - nodeY[to];
+        return std::sqrt(dx * dx + dy * dy);
+    }
+
+    // Traffic never drops below 1.0, so an arc is admissible when its distance covers the straight line
+    bool arcAdmissible(int from, const Arc& arc) const {
+        if (!hasCoordinates[from] || !hasCoordinates[arc.target]) {
+            return false;
+        }
+        return arc.cost() >= straightLine(from, arc.target) * (1.0 - 1e-9);
+    }
+
+    void recountInadmissibleArcs() {
+        inadmissibleArcs = 0;
+        for (size_t node = 0; node < indexToId.size(); ++node) {
+            forEachArc(static_cast<int>(node), [&](const Arc& arc) {
+                if (!arcAdmissible(static_cast<int>(node), arc)) inadmissibleArcs++;
+            });
+        }
+    }
+
+    Arc* findArc(int from, int to) {
+        for (size_t i = firstArc[from]; i < firstArc[from + 1]; ++i) {
+            if (arcs[i].target == to) return &arcs[i];
+        }
+        for (auto& arc : overflowArcs[from]) {
+            if (arc.target == to) return &arc;
+        }
+        return nullptr;
+    }
+
+    // Merge the overflow lists back into the CSR arrays
+    void rebuild() {
+        size_t nodeCount = indexToId.size();
+        std::vector<size_t> newFirst(nodeCount + 1, 0);
+        std::vector<Arc> newArcs;
+        newArcs.reserve(arcs.size() + overflowCount);
+
+        for (size_t node = 0; node < nodeCount; ++node) {
+            newFirst[node] = newArcs.size();
+            newArcs.insert(newArcs.end(), arcs.begin() + firstArc[node], arcs.begin() + firstArc[node + 1]);
+            newArcs.insert(newArcs.end(), overflowArcs[node].begin(), overflowArcs[node].end());
+            overflowArcs[node].clear();
+        }
+        newFirst[nodeCount] = newArcs.size();
+
+        firstArc.swap(newFirst);
+        arcs.swap(newArcs);
+        overflowCount = 0;
+    }
+
+    size_t edgeCountLocked() const {
+        return arcs.size() + overflowCount;
+    }
+
+    template <typename Visitor>
+    void forEachArc(int node, Visitor&& visit) const {
+        for (size_t i = firstArc[node]; i < firstArc[node + 1]; ++i) {
+            visit(arcs[i]);
+        }
+        for (const auto& arc : overflowArcs[node]) {
+            visit(arc);
+        }
+    }
+
+public:
+    RoadGraph() : firstArc(1, 0) {}
+
+    // Replace the whole graph, e.g. when loading the edges table at startup
+    void load(const std::vector<Location>& locations, const std::vector<std::tuple<int, int, double, double>>& edges) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        indexToId.clear();
+        idToIndex.clear();
+        sparseIdToIndex.clear();
+        firstArc.assign(1, 0);
+        arcs.clear();
+        overflowArcs.clear();
+        overflowCount = 0;
+        nodeX.clear();
+        nodeY.clear();
+        hasCoordinates.clear();
+
+        for (const auto& location : locations) {
+            int index = ensureNode(location.id);
+            nodeX[index] = location.x;
+            nodeY[index] = location.y;
+            hasCoordinates[index] = 1;
+        }
+        for (const auto& edge : edges) {
+            ensureNode(std::get<0>(edge));
+            ensureNode(std::get<1>(edge));
+        }
+
+        // Counting sort of the edges by source index
+        size_t nodeCount = indexToId.size();
+        std::vector<size_t> degree(nodeCount + 1, 0);
+        for (const auto& edge : edges) {
+            degree[lookupIndex(std::get<0>(edge)) + 1]++;
+        }
+        firstArc.assign(nodeCount + 1, 0);
+        for (size_t node = 0; node < nodeCount; ++node) {
+            firstArc[node + 1] = firstArc[node] + degree[node + 1];
+        }
+        arcs.resize(edges.size());
+        std::vector<size_t> fill(firstArc.begin(), firstArc.end() - 1);
+        for (const auto& edge : edges) {
+            int from = lookupIndex(std::get<0>(edge));
+            arcs[fill[from]++] = {lookupIndex(std::get<1>(edge)), std::get<2>(edge), std::get<3>(edge)};
+        }
+        recountInadmissibleArcs();
+        topologyVersion++;
+        metricVersion++;
+    }
+
+    void addNode(int id, double x, double y) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        int index = ensureNode(id);
+        bool hadArcs = hasCoordinates[index] == 0 && edgeCountLocked() > 0;
+        nodeX[index] = x;
+        nodeY[index] = y;
+        hasCoordinates[index] = 1;
+        if (hadArcs) {
+            recountInadmissibleArcs(); // Edges may have referenced this location before it existed
+        }
+    }
+
+    // Insert or replace the directed edge source -> destination
+    void setEdge(int source, int destination, double distance, double traffic) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        int from = ensureNode(source);
+        int to = ensureNode(destination);
+
+        if (Arc* arc = findArc(from, to)) {
+            inadmissibleArcs -= arcAdmissible(from, *arc) ? 0 : 1;
+            arc->distance = distance;
+            arc->traffic = traffic;
+            inadmissibleArcs += arcAdmissible(from, *arc) ? 0 : 1;
+            metricVersion++;
+            return;
+        }
+
+        overflowArcs[from].push_back({to, distance, traffic});
+        overflowCount++;
+        inadmissibleArcs += arcAdmissible(from, overflowArcs[from].back()) ? 0 : 1;
+        topologyVersion++;
+        metricVersion++;
+        if (overflowCount > std::max<size_t>(1024, arcs.size() / 8)) {
+            rebuild();
+        }
+    }
+
+    // Add to the traffic factor of an existing edge; returns false if there is no such edge
+    bool addTraffic(int source, int destination, double additionalTraffic) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        int from = lookupIndex(source);
+        int to = lookupIndex(destination);
+        if (from < 0 || to < 0) {
+            return false;
+        }
+        Arc* arc = findArc(from, to);
+        if (!arc) {
+            return false;
+        }
+        inadmissibleArcs -= arcAdmissible(from, *arc) ? 0 : 1;
+        arc->traffic += additionalTraffic;
+        inadmissibleArcs += arcAdmissible(from, *arc) ? 0 : 1;
+        metricVersion++;
+        return true;
+    }
+
+    size_t nodeCount() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return indexToId.size();
+    }
+
+    size_t edgeCount() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return edgeCountLocked();
+    }
+
+    uint64_t currentTopologyVersion() const {
+        return topologyVersion.load();
+    }
+
+    uint64_t currentMetricVersion() const {
+        return metricVersion.load();
+    }
+
+    Snapshot snapshot() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        Snapshot result;
+        result.nodeIds = indexToId;
+        result.edges.reserve(edgeCountLocked());
+        for (size_t node = 0; node < indexToId.size(); ++node) {
+            forEachArc(static_cast<int>(node), [&](const Arc& arc) {
+                result.edges.push_back({static_cast<int>(node), arc.target, arc.cost()});
+            });
+        }
+        result.topologyVersion = topologyVersion.load();
+        result.metricVersion = metricVersion.load();
+        return result;
+    }
+
+    // Dense node index for a location ID, or -1
+    int indexOf(int id) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return lookupIndex(id);
+    }
+
+    // Whether straight-line distance is currently a lower bound on every edge cost
+    bool heuristicAdmissible() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return inadmissibleArcs == 0;
+    }
+
+    // One-to-many Dijkstra: cost from sourceId to each target (infinity if unreachable).
+    // The search stops as soon as every reachable target has been settled.
+    std::vector<double> costsFrom(int sourceId, const std::vector<int>& targetIds) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        std::vector<double> costs(targetIds.size(), std::numeric_limits<double>::infinity());
+
+        int source = lookupIndex(sourceId);
+        if (source < 0) {
+            return costs;
+        }
+
+        static thread_local SearchSpace space;
+        space.prepare(indexToId.size());
+
+        // Targets still to be settled, by node; duplicates in targetIds share one node
+        std::unordered_map<int, std::vector<size_t>> pendingTargets;
+        for (size_t i = 0; i < targetIds.size(); ++i) {
+            int target = lookupIndex(targetIds[i]);
+            if (target >= 0) pendingTargets[target].push_back(i);
+        }
+
+        std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<>> pq;
+        space.set(source, 0, -1);
+        pq.push({0, source});
+        size_t settled = 0;
+
+        while (!pq.empty() && !pendingTargets.empty()) {
+            auto [dist, current] = pq.top();
+            pq.pop();
+            if (dist > space.get(current)) {
+                continue; // Stale queue entry
+            }
+
+            auto target = pendingTargets.find(current);
+            if (target != pendingTargets.end()) {
+                for (size_t column : target->second) costs[column] = dist;
+                pendingTargets.erase(target);
+            }
+            ++settled;
+
+            forEachArc(current, [&](const Arc& arc) {
+                double alt = dist + arc.cost();
+                if (alt < space.get(arc.target)) {
+                    space.set(arc.target, alt, current);
+                    pq.push({alt, arc.target});
+                }
+            });
+        }
+        metrics().recordSettledNodes(Metrics::Search::OneToMany, settled);
+        return costs;
+    }
+
+    // Dijkstra's algorithm over edge cost distance * traffic_factor. A* adds the
+    // straight-line distance to the target as a heuristic; it falls back to plain
+    // Dijkstra whenever some edge is cheaper than its straight line, since the
+    // heuristic would then overestimate and could miss the shortest path.
+    PathResult shortestPath(int startId, int endId, RoutingAlgorithm algorithm = RoutingAlgorithm::Dijkstra) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        PathResult result;
+
+        int start = lookupIndex(startId);
+        int end = lookupIndex(endId);
+        if (start < 0 || end < 0) {
+            return result;
+        }
+
+        bool useHeuristic = algorithm == RoutingAlgorithm::AStar && inadmissibleArcs == 0 && hasCoordinates[end];
+        result.algorithm = useHeuristic ? RoutingAlgorithm::AStar : RoutingAlgorithm::Dijkstra;
+        auto heuristic = [&](int node) {
+            return useHeuristic ? straightLine(node, end) : 0.0;
+        };
+
+        static thread_local SearchSpace space;
+        space.prepare(indexToId.size());
+
+        // Entries are (distance + heuristic, distance, node)
+        typedef std::tuple<double, double, int> QueueEntry;
+        std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<>> pq;
+        space.set(start, 0, -1);
+        pq.push({heuristic(start), 0, start});
+
+        while (!pq.empty()) {
+            auto [key, dist, current] = pq.top();
+            pq.pop();
+            if (dist > space.get(current)) {
+                continue; // Stale queue entry
+            }
+            result.settledNodes++;
+
+            if (current == end) {
+                break; // We've reached the destination
+            }
+
+            forEachArc(current, [&](const Arc& arc) {
+                double alt = dist + arc.cost();
+                if (alt < space.get(arc.target)) {
+                    space.set(arc.target, alt, current);
+                    pq.push({alt + heuristic(arc.target), alt, arc.target});
+                }
+            });
+        }
+
+        metrics().recordSettledNodes(useHeuristic ? Metrics::Search::AStar : Metrics::Search::Dijkstra, result.settledNodes);
+        result.cost = space.get(end);
+        if (result.cost == std::numeric_limits<double>::infinity()) {
+            return result; // No path found
+        }
+
+        for (int at = end; at != -1; at = space.parent[at]) {
+            result.path.push_back(indexToId[at]);
+        }
+        std::reverse(result.path.begin(), result.path.end());
+        return result;
+    }
+};
+
+// Customizable contraction hierarchy (CCH) built from a RoadGraph snapshot.
+// Contraction only looks at the topology: nodes are eliminated in minimum-degree
+// order and every fill-in edge becomes a shortcut. Edge costs are applied
+// afterwards by customize(), which relaxes the lower triangles of the hierarchy
+// bottom-up, so traffic changes never require a new contraction. Queries run a
+// bidirectional upward search and unpack shortcuts back into location IDs.
+class ContractionHierarchy {
+private:
+    std::vector<int> nodeIds;           // dense node index -> location ID
+    std::vector<int> rank;              // contraction position of each node
+    std::vector<int> byRank;            // node at each contraction position
+    std::vector<size_t> upFirst;        // upward arcs of v: upHead[upFirst[v] .. upFirst[v + 1]), sorted by head
+    std::vector<int> upHead;
+    std::vector<double> upWeight;       // cost tail -> head
+    std::vector<double> downWeight;     // cost head -> tail
+    std::vector<int> upMiddle;          // node the tail -> head cost is routed through, -1 for an original edge
+    std::vector<int> downMiddle;        // same for head -> tail
+    uint64_t topologyVersion = 0;
+    uint64_t metricVersion = 0;
+
+    struct Labels {
+        std::vector<double> distance;
+        std::vector<int> parent;
+        std::vector<uint32_t> stamp;
+        std::vector<int> touched;
+        uint32_t round = 0;
+
+        void prepare(size_t nodeCount) {
+            if (stamp.size() < nodeCount) {
+                distance.resize(nodeCount);
+                parent.resize(nodeCount);
+                stamp.resize(nodeCount, 0);
+            }
+            if (++round == 0) {
+                std::fill(stamp.begin(), stamp.end(), 0);
+                round = 1;
+            }
+            touched.clear();
+        }
+
+        double get(int node) const {
+            return stamp[node] == round ? distance[node] : std::numeric_limits<double>::infinity();
+        }
+
+        void set(int node, double dist, int from) {
+            if (stamp[node] != round) touched.push_back(node);
+            stamp[node] = round;
+            distance[node] = dist;
+            parent[node] = from;
+        }
+    };
+
+    // Arc between two nodes of the hierarchy, stored at the lower-ranked one; -1 if absent
+    int findArc(int a, int b) const {
+        int tail = rank[a] < rank[b] ? a : b;
+        int head = tail == a ? b : a;
+        auto begin = upHead.begin() + upFirst[tail];
+        auto end = upHead.begin() + upFirst[tail + 1];
+        auto it = std::lower_bound(begin, end, head);
+        return (it != end && *it == head) ? static_cast<int>(it - upHead.begin()) : -1;
+    }
+
+    // Cost of travelling a -> b along their hierarchy arc
+    double arcCost(int arc, int a, int b) const {
+        return rank[a] < rank[b] ? upWeight[arc] : downWeight[arc];
+    }
+
+    void contract(const RoadGraph::Snapshot& snapshot) {
+        size_t nodeCount = nodeIds.size();
+        std::vector<std::vector<int>> neighbors(nodeCount);
+        for (const auto& edge : snapshot.edges) {
+            if (edge.from == edge.to) continue;
+            neighbors[edge.from].push_back(edge.to);
+            neighbors[edge.to].push_back(edge.from);
+        }
+        for (auto& list : neighbors) {
+            std::sort(list.begin(), list.end());
+            list.erase(std::unique(list.begin(), list.end()), list.end());
+        }
+
+        // Minimum-degree elimination; a node's neighbours at elimination time become its upward arcs
+        rank.assign(nodeCount, -1);
+        byRank.clear();
+        std::vector<std::vector<int>> upward(nodeCount);
+        std::priority_queue<std::pair<size_t, int>, std::vector<std::pair<size_t, int>>, std::greater<>> pq;
+        for (size_t node = 0; node < nodeCount; ++node) {
+            pq.push({neighbors[node].size(), static_cast<int>(node)});
+        }
+
+        std::vector<int> merged;
+        while (!pq.empty()) {
+            auto [degree, node] = pq.top();
+            pq.pop();
+            if (rank[node] >= 0 || degree != neighbors[node].size()) {
+                continue; // Already eliminated or stale degree
+            }
+            rank[node] = static_cast<int>(byRank.size());
+            byRank.push_back(node);
+            upward[node].swap(neighbors[node]);
+
+            // Turn the remaining neighbourhood into a clique
+            const auto& clique = upward[node];
+            for (int neighbor : clique) {
+                auto& list = neighbors[neighbor];
+                merged.clear();
+                std::set_union(list.begin(), list.end(), clique.begin(), clique.end(), std::back_inserter(merged));
+                merged.erase(std::remove_if(merged.begin(), merged.end(),
+                                            [&](int other) { return other == node || other == neighbor; }),
+                             merged.end());
+                list.swap(merged);
+                pq.push({list.size(), neighbor});
+            }
+        }
+
+        upFirst.assign(nodeCount + 1, 0);
+        upHead.clear();
+        for (size_t node = 0; node < nodeCount; ++node) {
+            upFirst[node] = upHead.size();
+            upHead.insert(upHead.end(), upward[node].begin(), upward[node].end());
+        }
+        upFirst[nodeCount] = upHead.size();
+    }
+
+    // Upward Dijkstra from source; forward searches use tail -> head costs, backward ones head -> tail
+    size_t upwardSearch(int source, bool forward, Labels& labels) const {
+        size_t settled = 0;
+        std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<>> pq;
+        labels.set(source, 0, -1);
+        pq.push({0, source});
+
+        const std::vector<double>& weight = forward ? upWeight : downWeight;
+        while (!pq.empty()) {
+            auto [dist, node] = pq.top();
+            pq.pop();
+            if (dist > labels.get(node)) continue;
+            settled++;
+
+            for (size_t arc = upFirst[node]; arc < upFirst[node + 1]; ++arc) {
+                double alt = dist + weight[arc];
+                int head = upHead[arc];
+                if (alt < labels.get(head)) {
+                    labels.set(head, alt, node);
+                    pq.push({alt, head});
+                }
+            }
+        }
+        return settled;
+    }
+
+public:
+    explicit ContractionHierarchy(const RoadGraph::Snapshot& snapshot)
+        : nodeIds(snapshot.nodeIds), topologyVersion(snapshot.topologyVersion) {
+        contract(snapshot);
+        customize(snapshot);
+    }
+
+    // Apply the snapshot's edge costs to the existing hierarchy. The snapshot must
+    // come from the same topology version the hierarchy was contracted from.
+    void customize(const RoadGraph::Snapshot& snapshot) {
+        const double infinity = std::numeric_limits<double>::infinity();
+        upWeight.assign(upHead.size(), infinity);
+        downWeight.assign(upHead.size(), infinity);
+        upMiddle.assign(upHead.size(), -1);
+        downMiddle.assign(upHead.size(), -1);
+
+        for (const auto& edge : snapshot.edges) {
+            if (edge.from == edge.to) continue;
+            int arc = findArc(edge.from, edge.to);
+            double& weight = rank[edge.from] < rank[edge.to] ? upWeight[arc] : downWeight[arc];
+            weight = std::min(weight, edge.cost);
+        }
+
+        // Every pair of upward arcs (w,x), (w,y) closes a lower triangle over the arc (x,y).
+        // Processing w in contraction order finalizes its arcs before they are used.
+        for (int w : byRank) {
+            for (size_t i = upFirst[w]; i < upFirst[w + 1]; ++i) {
+                for (size_t j = i + 1; j < upFirst[w + 1]; ++j) {
+                    size_t toX = i, toY = j;
+                    if (rank[upHead[toX]] > rank[upHead[toY]]) std::swap(toX, toY);
+                    int arc = findArc(upHead[toX], upHead[toY]);
+
+                    double viaUp = downWeight[toX] + upWeight[toY];    // x -> w -> y
+                    if (viaUp < upWeight[arc]) {
+                        upWeight[arc] = viaUp;
+                        upMiddle[arc] = w;
+                    }
+                    double viaDown = downWeight[toY] + upWeight[toX];  // y -> w -> x
+                    if (viaDown < downWeight[arc]) {
+                        downWeight[arc] = viaDown;
+                        downMiddle[arc] = w;
+                    }
+                }
+            }
+        }
+        metricVersion = snapshot.metricVersion;
+    }
+
+    uint64_t builtTopologyVersion() const {
+        return topologyVersion;
+    }
+
+    uint64_t builtMetricVersion() const {
+        return metricVersion;
+    }
+
+    size_t nodeCount() const {
+        return nodeIds.size();
+    }
+
+    // Number of arcs in the hierarchy, original edges plus shortcuts
+    size_t arcCount() const {
+        return upHead.size();
+    }
+
+    // Point-to-point query between dense node indices
+    RoadGraph::PathResult shortestPath(int start, int end) const {
+        RoadGraph::PathResult result;
+        result.algorithm = RoutingAlgorithm::ContractionHierarchy;
+        if (start < 0 || end < 0 || start >= static_cast<int>(nodeIds.size()) || end >= static_cast<int>(nodeIds.size())) {
+            return result;
+        }
+
+        static thread_local Labels forward, backward;
+        forward.prepare(nodeIds.size());
+        backward.prepare(nodeIds.size());
+        result.settledNodes = upwardSearch(start, true, forward) + upwardSearch(end, false, backward);
+        metrics().recordSettledNodes(Metrics::Search::ContractionHierarchy, result.settledNodes);
+
+        int meet = -1;
+        for (int node : forward.touched) {
+            double total = forward.get(node) + backward.get(node);
+            if (total < result.cost) {
+                result.cost = total;
+                meet = node;
+            }
+        }
+        if (meet < 0) {
+            return result; // No path found
+        }
+
+        // Hierarchy-level path start -> meet -> end
+        std::vector<int> hops;
+        for (int at = meet; at != -1; at = forward.parent[at]) hops.push_back(at);
+        std::reverse(hops.begin(), hops.end());
+        for (int at = backward.parent[meet]; at != -1; at = backward.parent[at]) hops.push_back(at);
+
+        // Unpack shortcuts: a hop a -> b routed through m becomes a -> m -> b
+        std::vector<std::pair<int, int>> pending;
+        for (size_t i = hops.size(); i-- > 1;) {
+            pending.push_back({hops[i - 1], hops[i]});
+        }
+        result.path.push_back(nodeIds[start]);
+        while (!pending.empty()) {
+            auto [from, to] = pending.back();
+            pending.pop_back();
+            int arc = findArc(from, to);
+            int middle = rank[from] < rank[to] ? upMiddle[arc] : downMiddle[arc];
+            if (middle < 0) {
+                result.path.push_back(nodeIds[to]);
+            } else {
+                pending.push_back({middle, to});
+                pending.push_back({from, middle});
+            }
+        }
+        return result;
+    }
+};
+
+// Prepared statements for one SQLite connection, keyed by SQL text. Each query
+// is parsed and planned once; later uses get the same statement back after
+// sqlite3_reset/sqlite3_clear_bindings. A statement that is still in use
+// further up the call stack is never handed out twice: the second caller gets
+// a one-off statement that is finalized when released.
+class StatementCache {
+private:
+    struct Entry {
+        sqlite3_stmt* stmt = nullptr;
+        bool inUse = false;
+    };
+
+    sqlite3* db;
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::atomic<uint64_t> hitCount{0};
+    std::atomic<uint64_t> missCount{0};
+
+    void release(sqlite3_stmt* stmt, Entry* entry) {
+        if (!entry) {
+            sqlite3_finalize(stmt);
+            return;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        std::lock_guard<std::mutex> lock(mutex);
+        entry->inUse = false;
+    }
+
+public:
+    // Scoped use of a statement; converts to sqlite3_stmt* and is null if preparing failed
+    class Handle {
+    private:
+        StatementCache* cache = nullptr;
+        sqlite3_stmt* stmt = nullptr;
+        Entry* entry = nullptr;     // null for one-off statements
+        std::chrono::steady_clock::time_point acquired;
+
+    public:
+        Handle() = default;
+        Handle(StatementCache* cache, sqlite3_stmt* stmt, Entry* entry)
+            : cache(cache), stmt(stmt), entry(entry), acquired(std::chrono::steady_clock::now()) {}
+        Handle(Handle&& other) noexcept : cache(other.cache), stmt(other.stmt), entry(other.entry), acquired(other.acquired) {
+            other.stmt = nullptr;
+        }
+        Handle& operator=(Handle&& other) noexcept {
+            if (this != &other) {
+                reset();
+                cache = other.cache;
+                stmt = other.stmt;
+                entry = other.entry;
+                acquired = other.acquired;
+                other.stmt = nullptr;
+            }
+            return *this;
+        }
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+
+        ~Handle() {
+            reset();
+        }
+
+        // Return the statement to the cache early
+        void reset() {
+            if (stmt) {
+                metrics().recordStatement(std::chrono::steady_clock::now() - acquired);
+                tracer().recordSpan("sql", sqlite3_sql(stmt), acquired);
+                cache->release(stmt, entry);
+                stmt = nullptr;
+            }
+        }
+
+        operator sqlite3_stmt*() const {
+            return stmt;
+        }
+    };
+
+    explicit StatementCache(sqlite3* db) : db(db) {}
+
+    ~StatementCache() {
+        for (auto& entry : entries) {
+            sqlite3_finalize(entry.second.stmt);
+        }
+    }
+
+    StatementCache(const StatementCache&) = delete;
+    StatementCache& operator=(const StatementCache&) = delete;
+
+    Handle acquire(const std::string& sql) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(sql);
+            if (it != entries.end() && !it->second.inUse) {
+                it->second.inUse = true;
+                hitCount++;
+                return Handle(this, it->second.stmt, &it->second);
+            }
+        }
+
+        missCount++;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v3(db, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+            return Handle();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto inserted = entries.emplace(sql, Entry());
+        if (!inserted.second) {
+            return Handle(this, stmt, nullptr); // Cached copy is busy; use a one-off statement
+        }
+        inserted.first->second.stmt = stmt;
+        inserted.first->second.inUse = true;
+        return Handle(this, stmt, &inserted.first->second);
+    }
+
+    uint64_t hits() const {
+        return hitCount.load();
+    }
+
+    uint64_t misses() const {
+        return missCount.load();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+};
+
+// Per-query timing from SQLite's trace hooks: call count, total, median,
+// 99th percentile and maximum run time, and rows returned, keyed by SQL text
+// with literals replaced by "?". Runs slower than the threshold are logged.
+// Attach to a connection only while the connection is not in use.
+class StatementProfiler {
+private:
+    // Quarter-octave buckets of nanoseconds: values below 4 have their own
+    // bucket, then each power of two is split into four
+    static constexpr size_t kBuckets = 4 * 63;
+
+    struct Query {
+        uint64_t calls = 0;
+        uint64_t rows = 0;
+        uint64_t totalNs = 0;
+        uint64_t maxNs = 0;
+        std::array<uint32_t, kBuckets> buckets{};
+    };
+
+    sqlite3* db = nullptr;
+    std::mutex mutex;
+    std::unordered_map<std::string, Query> queries;
+    // Statements between their first step and their reset
+    struct Run {
+        std::chrono::steady_clock::time_point started;
+        uint64_t rows = 0;
+    };
+    std::unordered_map<sqlite3_stmt*, Run> running;
+    std::atomic<int64_t> slowThresholdNs{100 * 1000000LL};
+
+    static size_t bucketOf(uint64_t ns) {
+        if (ns < 4) {
+            return static_cast<size_t>(ns);
+        }
+        int exponent = 63;
+        while (!(ns >> exponent)) --exponent;
+        size_t index = 4 * (exponent - 1) + ((ns >> (exponent - 2)) & 3);
+        return std::min(index, kBuckets - 1);
+    }
+
+    // Largest value in a bucket
+    static uint64_t upperBoundOf(size_t bucket) {
+        if (bucket < 4) {
+            return bucket;
+        }
+        int exponent = static_cast<int>(bucket / 4) + 1;
+        uint64_t quarter = 1ULL << (exponent - 2);
+        return (4 + bucket % 4 + 1) * quarter - 1;
+    }
+
+    static uint64_t percentile(const Query& query, double fraction) {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * query.calls));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += query.buckets[i];
+            if (seen >= rank && seen > 0) {
+                return std::min(upperBoundOf(i), query.maxNs);
+            }
+        }
+        return query.maxNs;
+    }
+
+    // Literals become "?" so one query built with different values is one entry
+    static std::string normalize(const char* sql) {
+        std::string result;
+        for (const char* c = sql; *c; ++c) {
+            if (*c == '\'') {
+                // Skip to the closing quote; a doubled quote is part of the literal
+                ++c;
+                while (*c && !(*c == '\'' && c[1] != '\'')) {
+                    c += *c == '\'' ? 2 : 1;
+                }
+                result += '?';
+                if (!*c) break;
+            } else if (std::isdigit(static_cast<unsigned char>(*c)) &&
+                       (result.empty() || !(std::isalnum(static_cast<unsigned char>(result.back())) || result.back() == '_'))) {
+                while (std::isalnum(static_cast<unsigned char>(c[1])) || c[1] == '.') ++c;
+                result += '?';
+            } else if (std::isspace(static_cast<unsigned char>(*c))) {
+                if (!result.empty() && result.back() != ' ') result += ' ';
+            } else {
+                result += *c;
+            }
+        }
+        while (!result.empty() && result.back() == ' ') result.pop_back();
+        return result;
+    }
+
+    static int onTrace(unsigned event, void* context, void* statement, void* detail) {
+        auto* profiler = static_cast<StatementProfiler*>(context);
+        auto* stmt = static_cast<sqlite3_stmt*>(statement);
+        if (event == SQLITE_TRACE_STMT) {
+            // Also fires for each trigger program the statement runs; keep the first start
+            std::lock_guard<std::mutex> lock(profiler->mutex);
+            profiler->running.emplace(stmt, Run{std::chrono::steady_clock::now(), 0});
+        } else if (event == SQLITE_TRACE_ROW) {
+            std::lock_guard<std::mutex> lock(profiler->mutex);
+            profiler->running[stmt].rows++;
+        } else if (event == SQLITE_TRACE_PROFILE) {
+            profiler->finished(stmt, *static_cast<sqlite3_int64*>(detail));
+        }
+        return 0;
+    }
+
+    // SQLite's own elapsed time comes from the VFS clock, often only to the
+    // millisecond, so it is used only for runs that began before attach
+    void finished(sqlite3_stmt* stmt, int64_t sqliteNs) {
+        auto now = std::chrono::steady_clock::now();
+        std::string sql = normalize(sqlite3_sql(stmt));
+        uint64_t rows = 0;
+        uint64_t ns = static_cast<uint64_t>(std::max<int64_t>(sqliteNs, 0));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto run = running.find(stmt);
+            if (run != running.end()) {
+                rows = run->second.rows;
+                ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - run->second.started).count();
+                running.erase(run);
+            }
+            Query& query = queries[sql];
+            query.calls++;
+            query.rows += rows;
+            query.totalNs += ns;
+            query.maxNs = std::max(query.maxNs, ns);
+            query.buckets[bucketOf(ns)]++;
+        }
+        if (static_cast<int64_t>(ns) >= slowThresholdNs.load(std::memory_order_relaxed)) {
+            char* expanded = sqlite3_expanded_sql(stmt);
+            std::cerr << "Slow query (" << ns / 1e6 << " ms, " << rows << " rows): "
+                      << (expanded ? expanded : sql.c_str()) << std::endl;
+            sqlite3_free(expanded);
+        }
+    }
+
+public:
+    StatementProfiler() = default;
+    StatementProfiler(const StatementProfiler&) = delete;
+    StatementProfiler& operator=(const StatementProfiler&) = delete;
+
+    ~StatementProfiler() {
+        detach();
+    }
+
+    void attach(sqlite3* connection) {
+        detach();
+        db = connection;
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_ROW | SQLITE_TRACE_PROFILE, &StatementProfiler::onTrace, this);
+    }
+
+    void detach() {
+        if (db) {
+            sqlite3_trace_v2(db, 0, nullptr, nullptr);
+            db = nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        running.clear();
+    }
+
+    bool attached() const {
+        return db != nullptr;
+    }
+
+    // Runs at least this long are logged to stderr; negative disables the log
+    void setSlowThreshold(std::chrono::microseconds threshold) {
+        slowThresholdNs.store(threshold.count() < 0 ? std::numeric_limits<int64_t>::max() : threshold.count() * 1000,
+                              std::memory_order_relaxed);
+    }
+
+    double slowThresholdMs() const {
+        int64_t ns = slowThresholdNs.load(std::memory_order_relaxed);
+        return ns == std::numeric_limits<int64_t>::max() ? -1.0 : ns / 1e6;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        queries.clear();
+    }
+
+    // Queries as a JSON array, most total time first
+    std::string json() {
+        std::vector<std::pair<std::string, Query>> sorted;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sorted.assign(queries.begin(), queries.end());
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, Query>& a, const std::pair<std::string, Query>& b) {
+            return a.second.totalNs > b.second.totalNs;
+        });
+
+        std::ostringstream json;
+        json << std::fixed << std::setprecision(3) << "[";
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            const Query& query = sorted[i].second;
+            json << (i > 0 ? "," : "")
+                 << "{\"sql\":\"" << escape_json(sorted[i].first) << "\""
+                 << ",\"calls\":" << query.calls
+                 << ",\"rows\":" << query.rows
+                 << ",\"totalMs\":" << query.totalNs / 1e6
+                 << ",\"meanMs\":" << query.totalNs / 1e6 / query.calls
+                 << ",\"p50Ms\":" << percentile(query, 0.50) / 1e6
+                 << ",\"p99Ms\":" << percentile(query, 0.99) / 1e6
+                 << ",\"maxMs\":" << query.maxNs / 1e6 << "}";
+        }
+        json << "]";
+        return json.str();
+    }
+};
+
+// Collects order IDs and hands them to a callback in batches, once the oldest
+// queued order has waited for the window or the batch is full. The callback
+// runs on the batcher's own thread.
+class OrderBatcher {
+public:
+    struct Settings {
+        bool enabled = false;
+        int windowMs = 2000;
+        size_t maxOrders = 32;
+    };
+
+private:
+    std::function<void(const std::vector<int>&)> dispatch;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<int> queue;
+    std::chrono::steady_clock::time_point deadline;   // when the current batch is due
+    Settings settings;
+    bool stopping = false;
+    std::thread thread;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            bool due = !queue.empty() && (stopping || !settings.enabled || queue.size() >= settings.maxOrders ||
+                                          std::chrono::steady_clock::now() >= deadline);
+            if (due) {
+                std::vector<int> batch;
+                batch.swap(queue);
+                lock.unlock();
+                dispatch(batch);
+                lock.lock();
+                continue;
+            }
+            if (stopping) {
+                break;
+            }
+            if (queue.empty()) {
+                wake.wait(lock);
+            } else {
+                wake.wait_until(lock, deadline);
+            }
+        }
+    }
+
+public:
+    explicit OrderBatcher(std::function<void(const std::vector<int>&)> dispatch)
+        : dispatch(std::move(dispatch)) {
+        thread = std::thread([this] { run(); });
+    }
+
+    ~OrderBatcher() {
+        stop();
+    }
+
+    OrderBatcher(const OrderBatcher&) = delete;
+    OrderBatcher& operator=(const OrderBatcher&) = delete;
+
+    // Dispatch whatever is queued and end the thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // Queue an order; returns false when batching is off and the caller should assign it itself
+    bool enqueue(int orderId) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!settings.enabled || stopping) {
+                return false;
+            }
+            if (queue.empty()) {
+                deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(settings.windowMs);
+            }
+            queue.push_back(orderId);
+        }
+        wake.notify_all();
+        return true;
+    }
+
+    // Remove and return the queued orders, e.g. to dispatch them right away
+    std::vector<int> takeAll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<int> batch;
+        batch.swap(queue);
+        return batch;
+    }
+
+    // Turning batching off dispatches anything still queued
+    void configure(const Settings& newSettings) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            settings = newSettings;
+            if (!queue.empty()) {
+                deadline = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(settings.windowMs));
+            }
+        }
+        wake.notify_all();
+    }
+
+    Settings current() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return settings;
+    }
+
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+};
+
+// Orders no driver could take, retried oldest first whenever capacity may have
+// freed up. Nothing is polled: the thread sleeps until notify() reports a capacity
+// event, and events that arrive during a pass are folded into one more pass.
+// The retry callback runs on the scheduler's own thread and returns true once
+// the order no longer needs a driver.
+class RedispatchScheduler {
+private:
+    std::function<bool(int)> retry;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::set<std::pair<uint64_t, int>> queue;          // (arrival sequence, order ID), oldest first
+    std::unordered_map<int, uint64_t> arrivalOf;       // order ID -> its key in queue
+    uint64_t nextArrival = 0;
+    bool signalled = false;
+    bool stopping = false;
+    uint64_t passes = 0;
+    uint64_t retries = 0;
+    std::thread thread;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return signalled || stopping; });
+            if (stopping) {
+                break;
+            }
+            signalled = false;
+            ++passes;
+            std::vector<int> snapshot;
+            for (const auto& entry : queue) {
+                snapshot.push_back(entry.second);
+            }
+            lock.unlock();
+            for (int orderId : snapshot) {
+                bool done = retry(orderId);
+                lock.lock();
+                ++retries;
+                if (done) {
+                    eraseLocked(orderId);
+                }
+                bool halt = stopping;
+                lock.unlock();
+                if (halt) {
+                    break;
+                }
+            }
+            lock.lock();
+        }
+    }
+
+    void eraseLocked(int orderId) {
+        auto it = arrivalOf.find(orderId);
+        if (it != arrivalOf.end()) {
+            queue.erase({it->second, orderId});
+            arrivalOf.erase(it);
+        }
+    }
 
-#include <sqlite3.h>
+public:
+    explicit RedispatchScheduler(std::function<bool(int)> retry)
+        : retry(std::move(retry)) {
+        thread = std::thread([this] { run(); });
+    }
 
-// Define simple JSON handling functions
-std::string escape_json(const std::string& s) {
-    std::ostringstream o;
-    for (auto c = s.cbegin(); c != s.cend(); c++) {
-        if (*c == '"' || *c == '\\' || ('\x00' <= *c && *c <= '\x1f')) {
-            o << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(*c);
-        } else {
-            o << *c;
+    ~RedispatchScheduler() {
+        stop();
+    }
+
+    RedispatchScheduler(const RedispatchScheduler&) = delete;
+    RedispatchScheduler& operator=(const RedispatchScheduler&) = delete;
+
+    // End the thread; orders still waiting stay Pending in the database
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (thread.joinable()) {
+            thread.join();
         }
     }
-    return o.str();
-}
 
-// Helper function to check if string ends with a specific suffix (replacement for C++20's ends_with)
-bool ends_with(const std::string& str, const std::string& suffix) {
-    if (str.length() < suffix.length())
-        return false;
-    return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
-}
+    // Start waiting for a driver; an order already waiting keeps its place
+    void add(int orderId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (arrivalOf.count(orderId) == 0) {
+            arrivalOf[orderId] = nextArrival;
+            queue.insert({nextArrival++, orderId});
+        }
+    }
 
-// Simple HTTP server using standard sockets
-class SimpleHttpServer {
-private:
-    int server_fd;
-    struct sockaddr_in address;
-    int port;
-    bool running;
-    
-    // Handler function type
-    typedef std::function<std::string(const std::string&, const std::string&, const std::string&)> HandlerFunction;
-    HandlerFunction handler;
+    void remove(int orderId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        eraseLocked(orderId);
+    }
+
+    // A driver was added, moved, had its limits raised or finished an order
+    void notify() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.empty()) {
+                return;
+            }
+            signalled = true;
+        }
+        wake.notify_all();
+    }
+
+    size_t waiting() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    uint64_t passCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return passes;
+    }
+
+    uint64_t retryCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return retries;
+    }
+};
 
+// Dispatch split over a rows x cols grid of regions covering the locations'
+// bounding box; points outside it belong to the nearest edge region. Each
+// region files the drivers standing in it and runs its own thread over the
+// orders whose restaurant lies in it, so orders in different regions are
+// dispatched in parallel. An order its region cannot place is handed off to
+// the adjacent regions, nearest first, and one none of them can place goes to
+// the fallback callback.
+class RegionalDispatcher {
 public:
-    SimpleHttpServer(int port = 8080) : port(port), running(false) {
-#ifdef _WIN32
-        // Initialize Winsock
-        WSADATA wsaData;
-        int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
-        if (result != 0) {
-            std::cerr << "WSAStartup failed: " << result << std::endl;
-            return;
+    // Try to place an order with one region's drivers; true once it needs no more dispatching
+    using Attempt = std::function<bool(const DriverIndex& drivers, int orderId)>;
+    using Fallback = std::function<void(int orderId)>;
+
+    struct RegionStats {
+        size_t drivers;
+        size_t queued;
+        uint64_t dispatched;    // orders placed with this region's drivers
+        uint64_t handedOff;     // orders passed on to a neighbouring region
+    };
+
+private:
+    struct Task {
+        int orderId;
+        std::vector<int> regions;   // regions still to try, in order; the front one holds the task
+    };
+
+    struct Region {
+        DriverIndex drivers;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<Task> queue;
+        std::atomic<uint64_t> dispatched{0};
+        std::atomic<uint64_t> handedOff{0};
+        std::thread thread;
+    };
+
+    Attempt attempt;
+    Fallback fallback;
+    int rows;
+    int cols;
+    double minX, minY;
+    double cellWidth, cellHeight;
+    std::vector<std::unique_ptr<Region>> regions;
+    std::atomic<bool> stopping{false};
+    // Region and location of every filed driver
+    std::mutex placementMutex;
+    std::unordered_map<int, std::pair<int, int>> placement;
+
+    int column(double x) const {
+        return std::min(cols - 1, std::max(0, static_cast<int>(std::floor((x - minX) / cellWidth))));
+    }
+
+    int row(double y) const {
+        return std::min(rows - 1, std::max(0, static_cast<int>(std::floor((y - minY) / cellHeight))));
+    }
+
+    // Squared distance from a point to a region's rectangle
+    double distanceTo(int region, double x, double y) const {
+        double left = minX + (region % cols) * cellWidth;
+        double bottom = minY + (region / cols) * cellHeight;
+        double dx = std::max({left - x, 0.0, x - (left + cellWidth)});
+        double dy = std::max({bottom - y, 0.0, y - (bottom + cellHeight)});
+        return dx * dx + dy * dy;
+    }
+
+    // Queue a task on its front region; after stop() the fallback takes it instead
+    void post(Task task) {
+        Region& region = *regions[task.regions.front()];
+        {
+            std::lock_guard<std::mutex> lock(region.mutex);
+            if (!stopping) {
+                region.queue.push_back(std::move(task));
+                region.wake.notify_one();
+                return;
+            }
         }
-#endif
+        fallback(task.orderId);
+    }
 
-        // Create socket
-        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-            std::cerr << "Socket creation failed" << std::endl;
-            return;
+    void run(int index) {
+        Region& region = *regions[index];
+        std::unique_lock<std::mutex> lock(region.mutex);
+        while (true) {
+            region.wake.wait(lock, [&] { return stopping || !region.queue.empty(); });
+            if (region.queue.empty()) {
+                break; // Stopping, and everything queued here has been handled
+            }
+            Task task = std::move(region.queue.front());
+            region.queue.pop_front();
+            lock.unlock();
+
+            if (attempt(region.drivers, task.orderId)) {
+                ++region.dispatched;
+            } else {
+                task.regions.erase(task.regions.begin());
+                if (task.regions.empty()) {
+                    fallback(task.orderId);
+                } else {
+                    ++region.handedOff;
+                    post(std::move(task));
+                }
+            }
+            lock.lock();
         }
+    }
 
-        // Set socket options
-        int opt = 1;
-#ifdef _WIN32
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) < 0) {
-#else
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-#endif
-            std::cerr << "Setsockopt failed" << std::endl;
-            return;
+    void fileLocked(int driverId, int locationId, double x, double y) {
+        int region = row(y) * cols + column(x);
+        auto it = placement.find(driverId);
+        if (it != placement.end() && it->second.first != region) {
+            regions[it->second.first]->drivers.remove(driverId);
         }
+        regions[region]->drivers.update(driverId, locationId, x, y);
+        placement[driverId] = {region, locationId};
+    }
 
-        address.sin_family = AF_INET;
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_port = htons(port);
+public:
+    // bounds is (minX, minY, maxX, maxY) of the area to split
+    RegionalDispatcher(int rows, int cols, const std::tuple<double, double, double, double>& bounds,
+                       Attempt attempt, Fallback fallback)
+        : attempt(std::move(attempt)), fallback(std::move(fallback)),
+          rows(std::max(1, rows)), cols(std::max(1, cols)),
+          minX(std::get<0>(bounds)), minY(std::get<1>(bounds)) {
+        double width = std::get<2>(bounds) - minX;
+        double height = std::get<3>(bounds) - minY;
+        cellWidth = width > 0 ? width / this->cols : 1.0;
+        cellHeight = height > 0 ? height / this->rows : 1.0;
+        for (int i = 0; i < this->rows * this->cols; ++i) {
+            regions.emplace_back(new Region());
+        }
+        for (int i = 0; i < this->rows * this->cols; ++i) {
+            regions[i]->thread = std::thread([this, i] { run(i); });
+        }
+    }
 
-        // Bind socket
-        if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-            std::cerr << "Bind failed" << std::endl;
-            return;
+    ~RegionalDispatcher() {
+        stop();
+    }
+
+    RegionalDispatcher(const RegionalDispatcher&) = delete;
+    RegionalDispatcher& operator=(const RegionalDispatcher&) = delete;
+
+    // Dispatch whatever is queued and end the threads
+    void stop() {
+        stopping = true;
+        for (auto& region : regions) {
+            std::lock_guard<std::mutex> lock(region->mutex);
+            region->wake.notify_all();
+        }
+        for (auto& region : regions) {
+            if (region->thread.joinable()) {
+                region->thread.join();
+            }
         }
+    }
 
-        // Listen
-        if (listen(server_fd, 10) < 0) {
-            std::cerr << "Listen failed" << std::endl;
-            return;
+    // Queue an order whose restaurant is at (x, y); false once stopped
+    bool enqueue(int orderId, double x, double y) {
+        if (stopping) {
+            return false;
+        }
+        int cx = column(x);
+        int cy = row(y);
+        Task task;
+        task.orderId = orderId;
+        task.regions.push_back(cy * cols + cx);
+        std::vector<std::pair<double, int>> neighbours;
+        for (int ny = std::max(0, cy - 1); ny <= std::min(rows - 1, cy + 1); ++ny) {
+            for (int nx = std::max(0, cx - 1); nx <= std::min(cols - 1, cx + 1); ++nx) {
+                if (nx != cx || ny != cy) {
+                    neighbours.push_back({distanceTo(ny * cols + nx, x, y), ny * cols + nx});
+                }
+            }
         }
+        std::sort(neighbours.begin(), neighbours.end());
+        for (const auto& neighbour : neighbours) {
+            task.regions.push_back(neighbour.second);
+        }
+        post(std::move(task));
+        return true;
+    }
 
-        running = true;
+    // File a driver under the region containing its location
+    void place(int driverId, int locationId, double x, double y) {
+        std::lock_guard<std::mutex> lock(placementMutex);
+        fileLocked(driverId, locationId, x, y);
     }
 
-    ~SimpleHttpServer() {
-#ifdef _WIN32
-        closesocket(server_fd);
-        WSACleanup();
-#else
-        close(server_fd);
-#endif
+    // Coordinates of a location became known (or changed); refile the drivers standing there
+    void relocate(int locationId, double x, double y) {
+        std::lock_guard<std::mutex> lock(placementMutex);
+        std::vector<int> moved;
+        for (const auto& entry : placement) {
+            if (entry.second.second == locationId) moved.push_back(entry.first);
+        }
+        for (int driverId : moved) {
+            fileLocked(driverId, locationId, x, y);
+        }
     }
 
-    void start(HandlerFunction handlerFunc) {
-        handler = handlerFunc;
-        std::cout << "HTTP server started on port " << port << std::endl;
+    int rowCount() const {
+        return rows;
+    }
 
-        while (running) {
-            int addrlen = sizeof(address);
-#ifdef _WIN32
-            int new_socket = accept(server_fd, (struct sockaddr*)&address, &addrlen);
-#else
-            int new_socket = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
-#endif
-            if (new_socket < 0) {
-                std::cerr << "Accept failed" << std::endl;
-                continue;
-            }
+    int columnCount() const {
+        return cols;
+    }
 
-            // Read HTTP request
-            char buffer[30000] = {0};
-#ifdef _WIN32
-            int valread = recv(new_socket, buffer, 30000, 0);
-#else
-            int valread = read(new_socket, buffer, 30000);
-#endif
-            if (valread <= 0) {
-                std::cerr << "Read failed" << std::endl;
-#ifdef _WIN32
-                closesocket(new_socket);
-#else
-                close(new_socket);
-#endif
-                continue;
+    std::vector<RegionStats> stats() {
+        std::vector<RegionStats> result;
+        for (auto& region : regions) {
+            RegionStats entry;
+            entry.drivers = region->drivers.size();
+            {
+                std::lock_guard<std::mutex> lock(region->mutex);
+                entry.queued = region->queue.size();
             }
+            entry.dispatched = region->dispatched;
+            entry.handedOff = region->handedOff;
+            result.push_back(entry);
+        }
+        return result;
+    }
+};
 
-            // Parse HTTP request
-            std::string request(buffer);
-            size_t method_end = request.find(' ');
-            if (method_end == std::string::npos) {
-#ifdef _WIN32
-                closesocket(new_socket);
-#else
-                close(new_socket);
-#endif
-                continue;
+// Local search over a pickup-and-delivery stop sequence. Starting from a
+// feasible route, it applies the first improving move it finds among:
+// - relocate: move one stop elsewhere
+// - or-opt: move a run of 2 or 3 consecutive stops elsewhere
+// - 2-opt: reverse a run of stops that holds no complete order
+// Every candidate keeps each pickup ahead of its drop-off. The search stops at
+// a local optimum or when the time budget runs out, whichever comes first.
+// Costs are given per pair of stops and may be asymmetric.
+class RouteOptimizer {
+private:
+    const std::vector<RouteStop>& stops;
+    const std::vector<std::vector<double>>& cost;     // cost[a][b] from stop a to stop b
+    std::chrono::steady_clock::time_point deadline;
+
+    // Route length for an ordering of stop indices
+    double length(const std::vector<int>& order) const {
+        double total = 0;
+        for (size_t i = 1; i < order.size(); ++i) {
+            total += cost[order[i - 1]][order[i]];
+        }
+        return total;
+    }
+
+    bool feasible(const std::vector<int>& order) const {
+        std::unordered_map<int, bool> pickedUp;
+        for (int stop : order) {
+            if (stops[stop].isPickup) {
+                pickedUp[stops[stop].orderId] = true;
+            } else if (!pickedUp[stops[stop].orderId]) {
+                return false;
             }
+        }
+        return true;
+    }
 
-            std::string method = request.substr(0, method_end);
-            size_t path_end = request.find(' ', method_end + 1);
-            if (path_end == std::string::npos) {
-#ifdef _WIN32
-                closesocket(new_socket);
-#else
-                close(new_socket);
-#endif
-                continue;
+    bool expired() const {
+        return std::chrono::steady_clock::now() >= deadline;
+    }
+
+    // Move order[from, from + count) so it starts at position to of the remaining stops
+    static std::vector<int> moveRun(const std::vector<int>& order, size_t from, size_t count, size_t to) {
+        std::vector<int> rest;
+        rest.reserve(order.size());
+        rest.insert(rest.end(), order.begin(), order.begin() + from);
+        rest.insert(rest.end(), order.begin() + from + count, order.end());
+        rest.insert(rest.begin() + to, order.begin() + from, order.begin() + from + count);
+        return rest;
+    }
+
+    // Try the move; keep it if feasible and shorter
+    bool accept(std::vector<int>& order, double& best, std::vector<int>&& candidate) {
+        double candidateLength = length(candidate);
+        if (candidateLength < best - 1e-9 && feasible(candidate)) {
+            order.swap(candidate);
+            best = candidateLength;
+            return true;
+        }
+        return false;
+    }
+
+    bool improveByMoving(std::vector<int>& order, double& best, size_t runLength) {
+        size_t n = order.size();
+        for (size_t from = 0; from + runLength <= n; ++from) {
+            for (size_t to = 0; to + runLength <= n; ++to) {
+                if (to == from) continue;
+                if (accept(order, best, moveRun(order, from, runLength, to))) return true;
             }
+            if (expired()) return false;
+        }
+        return false;
+    }
 
-            std::string path = request.substr(method_end + 1, path_end - method_end - 1);
-            
-            // Extract request body
-            std::string body;
-            size_t body_start = request.find("\r\n\r\n");
-            if (body_start != std::string::npos) {
-                body = request.substr(body_start + 4);
+    bool improveByReversing(std::vector<int>& order, double& best) {
+        size_t n = order.size();
+        for (size_t i = 0; i + 1 < n; ++i) {
+            for (size_t j = i + 1; j < n; ++j) {
+                std::vector<int> candidate = order;
+                std::reverse(candidate.begin() + i, candidate.begin() + j + 1);
+                if (accept(order, best, std::move(candidate))) return true;
             }
+            if (expired()) return false;
+        }
+        return false;
+    }
 
-            // Call handler and get response
-            std::string response = handler(method, path, body);
+public:
+    RouteOptimizer(const std::vector<RouteStop>& stops, const std::vector<std::vector<double>>& cost,
+                   std::chrono::steady_clock::time_point deadline)
+        : stops(stops), cost(cost), deadline(deadline) {}
 
-            // Send response
-#ifdef _WIN32
-            send(new_socket, response.c_str(), response.length(), 0);
-#else
-            write(new_socket, response.c_str(), response.length());
-#endif
+    // Improved ordering of the stops as indices into the original sequence
+    std::vector<int> run() {
+        std::vector<int> order(stops.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = static_cast<int>(i);
+        double best = length(order);
 
-            // Close connection
-#ifdef _WIN32
-            closesocket(new_socket);
-#else
-            close(new_socket);
-#endif
+        bool improved = true;
+        while (improved && !expired()) {
+            improved = improveByMoving(order, best, 1) ||
+                       improveByMoving(order, best, 2) ||
+                       improveByMoving(order, best, 3) ||
+                       improveByReversing(order, best);
         }
+        return order;
     }
+};
 
-    void stop() {
-        running = false;
+// Min-cost assignment of rows to columns (Hungarian algorithm, O(rows^2 * cols)).
+// Infinite costs mark forbidden pairs. Returns the column for each row, or -1
+// for rows left without one because columns ran out or all were forbidden.
+inline std::vector<int> minCostAssignment(const std::vector<std::vector<double>>& cost) {
+    const double inf = std::numeric_limits<double>::infinity();
+    size_t rows = cost.size();
+    size_t cols = rows > 0 ? cost[0].size() : 0;
+    std::vector<int> result(rows, -1);
+    if (rows == 0 || cols == 0) {
+        return result;
+    }
+    if (rows > cols) {
+        // The algorithm needs rows <= cols; solve the transposed problem
+        std::vector<std::vector<double>> transposed(cols, std::vector<double>(rows));
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; j < cols; ++j) transposed[j][i] = cost[i][j];
+        }
+        std::vector<int> columnToRow = minCostAssignment(transposed);
+        for (size_t j = 0; j < cols; ++j) {
+            if (columnToRow[j] >= 0) result[columnToRow[j]] = static_cast<int>(j);
+        }
+        return result;
     }
-};
 
-// Location structure
-struct Location {
-    int id;
-    std::string name;
-    double x, y;
-};
+    // Forbidden pairs cost more than any complete assignment of allowed pairs,
+    // so the matching first maximizes the number of allowed pairs
+    double largest = 0;
+    for (const auto& row : cost) {
+        for (double value : row) {
+            if (value != inf) largest = std::max(largest, std::fabs(value));
+        }
+    }
+    double forbidden = (largest + 1) * (rows + 1) * 2;
+    auto at = [&](size_t i, size_t j) {
+        return cost[i][j] == inf ? forbidden : cost[i][j];
+    };
 
-// Order structure
-struct Order {
-    int id;
-    int restaurantId;
-    int customerLocationId;
-    int assignedDriverId = -1;
-    std::string status;
-};
+    // Potentials u (rows) and v (columns); owner[j] is the 1-based row matched to column j
+    std::vector<double> u(rows + 1, 0), v(cols + 1, 0), minSlack(cols + 1);
+    std::vector<size_t> owner(cols + 1, 0), previous(cols + 1, 0);
+    std::vector<char> visited(cols + 1);
+    for (size_t i = 1; i <= rows; ++i) {
+        owner[0] = i;
+        size_t column = 0;
+        std::fill(minSlack.begin(), minSlack.end(), inf);
+        std::fill(visited.begin(), visited.end(), 0);
+        do {
+            // Grow the alternating tree by the column with the least reduced cost
+            visited[column] = 1;
+            size_t row = owner[column];
+            size_t next = 0;
+            double delta = inf;
+            for (size_t j = 1; j <= cols; ++j) {
+                if (visited[j]) continue;
+                double slack = at(row - 1, j - 1) - u[row] - v[j];
+                if (slack < minSlack[j]) {
+                    minSlack[j] = slack;
+                    previous[j] = column;
+                }
+                if (minSlack[j] < delta) {
+                    delta = minSlack[j];
+                    next = j;
+                }
+            }
+            for (size_t j = 0; j <= cols; ++j) {
+                if (visited[j]) {
+                    u[owner[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    minSlack[j] -= delta;
+                }
+            }
+            column = next;
+        } while (owner[column] != 0);
+        // Flip the augmenting path
+        do {
+            size_t prior = previous[column];
+            owner[column] = owner[prior];
+            column = prior;
+        } while (column != 0);
+    }
 
-// Driver structure
-struct Driver {
-    int id;
-    int currentLocation;
-    std::vector<int> assignedOrders;
-    double speed;
-};
+    for (size_t j = 1; j <= cols; ++j) {
+        if (owner[j] != 0 && cost[owner[j] - 1][j - 1] != inf) {
+            result[owner[j] - 1] = static_cast<int>(j - 1);
+        }
+    }
+    return result;
+}
 
 class DeliverySystem {
 private:
     sqlite3* db;
+    // Serializes access to the connection; public methods call each other, so it is recursive
+    std::recursive_mutex dbMutex;
+    // Every query is prepared once on this connection and reused
+    std::unique_ptr<StatementCache> statements;
+    // Opt-in per-query timing, attached to the connection while enabled
+    StatementProfiler profiler;
+    // Every change to locations, edges, drivers and orders, for clients following them
+    ChangeFeed changes;
+    // Coordinates of every location, for distance calculations
+    LocationStore locationStore;
+    // Driver positions, so assignment only scores drivers near the restaurant
+    DriverIndex driverIndex;
+    // Drivers scored per round of assignDriverToOrder before the search widens
+    static constexpr size_t kAssignmentCandidates = 16;
+    // Planned stops per driver and the driver planned for each order. Kept in step
+    // with driver_orders; rebuilt at startup, then only changed by insertions and
+    // completions. Guarded by dbMutex.
+    std::unordered_map<int, std::vector<RouteStop>> routePlans;
+    std::unordered_map<int, int> plannedDriverForOrder;
+    // Time allowed for local search each time a driver's route changes
+    std::chrono::microseconds routeOptimizationBudget{2000};
+    // How dispatch ranks candidate drivers; chosen at startup
+    ScoringPolicy scoringPolicy = ScoringPolicy::Default;
+    // Authoritative in-memory copy of the locations/edges graph used for routing
+    RoadGraph roadGraph;
+    // Optional contraction hierarchy over roadGraph. Readers take a copy of the pointer;
+    // refreshes build a new hierarchy on the side and swap it in.
+    std::shared_ptr<const ContractionHierarchy> hierarchy;
+    std::mutex hierarchyBuildMutex;
+    // Workers for batched route computations such as distance matrices
+    ThreadPool computePool;
+    // Orders waiting for batch dispatch; declared last so its thread starts after everything else
+    OrderBatcher orderBatcher;
+    // Pending orders, retried when drivers gain capacity
+    RedispatchScheduler redispatch;
+    // Per-region dispatcher threads; only set when regional dispatch is enabled at startup
+    std::unique_ptr<RegionalDispatcher> regional;
+    // Optimistic regional dispatch attempts before one runs entirely under dbMutex
+    static constexpr int kRegionalAttempts = 3;
     
     // Helper function to initialize database
     void initDb() {
@@ -254,6 +4601,8 @@ private:
             "id INTEGER PRIMARY KEY AUTOINCREMENT, "
             "current_location INTEGER NOT NULL, "
             "speed REAL NOT NULL, "
+            "max_orders INTEGER NOT NULL DEFAULT 3, "
+            "detour_limit REAL NOT NULL DEFAULT 1.5, "
             "FOREIGN KEY(current_location) REFERENCES locations(id));";
             
         const char* createDriverOrdersSql = 
@@ -292,53 +4641,210 @@ private:
             std::cerr << "Error creating drivers table: " << errMsg << std::endl;
             sqlite3_free(errMsg);
         }
-        
-        sqlite3_exec(db, createDriverOrdersSql, nullptr, nullptr, &errMsg);
-        if (errMsg) {
-            std::cerr << "Error creating driver_orders table: " << errMsg << std::endl;
-            sqlite3_free(errMsg);
+        
+        sqlite3_exec(db, createDriverOrdersSql, nullptr, nullptr, &errMsg);
+        if (errMsg) {
+            std::cerr << "Error creating driver_orders table: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+        }
+        
+        sqlite3_exec(db, createEdgesSql, nullptr, nullptr, &errMsg);
+        if (errMsg) {
+            std::cerr << "Error creating edges table: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+        }
+        
+        // Databases created before per-driver limits existed lack these columns; the
+        // ALTERs fail harmlessly when the columns are already there
+        sqlite3_exec(db, "ALTER TABLE drivers ADD COLUMN max_orders INTEGER NOT NULL DEFAULT 3", nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "ALTER TABLE drivers ADD COLUMN detour_limit REAL NOT NULL DEFAULT 1.5", nullptr, nullptr, nullptr);
+        
+        // driver_orders is keyed by (driver_id, order_id); lookups by order need their own index
+        const char* createDriverOrdersIndexSql = 
+            "CREATE INDEX IF NOT EXISTS idx_driver_orders_order "
+            "ON driver_orders(order_id, driver_id);";
+            
+        sqlite3_exec(db, createDriverOrdersIndexSql, nullptr, nullptr, &errMsg);
+        if (errMsg) {
+            std::cerr << "Error creating driver_orders index: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+        }
+    }
+    
+    // Build the in-memory location store and road graph from the locations and edges tables
+    void loadRoadGraph() {
+        auto locations = getAllLocations();
+        locationStore.load(locations);
+        roadGraph.load(locations, getAllEdges());
+    }
+    
+    // File every driver in the spatial index under its current location
+    void loadDriverIndex() {
+        std::vector<std::tuple<int, int, double, double>> positions;
+        for (const auto& driver : getAllDrivers()) {
+            double x, y;
+            locationStore.position(driver.currentLocation, x, y);
+            positions.push_back(std::make_tuple(driver.id, driver.currentLocation, x, y));
+        }
+        driverIndex.load(positions);
+    }
+    
+    // Rebuild every driver's planned stops by inserting their orders one at a time
+    void loadRoutePlans() {
+        std::map<int, Order> orders;
+        for (const auto& order : getAllOrders()) {
+            orders[order.id] = order;
+        }
+        routePlans.clear();
+        plannedDriverForOrder.clear();
+        for (const auto& driver : getAllDrivers()) {
+            for (int orderId : driver.assignedOrders) {
+                auto it = orders.find(orderId);
+                if (it != orders.end() && it->second.status != "Delivered") {
+                    planOrder(driver.id, it->second, cheapestInsertion(routePlans[driver.id], it->second));
+                }
+            }
+            optimizeRoute(driver.id);
         }
-        
-        sqlite3_exec(db, createEdgesSql, nullptr, nullptr, &errMsg);
-        if (errMsg) {
-            std::cerr << "Error creating edges table: " << errMsg << std::endl;
-            sqlite3_free(errMsg);
+    }
+    
+    // Queue every order left Pending by a previous run and give them one retry
+    void loadPendingOrders() {
+        for (const auto& order : getAllOrders()) {
+            if (order.status == "Pending") {
+                redispatch.add(order.id);
+            }
+        }
+        redispatch.notify();
+    }
+    
+    void placeDriver(int driverId, int locationId) {
+        double x, y;
+        locationStore.position(locationId, x, y);
+        driverIndex.update(driverId, locationId, x, y);
+        if (regional) {
+            regional->place(driverId, locationId, x, y);
         }
     }
     
 public:
-    DeliverySystem() {
+    // databasePath may be ":memory:" for a throwaway database, e.g. in the simulator
+    explicit DeliverySystem(const std::string& databasePath = "delivery.db")
+        : orderBatcher([this](const std::vector<int>& orderIds) { assignDriversToOrders(orderIds); }),
+          redispatch([this](int orderId) { return retryPendingOrder(orderId); }) {
         // Open database connection
-        if (sqlite3_open("delivery.db", &db) != SQLITE_OK) {
+        if (sqlite3_open(databasePath.c_str(), &db) != SQLITE_OK) {
             std::cerr << "Cannot open database: " << sqlite3_errmsg(db) << std::endl;
             return;
         }
+        statements.reset(new StatementCache(db));
         
         // Initialize database tables
         initDb();
+        loadRoadGraph();
+        loadDriverIndex();
+        loadRoutePlans();
+        loadPendingOrders();
     }
     
     ~DeliverySystem() {
-        // Close database connection
+        // Dispatch queued orders while the database is still open, then stop retrying
+        orderBatcher.stop();
+        if (regional) {
+            regional->stop();
+        }
+        redispatch.stop();
+        
+        // Finalize cached statements, then close database connection
+        profiler.detach();
+        statements.reset();
         if (db) {
             sqlite3_close(db);
         }
     }
     
-    // Calculate distance between two locations
-    double calculateDistance(int loc1Id, int loc2Id) {
-        Location loc1 = getLocationById(loc1Id);
-        Location loc2 = getLocationById(loc2Id);
+private:
+    // Record a change in the change feed; fill writes the members of the change's JSON object
+    template <typename Fill>
+    void publishChange(const char* type, Fill fill) {
+        if (!changes.active()) {
+            changes.skip();
+            return;
+        }
+        JsonWriter change(128);
+        change.beginObject();
+        fill(change);
+        change.endObject();
+        changes.publish(type, change.take());
+    }
+    
+public:
+    ChangeFeed& changeFeed() {
+        return changes;
+    }
+    
+    // Prepared-statement cache counters as JSON
+    std::string statementCacheStatsJson() {
+        uint64_t hits = statements->hits();
+        uint64_t misses = statements->misses();
+        double hitRate = hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0;
         
-        return std::sqrt(std::pow(loc1.x - loc2.x, 2) + std::pow(loc1.y - loc2.y, 2));
+        std::ostringstream json;
+        json << "{\"hits\":" << hits
+             << ",\"misses\":" << misses
+             << ",\"hitRate\":" << hitRate
+             << ",\"cachedStatements\":" << statements->size() << "}";
+        return json.str();
+    }
+    
+    // Start or stop timing every query run on the connection
+    void setQueryProfiling(bool enabled) {
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        if (enabled && !profiler.attached()) {
+            profiler.attach(db);
+        } else if (!enabled) {
+            profiler.detach();
+        }
+    }
+    
+    void setSlowQueryThreshold(std::chrono::microseconds threshold) {
+        profiler.setSlowThreshold(threshold);
+    }
+    
+    void clearQueryProfile() {
+        profiler.clear();
+    }
+    
+    // Query profiler settings and per-query timings as JSON
+    std::string queryProfileJson() {
+        bool enabled;
+        {
+            std::lock_guard<std::recursive_mutex> lock(dbMutex);
+            enabled = profiler.attached();
+        }
+        std::ostringstream json;
+        json << "{\"enabled\":" << (enabled ? "true" : "false")
+             << ",\"slowQueryMs\":" << profiler.slowThresholdMs()
+             << ",\"queries\":" << profiler.json() << "}";
+        return json.str();
+    }
+    
+    // Straight-line distance between two locations
+    double calculateDistance(int loc1Id, int loc2Id) {
+        return locationStore.distance(loc1Id, loc2Id);
+    }
+    
+    // Straight-line length of a route through the given locations
+    double calculatePathDistance(const std::vector<int>& path) {
+        return locationStore.pathLength(path);
     }
     
     // Location management
     void addLocation(int id, const std::string& name, double x, double y) {
-        sqlite3_stmt* stmt;
-        std::string sql = "INSERT INTO locations (id, name, x, y) VALUES (?, ?, ?, ?)";
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        auto stmt = statements->acquire("INSERT INTO locations (id, name, x, y) VALUES (?, ?, ?, ?)");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return;
         }
@@ -350,17 +4856,25 @@ public:
         
         if (sqlite3_step(stmt) != SQLITE_DONE) {
             std::cerr << "Failed to add location: " << sqlite3_errmsg(db) << std::endl;
+        } else {
+            locationStore.set(id, x, y);
+            driverIndex.relocate(id, x, y);
+            if (regional) {
+                regional->relocate(id, x, y);
+            }
+            roadGraph.addNode(id, x, y);
+            publishChange("location", [&](JsonWriter& change) {
+                change.member("id", id).member("name", name).member("x", x).member("y", y);
+            });
         }
-        
-        sqlite3_finalize(stmt);
     }
     
     Location getLocationById(int id) {
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
         Location location;
-        sqlite3_stmt* stmt;
-        std::string sql = "SELECT id, name, x, y FROM locations WHERE id = ?";
+        auto stmt = statements->acquire("SELECT id, name, x, y FROM locations WHERE id = ?");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return location;
         }
@@ -374,16 +4888,15 @@ public:
             location.y = sqlite3_column_double(stmt, 3);
         }
         
-        sqlite3_finalize(stmt);
         return location;
     }
     
     std::vector<Location> getAllLocations() {
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
         std::vector<Location> locations;
-        sqlite3_stmt* stmt;
-        std::string sql = "SELECT id, name, x, y FROM locations";
+        auto stmt = statements->acquire("SELECT id, name, x, y FROM locations");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return locations;
         }
@@ -397,16 +4910,16 @@ public:
             locations.push_back(location);
         }
         
-        sqlite3_finalize(stmt);
         return locations;
     }
     
     // Order management
     int placeOrder(int restaurantId, int customerLocationId) {
-        sqlite3_stmt* stmt;
-        std::string sql = "INSERT INTO orders (restaurant_id, customer_location_id, status) VALUES (?, ?, ?)";
+        Tracer::Span span("placeOrder", restaurantId);
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        auto stmt = statements->acquire("INSERT INTO orders (restaurant_id, customer_location_id, status) VALUES (?, ?, ?)");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return -1;
         }
@@ -417,33 +4930,36 @@ public:
         
         if (sqlite3_step(stmt) != SQLITE_DONE) {
             std::cerr << "Failed to place order: " << sqlite3_errmsg(db) << std::endl;
-            sqlite3_finalize(stmt);
             return -1;
         }
         
         int orderId = sqlite3_last_insert_rowid(db);
-        sqlite3_finalize(stmt);
+        publishChange("order", [&](JsonWriter& change) {
+            change.member("id", orderId)
+                  .member("restaurantId", restaurantId)
+                  .member("customerLocationId", customerLocationId)
+                  .member("status", "Preparing");
+        });
         
         // Upon placing an order, also update any driver who's assigned to it
         // to have their current location set to the restaurant
-        sql = "UPDATE drivers SET current_location = ? WHERE id IN (SELECT driver_id FROM driver_orders WHERE order_id = ?)";
+        stmt = statements->acquire("UPDATE drivers SET current_location = ? WHERE id IN (SELECT driver_id FROM driver_orders WHERE order_id = ?)");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        if (stmt) {
             sqlite3_bind_int(stmt, 1, restaurantId); // Set driver location to restaurant
             sqlite3_bind_int(stmt, 2, orderId);
             
             sqlite3_step(stmt);
-            sqlite3_finalize(stmt);
         }
         
         return orderId;
     }
     
     void updateOrderStatus(int orderId, const std::string& status) {
-        sqlite3_stmt* stmt;
-        std::string sql = "UPDATE orders SET status = ? WHERE id = ?";
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        auto stmt = statements->acquire("UPDATE orders SET status = ? WHERE id = ?");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return;
         }
@@ -453,58 +4969,55 @@ public:
         
         if (sqlite3_step(stmt) != SQLITE_DONE) {
             std::cerr << "Failed to update order status: " << sqlite3_errmsg(db) << std::endl;
+        } else if (sqlite3_changes(db) > 0) {
+            publishChange("order", [&](JsonWriter& change) {
+                change.member("id", orderId).member("status", status);
+            });
         }
-        
-        sqlite3_finalize(stmt);
     }
     
     // In the getAllOrders method:
 std::vector<Order> getAllOrders() {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
     std::vector<Order> orders;
-    sqlite3_stmt* stmt;
-    std::string sql = "SELECT id, restaurant_id, customer_location_id, status FROM orders";
+    // One pass over orders joined with their assignments; rows for the same order are adjacent
+    auto stmt = statements->acquire("SELECT o.id, o.restaurant_id, o.customer_location_id, o.status, d.driver_id "
+                                    "FROM orders o LEFT JOIN driver_orders d ON d.order_id = o.id "
+                                    "ORDER BY o.id, d.driver_id");
     
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!stmt) {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
         return orders;
     }
     
     while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int id = sqlite3_column_int(stmt, 0);
+        if (!orders.empty() && orders.back().id == id) {
+            continue; // Additional driver for the same order; the first one is reported
+        }
+        
         Order order;
-        order.id = sqlite3_column_int(stmt, 0);
+        order.id = id;
         order.restaurantId = sqlite3_column_int(stmt, 1);
         order.customerLocationId = sqlite3_column_int(stmt, 2);
         order.status = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        
-        // Get assigned driver if any
-        sqlite3_stmt* driverStmt;
-        std::string driverSql = "SELECT driver_id FROM driver_orders WHERE order_id = ?";
-        
-        if (sqlite3_prepare_v2(db, driverSql.c_str(), -1, &driverStmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_int(driverStmt, 1, order.id);
-            
-            if (sqlite3_step(driverStmt) == SQLITE_ROW) {
-                order.assignedDriverId = sqlite3_column_int(driverStmt, 0);
-            }
-            
-            sqlite3_finalize(driverStmt);
+        if (sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+            order.assignedDriverId = sqlite3_column_int(stmt, 4);
         }
         
         orders.push_back(order);
     }
     
-    sqlite3_finalize(stmt);
     return orders;
 }
     
-
     // Add edge between two locations with given distance
 void addEdge(int source, int destination, double distance, double trafficFactor = 1.0) {
-    sqlite3_stmt* stmt;
-    std::string sql = "INSERT OR REPLACE INTO edges (source, destination, distance, traffic_factor) "
-                      "VALUES (?, ?, ?, ?)";
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    auto stmt = statements->acquire("INSERT OR REPLACE INTO edges (source, destination, distance, traffic_factor) "
+                                    "VALUES (?, ?, ?, ?)");
     
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!stmt) {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
         return;
     }
@@ -516,18 +5029,24 @@ void addEdge(int source, int destination, double distance, double trafficFactor
     
     if (sqlite3_step(stmt) != SQLITE_DONE) {
         std::cerr << "Failed to add edge: " << sqlite3_errmsg(db) << std::endl;
+    } else {
+        roadGraph.setEdge(source, destination, distance, trafficFactor);
+        publishChange("edge", [&](JsonWriter& change) {
+            change.member("source", source)
+                  .member("destination", destination)
+                  .member("distance", distance)
+                  .member("trafficFactor", trafficFactor);
+        });
     }
-    
-    sqlite3_finalize(stmt);
 }
 
 // Get all edges
 std::vector<std::tuple<int, int, double, double>> getAllEdges() {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
     std::vector<std::tuple<int, int, double, double>> edges;
-    sqlite3_stmt* stmt;
-    std::string sql = "SELECT source, destination, distance, traffic_factor FROM edges";
+    auto stmt = statements->acquire("SELECT source, destination, distance, traffic_factor FROM edges");
     
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!stmt) {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
         return edges;
     }
@@ -540,33 +5059,39 @@ std::vector<std::tuple<int, int, double, double>> getAllEdges() {
         edges.push_back(std::make_tuple(source, destination, distance, trafficFactor));
     }
     
-    sqlite3_finalize(stmt);
     return edges;
 }
 
-// Get JSON representation of edges
-std::string edgesToJson() {
-    std::ostringstream json;
-    json << "[";
+// Write the JSON array of edges
+void writeEdges(JsonWriter& json) {
     auto edges = getAllEdges();
-    for (size_t i = 0; i < edges.size(); ++i) {
-        if (i > 0) json << ",";
-        json << "{\"source\":" << std::get<0>(edges[i]) 
-             << ",\"destination\":" << std::get<1>(edges[i])
-             << ",\"distance\":" << std::get<2>(edges[i])
-             << ",\"trafficFactor\":" << std::get<3>(edges[i]) << "}";
+    json.reserve(80 * edges.size() + 2);
+    json.beginArray();
+    for (const auto& edge : edges) {
+        json.beginObject()
+            .member("source", std::get<0>(edge))
+            .member("destination", std::get<1>(edge))
+            .member("distance", std::get<2>(edge))
+            .member("trafficFactor", std::get<3>(edge))
+            .endObject();
     }
-    json << "]";
-    return json.str();
+    json.endArray();
+}
+
+// Get JSON representation of edges
+std::string edgesToJson() {
+    JsonWriter json;
+    writeEdges(json);
+    return json.take();
 }
 
     // Update traffic on an edge
     void updateEdgeTraffic(int source, int destination, double additionalTraffic) {
-        sqlite3_stmt* stmt;
-        std::string sql = "UPDATE edges SET traffic_factor = traffic_factor + ? "
-                        "WHERE source = ? AND destination = ?";
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        auto stmt = statements->acquire("UPDATE edges SET traffic_factor = traffic_factor + ? "
+                                        "WHERE source = ? AND destination = ?");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return;
         }
@@ -577,36 +5102,54 @@ std::string edgesToJson() {
         
         if (sqlite3_step(stmt) != SQLITE_DONE) {
             std::cerr << "Failed to update edge traffic: " << sqlite3_errmsg(db) << std::endl;
+        } else if (sqlite3_changes(db) > 0) {
+            roadGraph.addTraffic(source, destination, additionalTraffic);
+            if (changes.active()) {
+                publishEdgeTraffic(source, destination);
+            } else {
+                changes.skip();
+            }
+        }
+    }
+
+    // Publish an edge's traffic factor as stored after an update
+    void publishEdgeTraffic(int source, int destination) {
+        auto stmt = statements->acquire("SELECT traffic_factor FROM edges WHERE source = ? AND destination = ?");
+        if (!stmt) {
+            return;
+        }
+        sqlite3_bind_int(stmt, 1, source);
+        sqlite3_bind_int(stmt, 2, destination);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            double trafficFactor = sqlite3_column_double(stmt, 0);
+            publishChange("edge", [&](JsonWriter& change) {
+                change.member("source", source).member("destination", destination).member("trafficFactor", trafficFactor);
+            });
         }
-        
-        sqlite3_finalize(stmt);
     }
 
-    
     // Driver management
     int addDriver(double speed, int startLocation = -1) {
-        sqlite3_stmt* stmt;
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
         
         // If no start location provided, use the first available location
         if (startLocation < 0) {
-            std::string locSql = "SELECT id FROM locations ORDER BY id ASC LIMIT 1";
-            sqlite3_stmt* locStmt;
+            auto locStmt = statements->acquire("SELECT id FROM locations ORDER BY id ASC LIMIT 1");
             
-            if (sqlite3_prepare_v2(db, locSql.c_str(), -1, &locStmt, nullptr) == SQLITE_OK) {
+            if (locStmt) {
                 if (sqlite3_step(locStmt) == SQLITE_ROW) {
                     startLocation = sqlite3_column_int(locStmt, 0);
                 } else {
                     startLocation = 1; // Fallback if no locations exist
                 }
-                sqlite3_finalize(locStmt);
             } else {
                 startLocation = 1; // Fallback if query fails
             }
         }
         
-        std::string sql = "INSERT INTO drivers (current_location, speed) VALUES (?, ?)";
+        auto stmt = statements->acquire("INSERT INTO drivers (current_location, speed) VALUES (?, ?)");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return -1;
         }
@@ -616,20 +5159,29 @@ std::string edgesToJson() {
         
         if (sqlite3_step(stmt) != SQLITE_DONE) {
             std::cerr << "Failed to add driver: " << sqlite3_errmsg(db) << std::endl;
-            sqlite3_finalize(stmt);
             return -1;
         }
         
         int driverId = sqlite3_last_insert_rowid(db);
-        sqlite3_finalize(stmt);
+        placeDriver(driverId, startLocation);
+        publishChange("driver", [&](JsonWriter& change) {
+            Driver defaults;
+            change.member("id", driverId)
+                  .member("currentLocation", startLocation)
+                  .member("speed", speed)
+                  .member("maxOrders", defaults.maxOrders)
+                  .member("detourLimit", defaults.detourLimit)
+                  .key("assignedOrders").beginArray().endArray();
+        });
+        redispatch.notify();
         return driverId;
     }
     
     void updateDriverLocation(int driverId, int locationId) {
-        sqlite3_stmt* stmt;
-        std::string sql = "UPDATE drivers SET current_location = ? WHERE id = ?";
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        auto stmt = statements->acquire("UPDATE drivers SET current_location = ? WHERE id = ?");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return;
         }
@@ -639,369 +5191,913 @@ std::string edgesToJson() {
         
         if (sqlite3_step(stmt) != SQLITE_DONE) {
             std::cerr << "Failed to update driver location: " << sqlite3_errmsg(db) << std::endl;
+        } else if (sqlite3_changes(db) > 0) {
+            placeDriver(driverId, locationId);
+            publishChange("driver", [&](JsonWriter& change) {
+                change.member("id", driverId).member("currentLocation", locationId);
+            });
+            redispatch.notify();
+        }
+    }
+    
+    // Change how many orders a driver may hold and how far its route may grow per order
+    bool setDriverLimits(int driverId, size_t maxOrders, double detourLimit) {
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        auto stmt = statements->acquire("UPDATE drivers SET max_orders = ?, detour_limit = ? WHERE id = ?");
+        
+        if (!stmt) {
+            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+            return false;
         }
         
-        sqlite3_finalize(stmt);
+        sqlite3_bind_int(stmt, 1, static_cast<int>(maxOrders));
+        sqlite3_bind_double(stmt, 2, detourLimit);
+        sqlite3_bind_int(stmt, 3, driverId);
+        
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            std::cerr << "Failed to update driver limits: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        if (sqlite3_changes(db) == 0) {
+            return false;
+        }
+        publishChange("driver", [&](JsonWriter& change) {
+            change.member("id", driverId).member("maxOrders", maxOrders).member("detourLimit", detourLimit);
+        });
+        redispatch.notify();
+        return true;
+    }
+    
+    void setScoringPolicy(ScoringPolicy policy) {
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        scoringPolicy = policy;
     }
     
     std::vector<Driver> getAllDrivers() {
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
         std::vector<Driver> drivers;
-        sqlite3_stmt* stmt;
-        std::string sql = "SELECT id, current_location, speed FROM drivers";
+        // One pass over drivers joined with their assigned orders; rows for the same driver are adjacent
+        auto stmt = statements->acquire("SELECT d.id, d.current_location, d.speed, o.order_id, d.max_orders, d.detour_limit "
+                                        "FROM drivers d LEFT JOIN driver_orders o ON o.driver_id = d.id "
+                                        "ORDER BY d.id, o.order_id");
         
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        if (!stmt) {
             std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
             return drivers;
         }
         
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            Driver driver;
-            driver.id = sqlite3_column_int(stmt, 0);
-            driver.currentLocation = sqlite3_column_int(stmt, 1);
-            driver.speed = sqlite3_column_double(stmt, 2);
-            
-            // Get assigned orders
-            sqlite3_stmt* orderStmt;
-            std::string orderSql = "SELECT order_id FROM driver_orders WHERE driver_id = ?";
-            
-            if (sqlite3_prepare_v2(db, orderSql.c_str(), -1, &orderStmt, nullptr) == SQLITE_OK) {
-                sqlite3_bind_int(orderStmt, 1, driver.id);
-                
-                while (sqlite3_step(orderStmt) == SQLITE_ROW) {
-                    driver.assignedOrders.push_back(sqlite3_column_int(orderStmt, 0));
-                }
-                
-                sqlite3_finalize(orderStmt);
-            }
-            
-            drivers.push_back(driver);
-        }
-        
-        sqlite3_finalize(stmt);
+        readDrivers(stmt, drivers);
         return drivers;
     }
     
-    std::vector<int> findShortestPath(int start, int end) {
-        // Uses Dijkstra's algorithm to find shortest path between two locations
-        std::map<int, double> distances;
-        std::map<int, int> previous;
-        std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<>> pq;
+    // Load a single driver with its assigned orders; returns false if there is no such driver
+    bool getDriverById(int driverId, Driver& driver) {
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        auto stmt = statements->acquire("SELECT d.id, d.current_location, d.speed, o.order_id, d.max_orders, d.detour_limit "
+                                        "FROM drivers d LEFT JOIN driver_orders o ON o.driver_id = d.id "
+                                        "WHERE d.id = ? ORDER BY o.order_id");
         
-        // Initialize distances
-        auto locations = getAllLocations();
-        for (const auto& loc : locations) {
-            distances[loc.id] = std::numeric_limits<double>::infinity();
+        if (!stmt) {
+            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+            return false;
         }
         
-        // Distance to start is 0
-        distances[start] = 0;
-        pq.push({0, start});
-        
-        while (!pq.empty()) {
-            int current = pq.top().second;
-            pq.pop();
-            
-            if (current == end) {
-                break; // We've reached the destination
+        sqlite3_bind_int(stmt, 1, driverId);
+        std::vector<Driver> drivers;
+        readDrivers(stmt, drivers);
+        if (drivers.empty()) {
+            return false;
+        }
+        driver = drivers.front();
+        return true;
+    }
+    
+    // Group (id, current_location, speed, order_id, max_orders, detour_limit) rows, ordered by driver, into drivers
+    void readDrivers(sqlite3_stmt* stmt, std::vector<Driver>& drivers) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int id = sqlite3_column_int(stmt, 0);
+            if (drivers.empty() || drivers.back().id != id) {
+                Driver driver;
+                driver.id = id;
+                driver.currentLocation = sqlite3_column_int(stmt, 1);
+                driver.speed = sqlite3_column_double(stmt, 2);
+                driver.maxOrders = static_cast<size_t>(std::max(0, sqlite3_column_int(stmt, 4)));
+                driver.detourLimit = sqlite3_column_double(stmt, 5);
+                drivers.push_back(driver);
             }
             
-            // Get all connected locations (edges)
-            sqlite3_stmt* stmt;
-            std::string sql = "SELECT destination, distance, traffic_factor FROM edges WHERE source = ?";
-            
-            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-                std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-                continue;
+            if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+                drivers.back().assignedOrders.push_back(sqlite3_column_int(stmt, 3));
             }
-            
-            sqlite3_bind_int(stmt, 1, current);
-            
-            while (sqlite3_step(stmt) == SQLITE_ROW) {
-                int neighbor = sqlite3_column_int(stmt, 0);
-                double weight = sqlite3_column_double(stmt, 1);
-                double traffic = sqlite3_column_double(stmt, 2);
-                
-                double alt = distances[current] + weight * traffic;
-                if (alt < distances[neighbor]) {
-                    distances[neighbor] = alt;
-                    previous[neighbor] = current;
-                    pq.push({alt, neighbor});
-                }
+        }
+    }
+    
+    // Shortest path by distance * traffic_factor, answered from the in-memory road graph
+    std::vector<int> findShortestPath(int start, int end, RoutingAlgorithm algorithm = RoutingAlgorithm::Dijkstra) {
+        return roadGraph.shortestPath(start, end, algorithm).path;
+    }
+    
+    // Same as findShortestPath, but also reports cost and search statistics
+    RoadGraph::PathResult findRoute(int start, int end, RoutingAlgorithm algorithm = RoutingAlgorithm::Dijkstra) {
+        Tracer::Span span("findRoute");
+        if (span.active()) {
+            span.detail(std::to_string(start) + " -> " + std::to_string(end));
+        }
+        if (algorithm == RoutingAlgorithm::ContractionHierarchy) {
+            auto current = currentHierarchy(false);
+            if (current) {
+                return current->shortestPath(roadGraph.indexOf(start), roadGraph.indexOf(end));
             }
-            
-            sqlite3_finalize(stmt);
+            algorithm = RoutingAlgorithm::Dijkstra; // Hierarchy is being rebuilt by another request
         }
-        
-        // Reconstruct path
-        std::vector<int> path;
-        if (distances[end] == std::numeric_limits<double>::infinity()) {
-            return path; // No path found
+        return roadGraph.shortestPath(start, end, algorithm);
+    }
+    
+    // Network cost from every source to every target (row per source, infinity if unreachable).
+    // Each row is an independent one-to-many search; rows run in parallel on the compute pool.
+    std::vector<std::vector<double>> distanceMatrix(const std::vector<int>& sources, const std::vector<int>& targets) {
+        std::vector<std::future<std::vector<double>>> rows;
+        rows.reserve(sources.size());
+        for (int source : sources) {
+            rows.push_back(computePool.submit([this, source, &targets] {
+                return roadGraph.costsFrom(source, targets);
+            }));
         }
-        
-        for (int at = end; at != start; at = previous[at]) {
-            path.push_back(at);
+
+        std::vector<std::vector<double>> matrix;
+        matrix.reserve(sources.size());
+        for (auto& row : rows) {
+            matrix.push_back(row.get());
         }
-        path.push_back(start);
-        
-        // Reverse to get start->end order
-        std::reverse(path.begin(), path.end());
-        return path;
+        return matrix;
+    }
+    
+    // Return a contraction hierarchy matching the current road graph. A topology change
+    // (new location or road) triggers a full contraction; cost changes only re-run
+    // customization. If another thread is already refreshing it, returns nullptr
+    // unless wait is set.
+    std::shared_ptr<const ContractionHierarchy> currentHierarchy(bool wait = true) {
+        auto isCurrent = [this](const std::shared_ptr<const ContractionHierarchy>& candidate) {
+            return candidate &&
+                   candidate->builtTopologyVersion() == roadGraph.currentTopologyVersion() &&
+                   candidate->builtMetricVersion() == roadGraph.currentMetricVersion();
+        };
+
+        auto current = std::atomic_load(&hierarchy);
+        if (isCurrent(current)) {
+            return current;
+        }
+
+        std::unique_lock<std::mutex> build(hierarchyBuildMutex, std::defer_lock);
+        if (wait) {
+            build.lock();
+        } else if (!build.try_lock()) {
+            return nullptr;
+        }
+
+        current = std::atomic_load(&hierarchy);
+        if (isCurrent(current)) {
+            return current;
+        }
+
+        auto snapshot = roadGraph.snapshot();
+        std::shared_ptr<ContractionHierarchy> next;
+        if (current && current->builtTopologyVersion() == snapshot.topologyVersion) {
+            next = std::make_shared<ContractionHierarchy>(*current);
+            next->customize(snapshot);
+        } else {
+            next = std::make_shared<ContractionHierarchy>(snapshot);
+        }
+        std::atomic_store(&hierarchy, std::shared_ptr<const ContractionHierarchy>(next));
+        return next;
+    }
+    
+    // Write JSON arrays of every location, order and driver
+    void writeLocations(JsonWriter& json) {
+        auto locations = getAllLocations();
+        json.reserve(64 * locations.size() + 2);
+        json.beginArray();
+        for (const auto& location : locations) {
+            json.beginObject()
+                .member("id", location.id)
+                .member("name", location.name)
+                .member("x", location.x)
+                .member("y", location.y)
+                .endObject();
+        }
+        json.endArray();
+    }
+    
+    void writeOrders(JsonWriter& json) {
+        auto orders = getAllOrders();
+        json.reserve(96 * orders.size() + 2);
+        json.beginArray();
+        for (const auto& order : orders) {
+            json.beginObject()
+                .member("id", order.id)
+                .member("restaurantId", order.restaurantId)
+                .member("customerLocationId", order.customerLocationId)
+                .member("status", order.status);
+            if (order.assignedDriverId > 0) {
+                json.member("assignedDriverId", order.assignedDriverId);
+            }
+            json.endObject();
+        }
+        json.endArray();
+    }
+    
+    void writeDrivers(JsonWriter& json) {
+        auto drivers = getAllDrivers();
+        json.reserve(112 * drivers.size() + 2);
+        json.beginArray();
+        for (const auto& driver : drivers) {
+            json.beginObject()
+                .member("id", driver.id)
+                .member("currentLocation", driver.currentLocation)
+                .member("speed", driver.speed)
+                .member("maxOrders", driver.maxOrders)
+                .member("detourLimit", driver.detourLimit)
+                .key("assignedOrders").array(driver.assignedOrders)
+                .endObject();
+        }
+        json.endArray();
     }
     
     // Generate JSON responses
     std::string locationsToJson() {
-        std::ostringstream json;
-        json << "[";
-        auto locations = getAllLocations();
+        JsonWriter json;
+        writeLocations(json);
+        return json.take();
+    }
+    
+    std::string ordersToJson() {
+        JsonWriter json;
+        writeOrders(json);
+        return json.take();
+    }
+    
+    std::string driversToJson() {
+        JsonWriter json;
+        writeDrivers(json);
+        return json.take();
+    }
+    
+    // Load an order's details; returns false if there is no such order
+bool getOrderById(int orderId, Order& order) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    auto stmt = statements->acquire("SELECT id, restaurant_id, customer_location_id, status FROM orders WHERE id = ?");
+    
+    if (!stmt) {
+        return false;
+    }
+    
+    sqlite3_bind_int(stmt, 1, orderId);
+    
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        return false; // Order not found
+    }
+    order.id = sqlite3_column_int(stmt, 0);
+    order.restaurantId = sqlite3_column_int(stmt, 1);
+    order.customerLocationId = sqlite3_column_int(stmt, 2);
+    order.status = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+    return true;
+}
+
+// Score for giving an order to a driver under Policy - lower is better, infinity
+// if the driver is full or the order would grow its route beyond the driver's
+// detour limit. The insertion to commit if the driver is chosen is written to insertion.
+// plan is the driver's planned stops; scoring reads no other shared state but
+// the location store, so it needs no lock.
+template <typename Policy>
+double scoreDriverForOrder(const Driver& driver, const std::vector<RouteStop>& plan, const Order& order,
+                           double distanceToRestaurant, double deliveryDistance, RouteInsertion& insertion) {
+    if (driver.assignedOrders.size() >= driver.maxOrders) {
+        return std::numeric_limits<double>::infinity();
+    }
+    
+    insertion = cheapestInsertion(plan, order);
+    bool hasRoute = !plan.empty();
+    if (hasRoute) {
+        // If the new route is much longer than the detour limit allows, consider it backtracking
+        double newRouteLength = insertion.routeDistance + insertion.addedDistance;
+        if (newRouteLength > insertion.routeDistance * driver.detourLimit) {
+            return std::numeric_limits<double>::infinity();
+        }
+    }
+    
+    ScoringInput input;
+    input.load = driver.assignedOrders.size();
+    input.speed = driver.speed;
+    input.hasRoute = hasRoute;
+    input.routeDistance = insertion.routeDistance;
+    input.addedDistance = insertion.addedDistance;
+    input.distanceToRestaurant = distanceToRestaurant;
+    input.deliveryDistance = deliveryDistance;
+    return Policy::score(input);
+}
+
+template <typename Policy>
+void scoreCandidatesWith(const std::vector<Driver>& drivers, const std::vector<std::vector<RouteStop>>& plans, const Order& order,
+                         const std::vector<double>& distancesToRestaurant, double deliveryDistance,
+                         std::vector<double>& scores, std::vector<RouteInsertion>& insertions) {
+    scores.resize(drivers.size());
+    insertions.resize(drivers.size());
+    for (size_t d = 0; d < drivers.size(); ++d) {
+        scores[d] = scoreDriverForOrder<Policy>(drivers[d], plans[d], order, distancesToRestaurant[d], deliveryDistance, insertions[d]);
+    }
+}
+
+// Score candidate drivers, whose planned stops are plans, for an order with the
+// configured policy. The policy is picked once here, not per candidate.
+void scoreCandidates(const std::vector<Driver>& drivers, const std::vector<std::vector<RouteStop>>& plans, const Order& order,
+                     const std::vector<double>& distancesToRestaurant, double deliveryDistance,
+                     std::vector<double>& scores, std::vector<RouteInsertion>& insertions) {
+    switch (scoringPolicy) {
+        case ScoringPolicy::Eta:
+            scoreCandidatesWith<EtaScoring>(drivers, plans, order, distancesToRestaurant, deliveryDistance, scores, insertions);
+            break;
+        case ScoringPolicy::LoadBalanced:
+            scoreCandidatesWith<LoadBalancedScoring>(drivers, plans, order, distancesToRestaurant, deliveryDistance, scores, insertions);
+            break;
+        default:
+            scoreCandidatesWith<DefaultScoring>(drivers, plans, order, distancesToRestaurant, deliveryDistance, scores, insertions);
+            break;
+    }
+}
+
+// Copy of each driver's planned stops, empty for drivers without any
+std::vector<std::vector<RouteStop>> plansOf(const std::vector<Driver>& drivers) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    std::vector<std::vector<RouteStop>> plans(drivers.size());
+    for (size_t d = 0; d < drivers.size(); ++d) {
+        auto plan = routePlans.find(drivers[d].id);
+        if (plan != routePlans.end()) {
+            plans[d] = plan->second;
+        }
+    }
+    return plans;
+}
+
+// Cheapest precedence-feasible insertion of an order's pickup and drop-off into
+// a stop sequence, in O(stops). Inserting into gap g replaces the leg between
+// stops g-1 and g; a pickup in gap i and drop-off in gap j > i change
+// independent legs, so the best pair comes from a suffix minimum over j.
+RouteInsertion cheapestInsertion(const std::vector<RouteStop>& stops, const Order& order) {
+    RouteInsertion best;
+    size_t n = stops.size();
+    std::vector<int> path;
+    path.reserve(n);
+    for (const auto& stop : stops) {
+        path.push_back(stop.locationId);
+    }
+    std::vector<double> legs = locationStore.legLengths(path);
+    std::vector<double> fromPickup = locationStore.distancesFrom(order.restaurantId, path);
+    std::vector<double> fromDropoff = locationStore.distancesFrom(order.customerLocationId, path);
+    double pickupToDropoff = calculateDistance(order.restaurantId, order.customerLocationId);
+    for (double leg : legs) {
+        best.routeDistance += leg;
+    }
+    
+    // Cost of the leg a gap replaces, and of splicing a single location into it
+    auto replacedLeg = [&](size_t gap) {
+        return gap > 0 && gap < n ? legs[gap - 1] : 0.0;
+    };
+    auto splice = [&](const std::vector<double>& distances, size_t gap) {
+        return (gap > 0 ? distances[gap - 1] : 0.0) + (gap < n ? distances[gap] : 0.0) - replacedLeg(gap);
+    };
+    
+    // Best drop-off gap strictly after each gap
+    std::vector<double> laterDropoff(n + 1, std::numeric_limits<double>::infinity());
+    std::vector<size_t> laterDropoffGap(n + 1, n);
+    for (size_t gap = n; gap-- > 0;) {
+        double cost = splice(fromDropoff, gap + 1);
+        if (cost <= laterDropoff[gap + 1]) {
+            laterDropoff[gap] = cost;
+            laterDropoffGap[gap] = gap + 1;
+        } else {
+            laterDropoff[gap] = laterDropoff[gap + 1];
+            laterDropoffGap[gap] = laterDropoffGap[gap + 1];
+        }
+    }
+    
+    for (size_t gap = 0; gap <= n; ++gap) {
+        // Pickup and drop-off back to back in the same gap
+        double together = (gap > 0 ? fromPickup[gap - 1] : 0.0) + pickupToDropoff +
+                          (gap < n ? fromDropoff[gap] : 0.0) - replacedLeg(gap);
+        if (together < best.addedDistance) {
+            best.addedDistance = together;
+            best.pickupGap = best.dropoffGap = gap;
+        }
+        // Pickup here, drop-off in a later gap
+        if (gap < n) {
+            double apart = splice(fromPickup, gap) + laterDropoff[gap];
+            if (apart < best.addedDistance) {
+                best.addedDistance = apart;
+                best.pickupGap = gap;
+                best.dropoffGap = laterDropoffGap[gap];
+            }
+        }
+    }
+    return best;
+}
+
+// Splice an order's pickup and drop-off into a stop sequence at an insertion's gaps
+static void insertStops(std::vector<RouteStop>& stops, const Order& order, const RouteInsertion& insertion) {
+    size_t pickupGap = std::min(insertion.pickupGap, stops.size());
+    size_t dropoffGap = std::min(std::max(insertion.dropoffGap, pickupGap), stops.size());
+    // Drop-off first, so the pickup insertion shifts it into place behind the pickup
+    stops.insert(stops.begin() + dropoffGap, {order.id, order.customerLocationId, false});
+    stops.insert(stops.begin() + pickupGap, {order.id, order.restaurantId, true});
+}
+
+// Commit an insertion to a driver's planned stops
+void planOrder(int driverId, const Order& order, const RouteInsertion& insertion) {
+    unplanOrder(order.id);
+    insertStops(routePlans[driverId], order, insertion);
+    plannedDriverForOrder[order.id] = driverId;
+}
+
+// Road-network cost between every pair of stops. Pairs with no road path
+// between them fall back to straight-line distance, and so does the whole
+// matrix if the searches run past the deadline. Needs no lock: the road graph
+// and location store guard themselves.
+std::vector<std::vector<double>> routeCostMatrix(const std::vector<RouteStop>& stops,
+                                                 std::chrono::steady_clock::time_point deadline) {
+    Tracer::Span span("routeCostMatrix", static_cast<long long>(stops.size()));
+    // One one-to-many search per distinct location
+    std::vector<int> locations;
+    for (const auto& stop : stops) {
+        if (std::find(locations.begin(), locations.end(), stop.locationId) == locations.end()) {
+            locations.push_back(stop.locationId);
+        }
+    }
+    std::map<std::pair<int, int>, double> locationCost;
+    for (int from : locations) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            // Mixing road and straight-line rows would skew the search; use straight lines throughout
+            for (int a : locations) {
+                for (int b : locations) {
+                    locationCost[{a, b}] = calculateDistance(a, b);
+                }
+            }
+            break;
+        }
+        std::vector<double> costs = roadGraph.costsFrom(from, locations);
         for (size_t i = 0; i < locations.size(); ++i) {
-            if (i > 0) json << ",";
-            json << "{\"id\":" << locations[i].id 
-                 << ",\"name\":\"" << escape_json(locations[i].name) << "\""
-                 << ",\"x\":" << locations[i].x 
-                 << ",\"y\":" << locations[i].y << "}";
+            double value = locations[i] == from ? 0.0 : costs[i];
+            if (value == std::numeric_limits<double>::infinity()) {
+                value = calculateDistance(from, locations[i]);
+            }
+            locationCost[{from, locations[i]}] = value;
+        }
+    }
+    std::vector<std::vector<double>> cost(stops.size(), std::vector<double>(stops.size()));
+    for (size_t a = 0; a < stops.size(); ++a) {
+        for (size_t b = 0; b < stops.size(); ++b) {
+            cost[a][b] = locationCost[{stops[a].locationId, stops[b].locationId}];
+        }
+    }
+    return cost;
+}
+
+// Stops reordered by local search over road-network costs; needs no lock. The
+// budget covers building the cost matrix as well as the search.
+std::vector<RouteStop> optimizedStops(const std::vector<RouteStop>& stops, std::chrono::microseconds budget) {
+    auto deadline = std::chrono::steady_clock::now() + budget;
+    std::vector<std::vector<double>> cost = routeCostMatrix(stops, deadline);
+    std::vector<int> order = RouteOptimizer(stops, cost, deadline).run();
+    std::vector<RouteStop> optimized;
+    optimized.reserve(order.size());
+    for (int index : order) {
+        optimized.push_back(stops[index]);
+    }
+    return optimized;
+}
+
+// Reorder a driver's stops by local search over road-network costs
+void optimizeRoute(int driverId) {
+    Tracer::Span span("optimizeRoute", driverId);
+    auto plan = routePlans.find(driverId);
+    if (plan == routePlans.end() || plan->second.size() < 4) {
+        return; // A single order has only one feasible ordering
+    }
+    plan->second = optimizedStops(plan->second, routeOptimizationBudget);
+}
+
+void setRouteOptimizationBudget(std::chrono::microseconds budget) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    routeOptimizationBudget = budget;
+}
+
+// Drop an order's stops from whichever driver had it planned
+void unplanOrder(int orderId) {
+    auto planned = plannedDriverForOrder.find(orderId);
+    if (planned == plannedDriverForOrder.end()) {
+        return;
+    }
+    auto& stops = routePlans[planned->second];
+    stops.erase(std::remove_if(stops.begin(), stops.end(), [orderId](const RouteStop& stop) {
+        return stop.orderId == orderId;
+    }), stops.end());
+    if (stops.empty()) {
+        routePlans.erase(planned->second);
+    }
+    plannedDriverForOrder.erase(planned);
+}
+
+// Load the given drivers that are not yet in scoredDrivers, and mark them scored
+std::vector<Driver> loadUnscoredDrivers(const std::vector<int>& driverIds, std::set<int>& scoredDrivers) {
+    std::vector<Driver> drivers;
+    for (int driverId : driverIds) {
+        Driver driver;
+        if (scoredDrivers.insert(driverId).second && getDriverById(driverId, driver)) {
+            drivers.push_back(driver);
         }
-        json << "]";
-        return json.str();
     }
+    return drivers;
+}
+
+// Add the driver_orders row for an assignment
+bool insertDriverOrder(int driverId, int orderId) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    auto stmt = statements->acquire("INSERT INTO driver_orders (driver_id, order_id) VALUES (?, ?)");
     
-    std::string ordersToJson() {
-        std::ostringstream json;
-        json << "[";
-        auto orders = getAllOrders();
-        for (size_t i = 0; i < orders.size(); ++i) {
-            if (i > 0) json << ",";
-            json << "{\"id\":" << orders[i].id 
-                 << ",\"restaurantId\":" << orders[i].restaurantId 
-                 << ",\"customerLocationId\":" << orders[i].customerLocationId 
-                 << ",\"status\":\"" << escape_json(orders[i].status) << "\"";
-            
-            if (orders[i].assignedDriverId > 0) {
-                json << ",\"assignedDriverId\":" << orders[i].assignedDriverId;
-            }
-            
-            json << "}";
-        }
-        json << "]";
-        return json.str();
+    if (!stmt) {
+        return false;
     }
     
-    std::string driversToJson() {
-        std::ostringstream json;
-        json << "[";
-        auto drivers = getAllDrivers();
-        for (size_t i = 0; i < drivers.size(); ++i) {
-            if (i > 0) json << ",";
-            json << "{\"id\":" << drivers[i].id 
-                 << ",\"currentLocation\":" << drivers[i].currentLocation 
-                 << ",\"speed\":" << drivers[i].speed 
-                 << ",\"assignedOrders\":[";
-            
-            for (size_t j = 0; j < drivers[i].assignedOrders.size(); ++j) {
-                if (j > 0) json << ",";
-                json << drivers[i].assignedOrders[j];
-            }
-            
-            json << "]}";
-        }
-        json << "]";
-        return json.str();
+    sqlite3_bind_int(stmt, 1, driverId);
+    sqlite3_bind_int(stmt, 2, orderId);
+    
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        return false;
+    }
+    publishChange("order", [&](JsonWriter& change) {
+        change.member("id", orderId).member("assignedDriverId", driverId);
+    });
+    return true;
+}
+
+// Record the assignment of an order to a driver and commit its insertion into the driver's route
+bool recordAssignment(int driverId, const Order& order, const RouteInsertion& insertion) {
+    Tracer::Span span("recordAssignment", order.id);
+    int orderId = order.id;
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    if (!insertDriverOrder(driverId, orderId)) {
+        return false;
     }
+    planOrder(driverId, order, insertion);
+    optimizeRoute(driverId);
+    redispatch.remove(orderId);
     
-    // Parse JSON from string
-    std::map<std::string, std::string> parseJson(const std::string& jsonStr) {
-        std::map<std::string, std::string> result;
+    // Update order status
+    updateOrderStatus(orderId, "Assigned");
+    return true;
+}
+
+// Record the assignment of an order to a driver whose new route, including the order, is already planned
+bool recordPlannedAssignment(int driverId, const Order& order, std::vector<RouteStop> stops) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    if (!insertDriverOrder(driverId, order.id)) {
+        return false;
+    }
+    unplanOrder(order.id);
+    routePlans[driverId].swap(stops);
+    plannedDriverForOrder[order.id] = driverId;
+    redispatch.remove(order.id);
+    updateOrderStatus(order.id, "Assigned");
+    return true;
+}
+
+// Place an order using only one region's drivers, on that region's thread. The
+// nearest candidates are copied under dbMutex, then scored and the winner's
+// route optimized without it, so regions work in parallel; dbMutex is taken
+// again only to commit. If the winner's orders, limits or route changed in
+// between, the attempt starts over, and the last attempt holds dbMutex
+// throughout. Returns true once the order needs no more dispatching.
+bool dispatchInRegion(const DriverIndex& regionDrivers, int orderId) {
+    Tracer::Span span("dispatchInRegion", orderId);
+    for (int attempt = 1; attempt <= kRegionalAttempts; ++attempt) {
+        std::unique_lock<std::recursive_mutex> serial(dbMutex, std::defer_lock);
+        if (attempt == kRegionalAttempts) {
+            serial.lock();
+        }
         
-        size_t pos = 0;
-        while(pos < jsonStr.size()) {
-            // Find key start (after quote)
-            size_t keyStart = jsonStr.find('"', pos);
-            if (keyStart == std::string::npos) break;
-            keyStart++;
-            
-            // Find key end (before quote)
-            size_t keyEnd = jsonStr.find('"', keyStart);
-            if (keyEnd == std::string::npos) break;
-            
-            std::string key = jsonStr.substr(keyStart, keyEnd - keyStart);
-            
-            // Find value start (after colon and whitespace)
-            size_t valueStart = jsonStr.find(':', keyEnd) + 1;
-            while (valueStart < jsonStr.size() && std::isspace(jsonStr[valueStart])) {
-                valueStart++;
+        Order order;
+        std::vector<Driver> drivers;
+        std::vector<std::vector<RouteStop>> plans;
+        std::vector<double> distancesToRestaurant;
+        double deliveryDistance;
+        std::chrono::microseconds budget;
+        {
+            std::lock_guard<std::recursive_mutex> lock(dbMutex);
+            if (!getOrderById(orderId, order) || plannedDriverForOrder.count(orderId) > 0) {
+                return true; // Completed, or assigned by other means
             }
-            
-            if (valueStart >= jsonStr.size()) break;
-            
-            std::string value;
-            if (jsonStr[valueStart] == '"') {
-                // String value
-                valueStart++;
-                size_t valueEnd = jsonStr.find('"', valueStart);
-                if (valueEnd == std::string::npos) break;
-                value = jsonStr.substr(valueStart, valueEnd - valueStart);
-                pos = valueEnd + 1;
-            } else {
-                // Number or other value - find next comma or closing brace
-                size_t valueEnd = jsonStr.find_first_of(",}", valueStart);
-                if (valueEnd == std::string::npos) break;
-                value = jsonStr.substr(valueStart, valueEnd - valueStart);
-                // Trim whitespace
-                while (!value.empty() && std::isspace(value.back())) {
-                    value.pop_back();
-                }
-                pos = valueEnd;
+            double x, y;
+            locationStore.position(order.restaurantId, x, y);
+            std::set<int> loaded;
+            drivers = loadUnscoredDrivers(regionDrivers.nearest(x, y, kAssignmentCandidates), loaded);
+            plans = plansOf(drivers);
+            budget = routeOptimizationBudget;
+        }
+        std::vector<int> driverLocations;
+        for (const auto& driver : drivers) {
+            driverLocations.push_back(driver.currentLocation);
+        }
+        distancesToRestaurant = locationStore.distancesFrom(order.restaurantId, driverLocations);
+        deliveryDistance = calculateDistance(order.restaurantId, order.customerLocationId);
+        
+        std::vector<double> scores;
+        std::vector<RouteInsertion> insertions;
+        scoreCandidates(drivers, plans, order, distancesToRestaurant, deliveryDistance, scores, insertions);
+        metrics().recordCandidatesScored(drivers.size());
+        size_t best = drivers.size();
+        for (size_t d = 0; d < drivers.size(); ++d) {
+            if (scores[d] < std::numeric_limits<double>::infinity() && (best == drivers.size() || scores[d] < scores[best])) {
+                best = d;
             }
-            
-            result[key] = value;
+        }
+        if (best == drivers.size()) {
+            return false; // No driver in this region can take it
         }
         
-        return result;
+        std::vector<RouteStop> stops = plans[best];
+        insertStops(stops, order, insertions[best]);
+        if (stops.size() >= 4) {
+            stops = optimizedStops(stops, budget);
+        }
+        
+        std::lock_guard<std::recursive_mutex> lock(dbMutex);
+        if (plannedDriverForOrder.count(orderId) > 0) {
+            return true;
+        }
+        Driver current;
+        auto plan = routePlans.find(drivers[best].id);
+        bool unchanged = getDriverById(drivers[best].id, current) &&
+                         current.assignedOrders == drivers[best].assignedOrders &&
+                         current.maxOrders == drivers[best].maxOrders &&
+                         current.detourLimit == drivers[best].detourLimit &&
+                         (plan == routePlans.end() ? plans[best].empty() : plan->second == plans[best]);
+        if (unchanged) {
+            return recordPlannedAssignment(drivers[best].id, order, std::move(stops));
+        }
     }
+    return false;
+}
 
     // Assign a driver to an order automatically
-// Replace the assignDriverToOrder method:
 int assignDriverToOrder(int orderId) {
-    auto drivers = getAllDrivers();
-    if (drivers.empty()) {
+    Tracer::Span span("assignDriverToOrder", orderId);
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    if (driverIndex.size() == 0) {
         return -1; // No drivers available
     }
     
     // Get order details
     Order order;
-    sqlite3_stmt* stmt;
-    std::string sql = "SELECT id, restaurant_id, customer_location_id, status FROM orders WHERE id = ?";
-    
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!getOrderById(orderId, order)) {
         return -1;
     }
     
-    sqlite3_bind_int(stmt, 1, orderId);
-    
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        order.id = sqlite3_column_int(stmt, 0);
-        order.restaurantId = sqlite3_column_int(stmt, 1);
-        order.customerLocationId = sqlite3_column_int(stmt, 2);
-        order.status = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-    } else {
-        sqlite3_finalize(stmt);
-        return -1; // Order not found
+    int driverId = assignBestDriver(order);
+    if (driverId != -1) {
+        return driverId;
     }
     
-    sqlite3_finalize(stmt);
-    
-    // Find the best driver based on:
-    // 1. Is the order along the driver's current direction of travel?
-    // 2. Driver's current load
-    // 3. Driver's speed
-    
+    // If no suitable driver found, mark the order as pending until capacity frees up
+    updateOrderStatus(orderId, "Pending");
+    redispatch.add(orderId);
+    return -1;
+}
+
+// Score drivers for an order and assign the best; -1, with nothing written, when none can take it
+int assignBestDriver(const Order& order) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
     int bestDriver = -1;
     double bestScore = std::numeric_limits<double>::infinity();
-    bool foundSuitableDriver = false;
+    RouteInsertion bestInsertion;
     
-    for (const auto& driver : drivers) {
-        // Skip drivers with too many orders (limit to 3 for efficiency)
-        if (driver.assignedOrders.size() >= 3) {
-            continue;
-        }
-        
-        // Get the driver's current route
-        std::vector<int> currentRoute = getDriverRoute(driver.id);
-        
-        // Calculate base score from number of orders and speed
-        double loadFactor = driver.assignedOrders.size() * 2.0; // Each order adds 2.0 to the score
-        double speedBonus = 10.0 / driver.speed; // Faster drivers get lower scores
+    // Only the drivers nearest the restaurant are scored; the search widens
+    // when none of them can take the order
+    double restaurantX, restaurantY;
+    locationStore.position(order.restaurantId, restaurantX, restaurantY);
+    double deliveryDistance = calculateDistance(order.restaurantId, order.customerLocationId);
+    std::set<int> scoredDrivers;
+    size_t candidateCount = kAssignmentCandidates;
+    
+    while (true) {
+        std::vector<int> candidateIds = driverIndex.nearest(restaurantX, restaurantY, candidateCount);
+        std::vector<Driver> drivers = loadUnscoredDrivers(candidateIds, scoredDrivers);
         
-        double routeCompatibilityScore = 0;
-        bool wouldCauseBacktracking = false;
+        // Straight-line distance from every candidate to the restaurant, in one batch
+        std::vector<int> driverLocations;
+        for (const auto& driver : drivers) {
+            driverLocations.push_back(driver.currentLocation);
+        }
+        std::vector<double> distancesToRestaurant = locationStore.distancesFrom(order.restaurantId, driverLocations);
         
-        if (!currentRoute.empty() && currentRoute.size() > 1) {
-            // Check if adding the new order would cause backtracking
-            // Find the overall direction of travel
-            int lastLoc = currentRoute.back();
-            int firstLoc = currentRoute.front();
-            
-            // Calculate if the new locations would add significant detour
-            double currentRouteLength = 0;
-            for (size_t i = 0; i < currentRoute.size() - 1; i++) {
-                currentRouteLength += calculateDistance(currentRoute[i], currentRoute[i+1]);
+        std::vector<double> scores;
+        std::vector<RouteInsertion> insertions;
+        scoreCandidates(drivers, plansOf(drivers), order, distancesToRestaurant, deliveryDistance, scores, insertions);
+        for (size_t d = 0; d < drivers.size(); ++d) {
+            if (scores[d] < bestScore) {
+                bestScore = scores[d];
+                bestDriver = drivers[d].id;
+                bestInsertion = insertions[d];
             }
-            
-            // Calculate potential new route length with new order locations
-            std::vector<int> testRoute = currentRoute;
-            testRoute.push_back(order.restaurantId);
-            testRoute.push_back(order.customerLocationId);
-            
-            double newRouteLength = 0;
-            for (size_t i = 0; i < testRoute.size() - 1; i++) {
-                newRouteLength += calculateDistance(testRoute[i], testRoute[i+1]);
-            }
-            
-            // If the new route is much longer (more than 50% detour), consider it backtracking
-            if (newRouteLength > currentRouteLength * 1.5) {
-                wouldCauseBacktracking = true;
-            }
-            
-            // If no backtracking, calculate a route compatibility score
-            if (!wouldCauseBacktracking) {
-                // Measure how well the new order fits in the current route
-                double avgDetourDistance = (newRouteLength - currentRouteLength) / 2.0;
-                routeCompatibilityScore = avgDetourDistance;
-                foundSuitableDriver = true;
-            }
-        } else {
-            // For drivers with no route or only one location, just use direct distance
-            double distToRestaurant = calculateDistance(driver.currentLocation, order.restaurantId);
-            double distTotal = distToRestaurant + 
-                              calculateDistance(order.restaurantId, order.customerLocationId);
-            
-            routeCompatibilityScore = distTotal / driver.speed;
-            foundSuitableDriver = true;
         }
         
-        // Only consider this driver if they wouldn't need to backtrack
-        if (!wouldCauseBacktracking) {
-            // Calculate final score - lower is better
-            double score = loadFactor + speedBonus + routeCompatibilityScore;
-            
-            if (score < bestScore) {
-                bestScore = score;
-                bestDriver = driver.id;
-            }
+        if (bestDriver != -1 || candidateIds.size() < candidateCount) {
+            break; // Found a driver, or every driver has been scored
         }
+        candidateCount *= 4;
     }
+    metrics().recordCandidatesScored(scoredDrivers.size());
     
-    if (bestDriver != -1 && foundSuitableDriver) {
-        // Assign the driver
-        sql = "INSERT INTO driver_orders (driver_id, order_id) VALUES (?, ?)";
-        
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-            return -1;
+    if (bestDriver == -1) {
+        return -1;
+    }
+    return recordAssignment(bestDriver, order, bestInsertion) ? bestDriver : -1;
+}
+
+// One scheduled retry of a Pending order; true when it no longer needs a driver
+bool retryPendingOrder(int orderId) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    Order order;
+    if (!getOrderById(orderId, order) || order.status != "Pending") {
+        return true; // Completed, or assigned by other means
+    }
+    // Already Pending and queued, so a miss leaves it as it is
+    Tracer::Span span("retryPendingOrder", orderId);
+    return assignBestDriver(order) != -1;
+}
+
+// Assign a batch of orders together by min-cost matching over the same scores
+// assignDriverToOrder uses. Each round gives every driver at most one order;
+// rounds repeat with refreshed scores (routes and loads have changed) until
+// no match is possible, and leftovers go through assignDriverToOrder.
+// Returns (order ID, driver ID or -1) for each order.
+std::vector<std::pair<int, int>> assignDriversToOrders(const std::vector<int>& orderIds) {
+    Tracer::Span span("assignDriversToOrders", static_cast<long long>(orderIds.size()));
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    std::vector<std::pair<int, int>> results;
+    std::vector<Order> remaining;
+    for (int orderId : orderIds) {
+        Order order;
+        if (getOrderById(orderId, order)) {
+            remaining.push_back(order);
+        } else {
+            results.push_back({orderId, -1});
         }
-        
-        sqlite3_bind_int(stmt, 1, bestDriver);
-        sqlite3_bind_int(stmt, 2, orderId);
-        
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            sqlite3_finalize(stmt);
-            return -1;
+    }
+    
+    while (!remaining.empty() && driverIndex.size() > 0) {
+        // Candidate drivers: the nearest few to each order's restaurant
+        std::set<int> candidateSet;
+        for (const auto& order : remaining) {
+            double x, y;
+            locationStore.position(order.restaurantId, x, y);
+            for (int driverId : driverIndex.nearest(x, y, kAssignmentCandidates)) {
+                candidateSet.insert(driverId);
+            }
+        }
+        std::set<int> loaded;
+        std::vector<Driver> drivers = loadUnscoredDrivers(std::vector<int>(candidateSet.begin(), candidateSet.end()), loaded);
+        std::vector<int> driverLocations;
+        for (const auto& driver : drivers) {
+            driverLocations.push_back(driver.currentLocation);
         }
         
-        sqlite3_finalize(stmt);
-        
-        // Update order status
-        updateOrderStatus(orderId, "Assigned");
+        std::vector<std::vector<RouteStop>> plans = plansOf(drivers);
+        std::vector<std::vector<double>> cost(remaining.size());
+        std::vector<std::vector<RouteInsertion>> insertions(remaining.size());
+        for (size_t i = 0; i < remaining.size(); ++i) {
+            const Order& order = remaining[i];
+            std::vector<double> distancesToRestaurant = locationStore.distancesFrom(order.restaurantId, driverLocations);
+            double deliveryDistance = calculateDistance(order.restaurantId, order.customerLocationId);
+            scoreCandidates(drivers, plans, order, distancesToRestaurant, deliveryDistance, cost[i], insertions[i]);
+            metrics().recordCandidatesScored(drivers.size());
+        }
         
-        return bestDriver;
+        std::vector<int> match = minCostAssignment(cost);
+        std::vector<Order> unmatched;
+        bool progress = false;
+        for (size_t i = 0; i < remaining.size(); ++i) {
+            if (match[i] >= 0 && recordAssignment(drivers[match[i]].id, remaining[i], insertions[i][match[i]])) {
+                results.push_back({remaining[i].id, drivers[match[i]].id});
+                progress = true;
+            } else {
+                unmatched.push_back(remaining[i]);
+            }
+        }
+        remaining.swap(unmatched);
+        if (!progress) {
+            break;
+        }
     }
     
-    // If no suitable driver found, mark the order as pending
-    updateOrderStatus(orderId, "Pending");
-    return -1;
+    // Whatever is left gets the one-at-a-time search, which widens beyond the nearest drivers
+    for (const auto& order : remaining) {
+        results.push_back({order.id, assignDriverToOrder(order.id)});
+    }
+    return results;
+}
+
+// Hand a new order to the batch dispatcher; false when batching is off
+bool queueForBatchDispatch(int orderId) {
+    return orderBatcher.enqueue(orderId);
+}
+
+// Assign every queued order now instead of waiting for the window
+std::vector<std::pair<int, int>> flushBatchDispatch() {
+    return assignDriversToOrders(orderBatcher.takeAll());
+}
+
+// Split dispatch over a rows x cols grid covering the current locations, each
+// region with its own thread. Call once, before serving requests.
+void enableRegionalDispatch(int rows, int cols) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
+    if (regional) {
+        return;
+    }
+    auto locations = getAllLocations();
+    double minX = 0, minY = 0, maxX = 0, maxY = 0;
+    for (size_t i = 0; i < locations.size(); ++i) {
+        if (i == 0) {
+            minX = maxX = locations[i].x;
+            minY = maxY = locations[i].y;
+        }
+        minX = std::min(minX, locations[i].x);
+        maxX = std::max(maxX, locations[i].x);
+        minY = std::min(minY, locations[i].y);
+        maxY = std::max(maxY, locations[i].y);
+    }
+    regional.reset(new RegionalDispatcher(rows, cols, std::make_tuple(minX, minY, maxX, maxY),
+        [this](const DriverIndex& drivers, int orderId) { return dispatchInRegion(drivers, orderId); },
+        [this](int orderId) { assignDriverToOrder(orderId); }));
+    for (const auto& driver : getAllDrivers()) {
+        placeDriver(driver.id, driver.currentLocation);
+    }
+}
+
+// Hand a new order to its restaurant's region; false when regional dispatch is off
+bool queueForRegionalDispatch(int orderId, int restaurantId) {
+    if (!regional) {
+        return false;
+    }
+    double x, y;
+    locationStore.position(restaurantId, x, y);
+    return regional->enqueue(orderId, x, y);
+}
+
+// Per-region driver counts, queue lengths and dispatch counters as JSON
+std::string regionalDispatchJson() {
+    std::ostringstream json;
+    if (!regional) {
+        json << "{\"enabled\":false}";
+        return json.str();
+    }
+    json << "{\"enabled\":true,\"rows\":" << regional->rowCount()
+         << ",\"cols\":" << regional->columnCount() << ",\"regions\":[";
+    auto stats = regional->stats();
+    for (size_t i = 0; i < stats.size(); ++i) {
+        if (i > 0) json << ",";
+        json << "{\"region\":" << i
+             << ",\"drivers\":" << stats[i].drivers
+             << ",\"queued\":" << stats[i].queued
+             << ",\"dispatched\":" << stats[i].dispatched
+             << ",\"handedOff\":" << stats[i].handedOff << "}";
+    }
+    json << "]}";
+    return json.str();
+}
+
+void configureBatchDispatch(const OrderBatcher::Settings& settings) {
+    orderBatcher.configure(settings);
+}
+
+OrderBatcher::Settings batchDispatchSettings() {
+    return orderBatcher.current();
 }
 
+// Dispatch mode and queue length as JSON
+std::string batchDispatchJson() {
+    auto settings = orderBatcher.current();
+    std::ostringstream json;
+    json << "{\"mode\":\"" << (settings.enabled ? "batch" : "greedy") << "\""
+         << ",\"windowMs\":" << settings.windowMs
+         << ",\"maxOrders\":" << settings.maxOrders
+         << ",\"pendingOrders\":" << orderBatcher.pending()
+         << ",\"awaitingDriver\":" << redispatch.waiting()
+         << ",\"redispatchPasses\":" << redispatch.passCount()
+         << ",\"redispatchRetries\":" << redispatch.retryCount() << "}";
+    return json.str();
+}
 
 // Update traffic on a route
 void updateTrafficOnRoute(const std::vector<int>& route, double trafficIncrement = 0.1) {
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
     if (route.size() < 2) {
         return; // Need at least two locations to have a route
     }
@@ -1011,16 +6107,16 @@ void updateTrafficOnRoute(const std::vector<int>& route, double trafficIncrement
     }
 }
 
-
 // Complete an order
 // Replace the completeOrder method:
 bool completeOrder(int orderId) {
+    Tracer::Span span("completeOrder", orderId);
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
     // First, get the order details before deleting
     Order order;
-    sqlite3_stmt* stmt;
-    std::string sql = "SELECT id, restaurant_id, customer_location_id, status FROM orders WHERE id = ?";
+    auto stmt = statements->acquire("SELECT id, restaurant_id, customer_location_id, status FROM orders WHERE id = ?");
     
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!stmt) {
         return false;
     }
     
@@ -1032,222 +6128,59 @@ bool completeOrder(int orderId) {
         order.customerLocationId = sqlite3_column_int(stmt, 2);
         order.status = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
     } else {
-        sqlite3_finalize(stmt);
         return false; // Order not found
     }
     
-    sqlite3_finalize(stmt);
-    
     // Remove driver assignment
-    sql = "DELETE FROM driver_orders WHERE order_id = ?";
+    stmt = statements->acquire("DELETE FROM driver_orders WHERE order_id = ?");
     
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!stmt) {
         return false;
     }
     
     sqlite3_bind_int(stmt, 1, orderId);
     bool driverRemoved = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
     
     if (!driverRemoved) {
         return false;
     }
+    unplanOrder(orderId);
+    redispatch.remove(orderId);
     
     // Delete the order from the database
-    sql = "DELETE FROM orders WHERE id = ?";
+    stmt = statements->acquire("DELETE FROM orders WHERE id = ?");
     
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!stmt) {
         return false;
     }
     
     sqlite3_bind_int(stmt, 1, orderId);
     bool orderDeleted = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
+    if (orderDeleted) {
+        publishChange("order.removed", [&](JsonWriter& change) {
+            change.member("id", orderId);
+        });
+        redispatch.notify(); // The driver has room for another order
+    }
     
     return orderDeleted;
 }
 
-// Get the optimal route for a driver
-// Replace the getDriverRoute method with this improved version:
+// Get the planned route for a driver: the locations of its stops in order
 std::vector<int> getDriverRoute(int driverId) {
-    // Get driver's current location and orders
-    Driver driver;
-    bool driverFound = false;
-    
-    auto drivers = getAllDrivers();
-    for (const auto& d : drivers) {
-        if (d.id == driverId) {
-            driver = d;
-            driverFound = true;
-            break;
-        }
-    }
-    
-    if (!driverFound || driver.assignedOrders.empty()) {
-        return {}; // No driver or no orders
-    }
-    
-    // Get all order locations (restaurant and customer)
-    struct OrderLocation {
-        int orderId;
-        int locationId;
-        bool isRestaurant;  // true for restaurant, false for customer
-        std::string name;   // Location name for debugging
-    };
-    
-    std::vector<OrderLocation> orderLocations;
-    std::map<int, Location> locationCache; // Cache location data
-    
-    // Fetch all locations once to avoid multiple database calls
-    auto allLocations = getAllLocations();
-    for (const auto& loc : allLocations) {
-        locationCache[loc.id] = loc;
-    }
-    
-    for (int orderId : driver.assignedOrders) {
-        sqlite3_stmt* stmt;
-        std::string sql = "SELECT id, restaurant_id, customer_location_id, status FROM orders WHERE id = ?";
-        
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-            continue;
-        }
-        
-        sqlite3_bind_int(stmt, 1, orderId);
-        
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            int id = sqlite3_column_int(stmt, 0);
-            int restaurantId = sqlite3_column_int(stmt, 1);
-            int customerId = sqlite3_column_int(stmt, 2);
-            std::string status = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-            
-            sqlite3_finalize(stmt);
-            
-            // Skip delivered orders
-            if (status == "Delivered") {
-                continue;
-            }
-            
-            // Add restaurant location
-            if (locationCache.find(restaurantId) != locationCache.end()) {
-                orderLocations.push_back({id, restaurantId, true, locationCache[restaurantId].name});
-            }
-            
-            // Add customer location
-            if (locationCache.find(customerId) != locationCache.end()) {
-                orderLocations.push_back({id, customerId, false, locationCache[customerId].name});
-            }
-        } else {
-            sqlite3_finalize(stmt);
-        }
-    }
-    
-    if (orderLocations.empty()) {
-        return {}; // No valid locations to visit
-    }
-    
-    // Create a route based on our order locations
+    Tracer::Span span("getDriverRoute", driverId);
+    std::lock_guard<std::recursive_mutex> lock(dbMutex);
     std::vector<int> route;
-    std::set<int> visitedLocations; // Use a set to track unique locations
-    std::map<int, bool> pickedUp; // Track which orders have been picked up
-    
-    // We'll start from the first restaurant, not the driver's current location
-    // Find the first restaurant in our order list
-    int startLocation = -1;
-    for (const auto& loc : orderLocations) {
-        if (loc.isRestaurant) {
-            startLocation = loc.locationId;
-            break;
-        }
-    }
-    
-    // If no restaurant found, use the first location in our list
-    if (startLocation == -1 && !orderLocations.empty()) {
-        startLocation = orderLocations[0].locationId;
-    }
-    
-    // If we still don't have a start, use driver's location as fallback
-    if (startLocation == -1) {
-        startLocation = driver.currentLocation;
-    }
-    
-    // Add start location to route and visited set
-    route.push_back(startLocation);
-    visitedLocations.insert(startLocation);
-    int currentLocation = startLocation;
-    
-    // Mark order as picked up if we're starting at a restaurant
-    for (const auto& loc : orderLocations) {
-        if (loc.locationId == startLocation && loc.isRestaurant) {
-            pickedUp[loc.orderId] = true;
-        }
-    }
-    
-    // Continue until all locations are visited
-    std::vector<bool> visited(orderLocations.size(), false);
-    bool madeProgress = true;
-    
-    while (madeProgress) {
-        madeProgress = false;
-        double bestDistance = std::numeric_limits<double>::infinity();
-        int bestNextIndex = -1;
-        
-        // Find closest unvisited location
-        for (size_t i = 0; i < orderLocations.size(); i++) {
-            if (visited[i]) continue;
-            
-            // If this is a customer location, skip if we haven't picked up from restaurant yet
-            if (!orderLocations[i].isRestaurant && 
-                pickedUp.find(orderLocations[i].orderId) == pickedUp.end()) {
-                continue;
-            }
-            
-            double distance = calculateDistance(currentLocation, orderLocations[i].locationId);
-            if (distance < bestDistance) {
-                bestDistance = distance;
-                bestNextIndex = i;
-            }
-        }
-        
-        // No more locations to visit
-        if (bestNextIndex == -1) break;
-        
-        // If this location is already in our route, don't add it again
-        int nextLocation = orderLocations[bestNextIndex].locationId;
-        if (visitedLocations.find(nextLocation) == visitedLocations.end()) {
-            route.push_back(nextLocation);
-            visitedLocations.insert(nextLocation);
-            madeProgress = true;
-        }
-        
-        // If this is a restaurant, mark order as picked up
-        if (orderLocations[bestNextIndex].isRestaurant) {
-            pickedUp[orderLocations[bestNextIndex].orderId] = true;
-        }
-        
-        // Update current location and mark as visited
-        currentLocation = nextLocation;
-        visited[bestNextIndex] = true;
+    auto plan = routePlans.find(driverId);
+    if (plan == routePlans.end()) {
+        return route; // No driver or no orders
     }
-    
-    // Make sure we have at least the restaurant and customer
-    if (route.size() < 2 && orderLocations.size() >= 2) {
-        // If we have a single-stop route with multiple locations, something went wrong
-        // Let's just make a direct route from restaurant to customer
-        route.clear();
-        
-        for (const auto& loc : orderLocations) {
-            if (loc.isRestaurant) {
-                route.push_back(loc.locationId);
-            }
-        }
-        
-        for (const auto& loc : orderLocations) {
-            if (!loc.isRestaurant) {
-                route.push_back(loc.locationId);
-            }
+    for (const auto& stop : plan->second) {
+        // Consecutive stops at the same place are one visit
+        if (route.empty() || route.back() != stop.locationId) {
+            route.push_back(stop.locationId);
         }
     }
-    
     return route;
 }
 };
@@ -1274,241 +6207,175 @@ std::string serveStaticFile(const std::string& filename) {
         contentType = "application/octet-stream";
     }
     
-    std::ostringstream response;
-    response << "HTTP/1.1 200 OK\r\n"
-             << "Content-Type: " << contentType << "\r\n"
-             << "Content-Length: " << content.length() << "\r\n"
-             << "Connection: close\r\n"
-             << "\r\n"
-             << content;
-             
-    return response.str();
-}
-
-int main() {
-    DeliverySystem system;
-    
-    SimpleHttpServer server(8080);
-    
-    server.start([&system](const std::string& method, const std::string& path, const std::string& body) -> std::string {
-        // Handle CORS preflight
-        if (method == "OPTIONS") {
-            return "HTTP/1.1 200 OK\r\n"
-                   "Access-Control-Allow-Origin: *\r\n"
-                   "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
-                   "Access-Control-Allow-Headers: X-Custom-Header, Content-Type\r\n"
-                   "Content-Length: 0\r\n"
-                   "\r\n";
-        }
-        
-        // CORS headers for all responses
-        std::string corsHeaders = "Access-Control-Allow-Origin: *\r\n"
-                                 "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
-                                 "Access-Control-Allow-Headers: X-Custom-Header, Content-Type\r\n";
-        
-        // Handle static files
-        if (path == "/" || path == "/index.html") {
-            return serveStaticFile("index.html");
-        } else if (path == "/style.css") {
-            return serveStaticFile("style.css");
-        } else if (path == "/script.js") {
-            return serveStaticFile("script.js");
-        }
-        
-        // API endpoints
-        if (path == "/api/locations") {
-            if (method == "GET") {
-                std::string json = system.locationsToJson();
-                std::ostringstream response;
-                response << "HTTP/1.1 200 OK\r\n"
-                         << corsHeaders
-                         << "Content-Type: application/json\r\n"
-                         << "Content-Length: " << json.length() << "\r\n"
-                         << "\r\n"
-                         << json;
-                return response.str();
-            } else if (method == "POST") {
-                try {
-                    auto json = system.parseJson(body);
-                    int id = std::stoi(json["id"]);
-                    std::string name = json["name"];
-                    double x = std::stod(json["x"]);
-                    double y = std::stod(json["y"]);
-                    
-                    system.addLocation(id, name, x, y);
-                    
-                    return "HTTP/1.1 201 Created\r\n"
-                           + corsHeaders +
-                           "Content-Type: application/json\r\n"
-                           "Content-Length: 2\r\n"
-                           "\r\n"
-                           "{}";
-                } catch (const std::exception& e) {
-                    std::string error = "{\"error\":\"" + std::string(e.what()) + "\"}";
-                    return "HTTP/1.1 400 Bad Request\r\n"
-                           + corsHeaders +
-                           "Content-Type: application/json\r\n"
-                           "Content-Length: " + std::to_string(error.length()) + "\r\n"
-                           "\r\n"
-                           + error;
-                }
+    std::ostringstream response;
+    response << "HTTP/1.1 200 OK\r\n"
+             << "Content-Type: " << contentType << "\r\n"
+             << "Content-Length: " << content.length() << "\r\n"
+             << "\r\n"
+             << content;
+             
+    return response.str();
+}
+
+// Routes one API or static-file request. main() hands this to the server;
+// tests call it directly.
+std::string handleApiRequest(DeliverySystem& system, const std::string& method, const std::string& path, const std::string& body) {
+    // Handle CORS preflight
+    if (method == "OPTIONS") {
+        return "HTTP/1.1 200 OK\r\n"
+               "Access-Control-Allow-Origin: *\r\n"
+               "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
+               "Access-Control-Allow-Headers: X-Custom-Header, Content-Type\r\n"
+               "Content-Length: 0\r\n"
+               "\r\n";
+    }
+    
+    // CORS headers for all responses
+    std::string corsHeaders = "Access-Control-Allow-Origin: *\r\n"
+                             "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
+                             "Access-Control-Allow-Headers: X-Custom-Header, Content-Type\r\n";
+    
+    // Handle static files
+    if (path == "/" || path == "/index.html") {
+        return serveStaticFile("index.html");
+    } else if (path == "/style.css") {
+        return serveStaticFile("style.css");
+    } else if (path == "/script.js") {
+        return serveStaticFile("script.js");
+    }
+    
+    // API endpoints
+    if (path == "/api/locations") {
+        if (method == "GET") {
+            JsonWriter json;
+            json.beginResponse("200 OK", corsHeaders);
+            system.writeLocations(json);
+            return json.finishResponse();
+        } else if (method == "POST") {
+            try {
+                int id;
+                std::string name;
+                double x, y;
+                JsonFields().required("id", id).required("name", name).required("x", x).required("y", y).parse(body);
+                
+                system.addLocation(id, name, x, y);
+                
+                return "HTTP/1.1 201 Created\r\n"
+                       + corsHeaders +
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: 2\r\n"
+                       "\r\n"
+                       "{}";
+            } catch (const std::exception& e) {
+                std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+                return "HTTP/1.1 400 Bad Request\r\n"
+                       + corsHeaders +
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: " + std::to_string(error.length()) + "\r\n"
+                       "\r\n"
+                       + error;
             }
-        } else if (path == "/api/orders") {
-            if (method == "GET") {
-                std::string json = system.ordersToJson();
-                std::ostringstream response;
-                response << "HTTP/1.1 200 OK\r\n"
-                         << corsHeaders
-                         << "Content-Type: application/json\r\n"
-                         << "Content-Length: " << json.length() << "\r\n"
-                         << "\r\n"
-                         << json;
-                return response.str();
-            } else if (method == "POST") {
-                try {
-                    auto json = system.parseJson(body);
-                    int restaurantId = std::stoi(json["restaurantId"]);
-                    int customerLocationId = std::stoi(json["customerLocationId"]);
+        }
+    } else if (path == "/api/orders") {
+        if (method == "GET") {
+            JsonWriter json;
+            json.beginResponse("200 OK", corsHeaders);
+            system.writeOrders(json);
+            return json.finishResponse();
+        } else if (method == "POST") {
+            try {
+                int restaurantId, customerLocationId;
+                JsonFields().required("restaurantId", restaurantId).required("customerLocationId", customerLocationId).parse(body);
+                
+                int orderId = system.placeOrder(restaurantId, customerLocationId);
+                JsonWriter json;
+                if (orderId >= 0 && system.queueForBatchDispatch(orderId)) {
+                    json.beginResponse("201 Created", corsHeaders);
+                    json.beginObject()
+                        .member("orderId", orderId)
+                        .member("message", "Queued for batch dispatch")
+                        .endObject();
+                    return json.finishResponse();
+                } else if (orderId >= 0 && system.queueForRegionalDispatch(orderId, restaurantId)) {
+                    json.beginResponse("201 Created", corsHeaders);
+                    json.beginObject()
+                        .member("orderId", orderId)
+                        .member("message", "Queued for regional dispatch")
+                        .endObject();
+                    return json.finishResponse();
+                } else if (orderId >= 0) {
+                    // Automatically assign a driver
+                    int driverId = system.assignDriverToOrder(orderId);
                     
-                    int orderId = system.placeOrder(restaurantId, customerLocationId);
-                    if (orderId >= 0) {
-                        // Automatically assign a driver
-                        int driverId = system.assignDriverToOrder(orderId);
-                        
-                        std::string response;
-                        if (driverId >= 0) {
-                            // Get driver details
-                            Driver driver;
-                            for (const auto& d : system.getAllDrivers()) {
-                                if (d.id == driverId) {
-                                    driver = d;
-                                    break;
-                                }
-                            }
-                            
-                            // Get the route
-                            auto route = system.getDriverRoute(driverId);
-                            
-                            // Create JSON string for route
-                            std::ostringstream routeJson;
-                            routeJson << "[";
-                            for (size_t i = 0; i < route.size(); ++i) {
-                                if (i > 0) routeJson << ",";
-                                routeJson << route[i];
+                    json.beginResponse("201 Created", corsHeaders);
+                    json.beginObject().member("orderId", orderId);
+                    if (driverId >= 0) {
+                        // Get driver details
+                        Driver driver;
+                        for (const auto& d : system.getAllDrivers()) {
+                            if (d.id == driverId) {
+                                driver = d;
+                                break;
                             }
-                            routeJson << "]";
-                            
-                            response = "{\"orderId\":" + std::to_string(orderId) + 
-                                    ",\"driverId\":" + std::to_string(driverId) + 
-                                    ",\"driverLocation\":" + std::to_string(driver.currentLocation) +
-                                    ",\"driverSpeed\":" + std::to_string(driver.speed) +
-                                    ",\"route\":" + routeJson.str() + "}";
-                        } else {
-                            response = "{\"orderId\":" + std::to_string(orderId) + 
-                                    ",\"message\":\"No driver available\"}";
                         }
                         
-                        return "HTTP/1.1 201 Created\r\n"
-                            + corsHeaders +
-                            "Content-Type: application/json\r\n"
-                            "Content-Length: " + std::to_string(response.length()) + "\r\n"
-                            "\r\n"
-                            + response;
-                    }else {
-                        return "HTTP/1.1 400 Bad Request\r\n"
-                               + corsHeaders +
-                               "Content-Type: application/json\r\n"
-                               "Content-Length: 30\r\n"
-                               "\r\n"
-                               "{\"error\":\"Failed to create order\"}";
+                        json.member("driverId", driverId)
+                            .member("driverLocation", driver.currentLocation)
+                            .member("driverSpeed", driver.speed)
+                            .key("route").array(system.getDriverRoute(driverId));
+                    } else {
+                        json.member("message", "No driver available");
                     }
-                } catch (const std::exception& e) {
-                    std::string error = "{\"error\":\"" + std::string(e.what()) + "\"}";
+                    json.endObject();
+                    return json.finishResponse();
+                } else {
                     return "HTTP/1.1 400 Bad Request\r\n"
                            + corsHeaders +
                            "Content-Type: application/json\r\n"
-                           "Content-Length: " + std::to_string(error.length()) + "\r\n"
+                           "Content-Length: 34\r\n"
                            "\r\n"
-                           + error;
+                           "{\"error\":\"Failed to create order\"}";
                 }
+            } catch (const std::exception& e) {
+                std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+                return "HTTP/1.1 400 Bad Request\r\n"
+                       + corsHeaders +
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: " + std::to_string(error.length()) + "\r\n"
+                       "\r\n"
+                       + error;
             }
-        } else if (path == "/api/drivers") {
-            if (method == "GET") {
-                std::string json = system.driversToJson();
-                std::ostringstream response;
-                response << "HTTP/1.1 200 OK\r\n"
-                         << corsHeaders
-                         << "Content-Type: application/json\r\n"
-                         << "Content-Length: " << json.length() << "\r\n"
-                         << "\r\n"
-                         << json;
-                return response.str();
-            } else if (method == "POST") {
-                try {
-                    auto json = system.parseJson(body);
-                    double speed = std::stod(json["speed"]);
-                    
-                    int driverId = system.addDriver(speed);
-                    if (driverId >= 0) {
-                        std::string response = "{\"driverId\":" + std::to_string(driverId) + "}";
-                        return "HTTP/1.1 201 Created\r\n"
-                               + corsHeaders +
-                               "Content-Type: application/json\r\n"
-                               "Content-Length: " + std::to_string(response.length()) + "\r\n"
-                               "\r\n"
-                               + response;
-                    } else {
-                        return "HTTP/1.1 400 Bad Request\r\n"
-                               + corsHeaders +
-                               "Content-Type: application/json\r\n"
-                               "Content-Length: 29\r\n"
-                               "\r\n"
-                               "{\"error\":\"Failed to add driver\"}";
-                    }
-                } catch (const std::exception& e) {
-                    std::string error = "{\"error\":\"" + std::string(e.what()) + "\"}";
+        }
+    } else if (path == "/api/drivers") {
+        if (method == "GET") {
+            JsonWriter json;
+            json.beginResponse("200 OK", corsHeaders);
+            system.writeDrivers(json);
+            return json.finishResponse();
+        } else if (method == "POST") {
+            try {
+                double speed;
+                JsonFields().required("speed", speed).parse(body);
+                
+                int driverId = system.addDriver(speed);
+                if (driverId >= 0) {
+                    std::string response = "{\"driverId\":" + std::to_string(driverId) + "}";
+                    return "HTTP/1.1 201 Created\r\n"
+                           + corsHeaders +
+                           "Content-Type: application/json\r\n"
+                           "Content-Length: " + std::to_string(response.length()) + "\r\n"
+                           "\r\n"
+                           + response;
+                } else {
                     return "HTTP/1.1 400 Bad Request\r\n"
                            + corsHeaders +
                            "Content-Type: application/json\r\n"
-                           "Content-Length: " + std::to_string(error.length()) + "\r\n"
+                           "Content-Length: 32\r\n"
                            "\r\n"
-                           + error;
-                }
-            }
-        } else if (path == "/api/route" && method == "POST") {
-            try {
-                auto json = system.parseJson(body);
-                int start = std::stoi(json["start"]);
-                int end = std::stoi(json["end"]);
-                
-                auto path = system.findShortestPath(start, end);
-                
-                std::ostringstream pathJson;
-                pathJson << "[";
-                for (size_t i = 0; i < path.size(); ++i) {
-                    if (i > 0) pathJson << ",";
-                    pathJson << path[i];
-                }
-                pathJson << "]";
-                
-                // Calculate total distance
-                double distance = 0;
-                if (path.size() > 1) {
-                    for (size_t i = 0; i < path.size() - 1; i++) {
-                        distance += system.calculateDistance(path[i], path[i+1]);
-                    }
+                           "{\"error\":\"Failed to add driver\"}";
                 }
-                
-                std::string response = "{\"path\":" + pathJson.str() + ",\"distance\":" + std::to_string(distance) + "}";
-                
-                return "HTTP/1.1 200 OK\r\n"
-                       + corsHeaders +
-                       "Content-Type: application/json\r\n"
-                       "Content-Length: " + std::to_string(response.length()) + "\r\n"
-                       "\r\n"
-                       + response;
             } catch (const std::exception& e) {
-                std::string error = "{\"error\":\"" + std::string(e.what()) + "\"}";
+                std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
                 return "HTTP/1.1 400 Bad Request\r\n"
                        + corsHeaders +
                        "Content-Type: application/json\r\n"
@@ -1516,42 +6383,84 @@ int main() {
                        "\r\n"
                        + error;
             }
-        }// Add these in the main function's server.start lambda
-
-else if (path == "/api/orders/complete" && method == "POST") {
-    try {
-        auto json = system.parseJson(body);
-        int orderId = std::stoi(json["orderId"]);
-        
-        bool success = system.completeOrder(orderId);
-        if (success) {
-            return "HTTP/1.1 200 OK\r\n"
+        }
+    } else if (path == "/api/route" && method == "POST") {
+        try {
+            int start, end;
+            std::string algorithmName;
+            JsonFields().required("start", start).required("end", end).optional("algorithm", algorithmName).parse(body);
+            RoutingAlgorithm algorithm = parseRoutingAlgorithm(algorithmName);
+            
+            auto route = system.findRoute(start, end, algorithm);
+            
+            // Calculate total distance
+            double distance = system.calculatePathDistance(route.path);
+            
+            JsonWriter json(128 + 8 * route.path.size());
+            json.beginResponse("200 OK", corsHeaders);
+            json.beginObject()
+                .key("path").array(route.path)
+                .member("distance", distance)
+                .member("algorithm", routingAlgorithmName(route.algorithm))
+                .member("settledNodes", route.settledNodes)
+                .endObject();
+            return json.finishResponse();
+        } catch (const std::exception& e) {
+            std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+            return "HTTP/1.1 400 Bad Request\r\n"
                    + corsHeaders +
                    "Content-Type: application/json\r\n"
-                   "Content-Length: 2\r\n"
+                   "Content-Length: " + std::to_string(error.length()) + "\r\n"
                    "\r\n"
-                   "{}";
-        } else {
+                   + error;
+        }
+    } else if (path == "/metrics" && method == "GET") {
+        std::string text = metrics().render();
+        std::ostringstream response;
+        response << "HTTP/1.1 200 OK\r\n"
+                 << "Content-Type: text/plain; version=0.0.4\r\n"
+                 << "Content-Length: " << text.length() << "\r\n"
+                 << "\r\n"
+                 << text;
+        return response.str();
+    } else if (path == "/api/trace" && method == "GET") {
+        std::string json = tracer().dumpJson();
+        std::ostringstream response;
+        response << "HTTP/1.1 200 OK\r\n"
+                 << corsHeaders
+                 << "Content-Type: application/json\r\n"
+                 << "Content-Length: " << json.length() << "\r\n"
+                 << "\r\n"
+                 << json;
+        return response.str();
+    } else if (path == "/api/trace" && method == "POST") {
+        try {
+            std::optional<double> rate;
+            bool clear = false;
+            JsonFields().optional("rate", rate).optional("clear", clear).parse(body);
+            if (rate) {
+                if (*rate < 0.0 || *rate > 1.0) throw std::invalid_argument("rate must be between 0 and 1");
+                tracer().setRate(*rate);
+            }
+            if (clear) {
+                tracer().clear();
+            }
+            
+            JsonWriter json;
+            json.beginResponse("200 OK", corsHeaders);
+            json.beginObject().member("rate", tracer().rate()).endObject();
+            return json.finishResponse();
+        } catch (const std::exception& e) {
+            std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
             return "HTTP/1.1 400 Bad Request\r\n"
                    + corsHeaders +
                    "Content-Type: application/json\r\n"
-                   "Content-Length: 35\r\n"
+                   "Content-Length: " + std::to_string(error.length()) + "\r\n"
                    "\r\n"
-                   "{\"error\":\"Failed to complete order\"}";
+                   + error;
         }
-    } catch (const std::exception& e) {
-        std::string error = "{\"error\":\"" + std::string(e.what()) + "\"}";
-        return "HTTP/1.1 400 Bad Request\r\n"
-               + corsHeaders +
-               "Content-Type: application/json\r\n"
-               "Content-Length: " + std::to_string(error.length()) + "\r\n"
-               "\r\n"
-               + error;
-    }
-}
-else if (path == "/api/edges") {
-    if (method == "GET") {
-        std::string json = system.edgesToJson();
+    } else if (path == "/api/stats/queries" && method == "GET") {
+        std::string json = system.queryProfileJson();
         std::ostringstream response;
         response << "HTTP/1.1 200 OK\r\n"
                  << corsHeaders
@@ -1560,28 +6469,180 @@ else if (path == "/api/edges") {
                  << "\r\n"
                  << json;
         return response.str();
-    } else if (method == "POST") {
+    } else if (path == "/api/stats/queries" && method == "POST") {
         try {
-            auto json = system.parseJson(body);
-            int source = std::stoi(json["source"]);
-            int destination = std::stoi(json["destination"]);
-            double distance = std::stod(json["distance"]);
-            double trafficFactor = 1.0; // Default traffic factor
+            std::optional<double> slowMs;
+            std::optional<bool> enabled;
+            bool clear = false;
+            JsonFields().optional("slowQueryMs", slowMs).optional("enabled", enabled).optional("clear", clear).parse(body);
+            if (slowMs) {
+                system.setSlowQueryThreshold(std::chrono::microseconds(static_cast<long long>(*slowMs * 1000)));
+            }
+            if (enabled) {
+                system.setQueryProfiling(*enabled);
+            }
+            if (clear) {
+                system.clearQueryProfile();
+            }
             
-            if (json.find("trafficFactor") != json.end()) {
-                trafficFactor = std::stod(json["trafficFactor"]);
+            std::string payload = system.queryProfileJson();
+            std::ostringstream response;
+            response << "HTTP/1.1 200 OK\r\n"
+                     << corsHeaders
+                     << "Content-Type: application/json\r\n"
+                     << "Content-Length: " << payload.length() << "\r\n"
+                     << "\r\n"
+                     << payload;
+            return response.str();
+        } catch (const std::exception& e) {
+            std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+            return "HTTP/1.1 400 Bad Request\r\n"
+                   + corsHeaders +
+                   "Content-Type: application/json\r\n"
+                   "Content-Length: " + std::to_string(error.length()) + "\r\n"
+                   "\r\n"
+                   + error;
+        }
+    } else if (path == "/api/stats/statements" && method == "GET") {
+        std::string json = system.statementCacheStatsJson();
+        std::ostringstream response;
+        response << "HTTP/1.1 200 OK\r\n"
+                 << corsHeaders
+                 << "Content-Type: application/json\r\n"
+                 << "Content-Length: " << json.length() << "\r\n"
+                 << "\r\n"
+                 << json;
+        return response.str();
+    } else if (path == "/api/dispatch/regions" && method == "GET") {
+        std::string json = system.regionalDispatchJson();
+        std::ostringstream response;
+        response << "HTTP/1.1 200 OK\r\n"
+                 << corsHeaders
+                 << "Content-Type: application/json\r\n"
+                 << "Content-Length: " << json.length() << "\r\n"
+                 << "\r\n"
+                 << json;
+        return response.str();
+    } else if (path == "/api/dispatch" && (method == "GET" || method == "POST")) {
+        try {
+            if (method == "POST") {
+                auto settings = system.batchDispatchSettings();
+                std::optional<std::string> mode;
+                JsonFields().optional("mode", mode)
+                            .optional("windowMs", settings.windowMs)
+                            .optional("maxOrders", settings.maxOrders)
+                            .parse(body);
+                if (mode) {
+                    if (*mode != "batch" && *mode != "greedy") {
+                        throw std::invalid_argument("Unknown dispatch mode: " + *mode);
+                    }
+                    settings.enabled = *mode == "batch";
+                }
+                if (settings.windowMs < 0 || settings.maxOrders == 0) {
+                    throw std::invalid_argument("windowMs must be >= 0 and maxOrders > 0");
+                }
+                system.configureBatchDispatch(settings);
             }
             
-            system.addEdge(source, destination, distance, trafficFactor);
+            std::string json = system.batchDispatchJson();
+            std::ostringstream response;
+            response << "HTTP/1.1 200 OK\r\n"
+                     << corsHeaders
+                     << "Content-Type: application/json\r\n"
+                     << "Content-Length: " << json.length() << "\r\n"
+                     << "\r\n"
+                     << json;
+            return response.str();
+        } catch (const std::exception& e) {
+            std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+            return "HTTP/1.1 400 Bad Request\r\n"
+                   + corsHeaders +
+                   "Content-Type: application/json\r\n"
+                   "Content-Length: " + std::to_string(error.length()) + "\r\n"
+                   "\r\n"
+                   + error;
+        }
+    } else if (path == "/api/drivers/limits" && method == "POST") {
+        try {
+            int driverId;
+            std::optional<int> maxOrders;
+            std::optional<double> detourLimit;
+            JsonFields().required("driverId", driverId)
+                        .optional("maxOrders", maxOrders)
+                        .optional("detourLimit", detourLimit)
+                        .parse(body);
+            Driver driver;
+            if (!system.getDriverById(driverId, driver)) {
+                throw std::invalid_argument("Unknown driver");
+            }
+            if (maxOrders) {
+                if (*maxOrders < 0) throw std::invalid_argument("maxOrders must be >= 0");
+                driver.maxOrders = static_cast<size_t>(*maxOrders);
+            }
+            if (detourLimit) {
+                driver.detourLimit = *detourLimit;
+                if (driver.detourLimit < 1.0) throw std::invalid_argument("detourLimit must be >= 1");
+            }
+            if (!system.setDriverLimits(driverId, driver.maxOrders, driver.detourLimit)) {
+                throw std::runtime_error("Failed to update driver limits");
+            }
             
-            return "HTTP/1.1 201 Created\r\n"
+            JsonWriter json;
+            json.beginResponse("200 OK", corsHeaders);
+            json.beginObject()
+                .member("driverId", driverId)
+                .member("maxOrders", driver.maxOrders)
+                .member("detourLimit", driver.detourLimit)
+                .endObject();
+            return json.finishResponse();
+        } catch (const std::exception& e) {
+            std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+            return "HTTP/1.1 400 Bad Request\r\n"
                    + corsHeaders +
                    "Content-Type: application/json\r\n"
-                   "Content-Length: 2\r\n"
+                   "Content-Length: " + std::to_string(error.length()) + "\r\n"
                    "\r\n"
-                   "{}";
+                   + error;
+        }
+    } else if (path == "/api/dispatch/flush" && method == "POST") {
+        auto assignments = system.flushBatchDispatch();
+        JsonWriter json;
+        json.beginResponse("200 OK", corsHeaders);
+        json.beginObject().key("assignments").beginArray();
+        for (const auto& assignment : assignments) {
+            json.beginObject().member("orderId", assignment.first).key("driverId");
+            if (assignment.second >= 0) {
+                json.value(assignment.second);
+            } else {
+                json.null();
+            }
+            json.endObject();
+        }
+        json.endArray().endObject();
+        return json.finishResponse();
+    } else if (path == "/api/matrix" && method == "POST") {
+        try {
+            std::vector<int> sources, targets;
+            JsonFields().required("sources", sources).required("targets", targets).parse(body);
+            if (sources.size() * targets.size() > 1000000) {
+                throw std::invalid_argument("Matrix too large (limit is 1000000 cells)");
+            }
+            
+            auto matrix = system.distanceMatrix(sources, targets);
+            
+            JsonWriter json(256 + 20 * sources.size() * targets.size());
+            json.beginResponse("200 OK", corsHeaders);
+            json.beginObject()
+                .key("sources").array(sources)
+                .key("targets").array(targets)
+                .key("costs").beginArray();
+            for (const auto& row : matrix) {
+                json.array(row); // Unreachable cells are infinite, written as null
+            }
+            json.endArray().endObject();
+            return json.finishResponse();
         } catch (const std::exception& e) {
-            std::string error = "{\"error\":\"" + std::string(e.what()) + "\"}";
+            std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
             return "HTTP/1.1 400 Bad Request\r\n"
                    + corsHeaders +
                    "Content-Type: application/json\r\n"
@@ -1589,83 +6650,66 @@ else if (path == "/api/edges") {
                    "\r\n"
                    + error;
         }
-    }
-}
-else if (path.find("/api/drivers/route") == 0 && method == "GET") {
-    // Extract driver ID from query string
-    size_t idPos = path.find("?id=");
-    if (idPos == std::string::npos) {
-        return "HTTP/1.1 400 Bad Request\r\n"
-               + corsHeaders +
-               "Content-Type: application/json\r\n"
-               "Content-Length: 37\r\n"
-               "\r\n"
-               "{\"error\":\"Missing driver ID parameter\"}";
-    }
-    
+    }// Add these in the main function's server.start lambda
+
+else if (path == "/api/orders/complete" && method == "POST") {
     try {
-        int driverId = std::stoi(path.substr(idPos + 4));
-        std::cout << "Fetching route for driver #" << driverId << std::endl;
-        
-        auto route = system.getDriverRoute(driverId);
-        std::cout << "Route size: " << route.size() << std::endl;
-        
-        std::ostringstream routeJson;
-        routeJson << "[";
-        for (size_t i = 0; i < route.size(); ++i) {
-            if (i > 0) routeJson << ",";
-            routeJson << route[i];
-        }
-        routeJson << "]";
-        
-        std::string response = "{\"route\":" + routeJson.str() + "}";
-        std::cout << "Response: " << response << std::endl;
-        
+    int orderId;
+    JsonFields().required("orderId", orderId).parse(body);
+    
+    bool success = system.completeOrder(orderId);
+    if (success) {
         return "HTTP/1.1 200 OK\r\n"
                + corsHeaders +
                "Content-Type: application/json\r\n"
-               "Content-Length: " + std::to_string(response.length()) + "\r\n"
+               "Content-Length: 2\r\n"
                "\r\n"
-               + response;
-    } catch (const std::exception& e) {
-        std::string error = "{\"error\":\"" + std::string(e.what()) + "\"}";
+               "{}";
+    } else {
         return "HTTP/1.1 400 Bad Request\r\n"
                + corsHeaders +
                "Content-Type: application/json\r\n"
-               "Content-Length: " + std::to_string(error.length()) + "\r\n"
+               "Content-Length: 36\r\n"
                "\r\n"
-               + error;
+               "{\"error\":\"Failed to complete order\"}";
+    }
+    } catch (const std::exception& e) {
+    std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+    return "HTTP/1.1 400 Bad Request\r\n"
+           + corsHeaders +
+           "Content-Type: application/json\r\n"
+           "Content-Length: " + std::to_string(error.length()) + "\r\n"
+           "\r\n"
+           + error;
     }
 }
-
-else if (path == "/api/orders/assign" && method == "POST") {
+else if (path == "/api/edges") {
+    if (method == "GET") {
+    JsonWriter json;
+    json.beginResponse("200 OK", corsHeaders);
+    system.writeEdges(json);
+    return json.finishResponse();
+    } else if (method == "POST") {
     try {
-        auto json = system.parseJson(body);
-        int orderId = std::stoi(json["orderId"]);
+        int source, destination;
+        double distance;
+        double trafficFactor = 1.0; // Default traffic factor
+        JsonFields().required("source", source)
+                    .required("destination", destination)
+                    .required("distance", distance)
+                    .optional("trafficFactor", trafficFactor)
+                    .parse(body);
         
-        // Update order status back to "Preparing" first
-        system.updateOrderStatus(orderId, "Preparing");
-        
-        // Try to assign a driver
-        int driverId = system.assignDriverToOrder(orderId);
-        
-        std::string response;
-        if (driverId >= 0) {
-            response = "{\"success\":true,\"orderId\":" + std::to_string(orderId) + 
-                      ",\"driverId\":" + std::to_string(driverId) + "}";
-        } else {
-            response = "{\"success\":false,\"orderId\":" + std::to_string(orderId) + 
-                      ",\"message\":\"No suitable driver available\"}";
-        }
+        system.addEdge(source, destination, distance, trafficFactor);
         
-        return "HTTP/1.1 200 OK\r\n"
+        return "HTTP/1.1 201 Created\r\n"
                + corsHeaders +
                "Content-Type: application/json\r\n"
-               "Content-Length: " + std::to_string(response.length()) + "\r\n"
+               "Content-Length: 2\r\n"
                "\r\n"
-               + response;
+               "{}";
     } catch (const std::exception& e) {
-        std::string error = "{\"error\":\"" + std::string(e.what()) + "\"}";
+        std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
         return "HTTP/1.1 400 Bad Request\r\n"
                + corsHeaders +
                "Content-Type: application/json\r\n"
@@ -1673,16 +6717,177 @@ else if (path == "/api/orders/assign" && method == "POST") {
                "\r\n"
                + error;
     }
+    }
 }
-        
-        // Default 404 response
-        return "HTTP/1.1 404 Not Found\r\n"
-               + corsHeaders +
-               "Content-Type: text/plain\r\n"
-               "Content-Length: 9\r\n"
-               "\r\n"
-               "Not Found";
+else if (path.find("/api/drivers/route") == 0 && method == "GET") {
+    // Extract driver ID from query string
+    size_t idPos = path.find("?id=");
+    if (idPos == std::string::npos) {
+    return "HTTP/1.1 400 Bad Request\r\n"
+           + corsHeaders +
+           "Content-Type: application/json\r\n"
+           "Content-Length: 39\r\n"
+           "\r\n"
+           "{\"error\":\"Missing driver ID parameter\"}";
+    }
+    
+    try {
+    int driverId = std::stoi(path.substr(idPos + 4));
+    auto route = system.getDriverRoute(driverId);
+    
+    JsonWriter json;
+    json.beginResponse("200 OK", corsHeaders);
+    json.beginObject().key("route").array(route).endObject();
+    return json.finishResponse();
+    } catch (const std::exception& e) {
+    std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+    return "HTTP/1.1 400 Bad Request\r\n"
+           + corsHeaders +
+           "Content-Type: application/json\r\n"
+           "Content-Length: " + std::to_string(error.length()) + "\r\n"
+           "\r\n"
+           + error;
+    }
+}
+
+else if (path == "/api/orders/assign" && method == "POST") {
+    try {
+    int orderId;
+    JsonFields().required("orderId", orderId).parse(body);
+    
+    // Update order status back to "Preparing" first
+    system.updateOrderStatus(orderId, "Preparing");
+    
+    // Try to assign a driver
+    int driverId = system.assignDriverToOrder(orderId);
+    
+    std::string response;
+    if (driverId >= 0) {
+        response = "{\"success\":true,\"orderId\":" + std::to_string(orderId) + 
+                  ",\"driverId\":" + std::to_string(driverId) + "}";
+    } else {
+        response = "{\"success\":false,\"orderId\":" + std::to_string(orderId) + 
+                  ",\"message\":\"No suitable driver available\"}";
+    }
+    
+    return "HTTP/1.1 200 OK\r\n"
+           + corsHeaders +
+           "Content-Type: application/json\r\n"
+           "Content-Length: " + std::to_string(response.length()) + "\r\n"
+           "\r\n"
+           + response;
+    } catch (const std::exception& e) {
+    std::string error = "{\"error\":\"" + escape_json(e.what()) + "\"}";
+    return "HTTP/1.1 400 Bad Request\r\n"
+           + corsHeaders +
+           "Content-Type: application/json\r\n"
+           "Content-Length: " + std::to_string(error.length()) + "\r\n"
+           "\r\n"
+           + error;
+    }
+}
+    
+    // Default 404 response
+    return "HTTP/1.1 404 Not Found\r\n"
+           + corsHeaders +
+           "Content-Type: text/plain\r\n"
+           "Content-Length: 9\r\n"
+           "\r\n"
+           "Not Found";
+}
+
+// The simulator includes this file for DeliverySystem and supplies its own main()
+#ifndef DELIVERY_SYSTEM_NO_MAIN
+int main(int argc, char* argv[]) {
+    // Command-line options: --port N, --workers N (0 = one per hardware thread),
+    // --max-body BYTES, --keepalive-timeout SECONDS, --ch (preprocess a contraction hierarchy),
+    // --route-budget-us MICROSECONDS (local search time per route change),
+    // --scoring default|eta|load (driver scoring policy for dispatch),
+    // --regions ROWSxCOLS (regional dispatch threads over a grid of the city)
+    int port = 8080;
+    size_t workerThreads = 0;
+    size_t maxBodySize = 8 * 1024 * 1024;
+    int keepAliveTimeout = 60;
+    bool prepareHierarchy = false;
+    long routeBudgetUs = 2000;
+    bool profileQueries = false;
+    double slowQueryMs = 100;
+    ScoringPolicy scoringPolicy = ScoringPolicy::Default;
+    int regionRows = 0, regionCols = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            port = std::stoi(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workerThreads = std::stoul(argv[++i]);
+        } else if (arg == "--max-body" && i + 1 < argc) {
+            maxBodySize = std::stoull(argv[++i]);
+        } else if (arg == "--keepalive-timeout" && i + 1 < argc) {
+            keepAliveTimeout = std::stoi(argv[++i]);
+        } else if (arg == "--ch") {
+            prepareHierarchy = true;
+        } else if (arg == "--route-budget-us" && i + 1 < argc) {
+            routeBudgetUs = std::stol(argv[++i]);
+        } else if (arg == "--regions" && i + 1 < argc) {
+            std::string grid = argv[++i];
+            size_t split = grid.find('x');
+            if (split == std::string::npos) {
+                std::cerr << "--regions expects ROWSxCOLS, e.g. 2x2" << std::endl;
+                return 1;
+            }
+            regionRows = std::stoi(grid.substr(0, split));
+            regionCols = std::stoi(grid.substr(split + 1));
+        } else if (arg == "--profile-sql") {
+            profileQueries = true;
+        } else if (arg == "--slow-query-ms" && i + 1 < argc) {
+            slowQueryMs = std::stod(argv[++i]);
+            profileQueries = true;
+        } else if (arg == "--trace-rate" && i + 1 < argc) {
+            double rate = std::stod(argv[++i]);
+            if (rate < 0.0 || rate > 1.0) {
+                std::cerr << "--trace-rate expects a probability between 0 and 1" << std::endl;
+                return 1;
+            }
+            tracer().setRate(rate);
+        } else if (arg == "--scoring" && i + 1 < argc) {
+            try {
+                scoringPolicy = parseScoringPolicy(argv[++i]);
+            } catch (const std::invalid_argument& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--port N] [--workers N] [--max-body BYTES] [--keepalive-timeout SECONDS] [--ch] [--route-budget-us MICROSECONDS] [--scoring default|eta|load] [--regions ROWSxCOLS] [--trace-rate PROBABILITY] [--profile-sql] [--slow-query-ms MILLISECONDS]" << std::endl;
+            return 1;
+        }
+    }
+
+    DeliverySystem system;
+    system.setRouteOptimizationBudget(std::chrono::microseconds(routeBudgetUs));
+    system.setScoringPolicy(scoringPolicy);
+    system.setSlowQueryThreshold(std::chrono::microseconds(static_cast<long long>(slowQueryMs * 1000)));
+    system.setQueryProfiling(profileQueries);
+    if (regionRows > 0 && regionCols > 0) {
+        system.enableRegionalDispatch(regionRows, regionCols);
+    }
+    if (prepareHierarchy) {
+        auto start = std::chrono::steady_clock::now();
+        auto hierarchy = system.currentHierarchy();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        std::cout << "Contraction hierarchy ready: " << hierarchy->nodeCount() << " nodes, "
+                  << hierarchy->arcCount() << " arcs in " << elapsed.count() << " ms" << std::endl;
+    }
+    
+    SimpleHttpServer server(port, workerThreads);
+    server.setEventStream("/api/events", system.changeFeed());
+    server.setMaxBodySize(maxBodySize);
+    server.setKeepAliveTimeout(keepAliveTimeout);
+    
+    server.start([&system](const std::string& method, const std::string& path, const std::string& body) -> std::string {
+        return handleApiRequest(system, method, path, body);
     });
     
     return 0;
-}
\ No newline at end of file
+}
+#endif // DELIVERY_SYSTEM_NO_MAIN
@@ -7,6 +7,7 @@ class DeliveryUI {
         this.updateEdges = async function() {
             try {
                 const edges = await this.fetchJson(`${API_BASE}/edges`);
+                this.edges = edges;
                 this.renderEdges(edges);
             } catch (error) {
                 console.error("Failed to load edges:", error);
@@ -16,24 +17,18 @@ class DeliveryUI {
         this.renderEdges = function(edges) {
             const edgesList = document.getElementById('edges-list');
             
-            this.fetchJson(`${API_BASE}/locations`)
-                .then(locations => {
-                    const locationMap = {};
-                    locations.forEach(loc => {
-                        locationMap[loc.id] = loc.name;
-                    });
-                    
-                    edgesList.innerHTML = edges.length ? edges.map(edge => `
-                        <div class="item">
-                            <strong>Road:</strong> ${locationMap[edge.source] || edge.source} → ${locationMap[edge.destination] || edge.destination}<br>
-                            Distance: ${edge.distance.toFixed(2)} units<br>
-                            Traffic: ${edge.trafficFactor.toFixed(2)}
-                        </div>
-                    `).join('') : '<p>No roads added yet</p>';
-                })
-                .catch(err => {
-                    console.error('Error fetching locations for edge rendering:', err);
-                });
+            const locationMap = {};
+            (this.locations || []).forEach(loc => {
+                locationMap[loc.id] = loc.name;
+            });
+            
+            edgesList.innerHTML = edges.length ? edges.map(edge => `
+                <div class="item">
+                    <strong>Road:</strong> ${locationMap[edge.source] || edge.source} → ${locationMap[edge.destination] || edge.destination}<br>
+                    Distance: ${edge.distance.toFixed(2)} units<br>
+                    Traffic: ${edge.trafficFactor.toFixed(2)}
+                </div>
+            `).join('') : '<p>No roads added yet</p>';
         }
         
         this.addEdge = async function() {
@@ -50,12 +45,14 @@ class DeliveryUI {
                     body: JSON.stringify({ source, destination, distance, trafficFactor })
                 });
                 alert('Road added successfully!');
-                this.updateEdges();
+                this.refresh(this.updateEdges);
                 document.getElementById('add-edge-form').reset();
             } catch (error) {
                 alert(`Error: ${error.message}`);
             }
         }
+
+        this.subscribeToChanges();
     }
 
     initEventListeners() {
@@ -96,12 +93,99 @@ class DeliveryUI {
 
     async loadInitialData() {
         await this.updateLocations();
-    await this.updateEdges();
-    await this.updateOrders();
-    await this.updateDrivers();
+        await this.updateEdges();
+        await this.updateDrivers();
+        await this.updateOrders();
     }
 
 
+    // Applies server-pushed deltas from /api/events so the lists stay current
+    // without refetching. Each event carries a partial object merged by id; a
+    // "reset" means we fell too far behind and must reload everything.
+    subscribeToChanges() {
+        if (typeof EventSource === 'undefined') return;
+        this.locations = this.locations || [];
+        this.orders = this.orders || [];
+        this.drivers = this.drivers || [];
+        this.edges = this.edges || [];
+
+        const upsert = (list, patch, matches, isComplete) => {
+            const existing = list.find(matches);
+            if (existing) {
+                Object.assign(existing, patch);
+            } else if (isComplete) {
+                list.push(patch);
+            }
+        };
+
+        const events = new EventSource(`${API_BASE}/events`);
+        events.addEventListener('open', () => { this.liveUpdates = true; });
+        events.addEventListener('error', () => { this.liveUpdates = false; });
+        events.addEventListener('location', e => {
+            const loc = JSON.parse(e.data);
+            upsert(this.locations, loc, l => l.id === loc.id, true);
+            this.scheduleRender('locations');
+        });
+        events.addEventListener('edge', e => {
+            const edge = JSON.parse(e.data);
+            upsert(this.edges, edge,
+                   x => x.source === edge.source && x.destination === edge.destination,
+                   'distance' in edge);
+            this.scheduleRender('edges');
+        });
+        events.addEventListener('driver', e => {
+            const driver = JSON.parse(e.data);
+            upsert(this.drivers, driver, d => d.id === driver.id, 'speed' in driver);
+            this.scheduleRender('drivers');
+        });
+        events.addEventListener('order', e => {
+            const order = JSON.parse(e.data);
+            upsert(this.orders, order, o => o.id === order.id, 'restaurantId' in order);
+            if ('assignedDriverId' in order) {
+                this.drivers.forEach(d => {
+                    d.assignedOrders = d.assignedOrders.filter(id => id !== order.id);
+                    if (d.id === order.assignedDriverId) d.assignedOrders.push(order.id);
+                });
+                this.scheduleRender('drivers');
+            }
+            this.scheduleRender('orders');
+        });
+        events.addEventListener('order.removed', e => {
+            const { id } = JSON.parse(e.data);
+            this.orders = this.orders.filter(o => o.id !== id);
+            this.drivers.forEach(d => {
+                d.assignedOrders = d.assignedOrders.filter(orderId => orderId !== id);
+            });
+            this.scheduleRender('orders');
+            this.scheduleRender('drivers');
+        });
+        events.addEventListener('reset', () => this.loadInitialData());
+    }
+
+    // Refetch the lists an action changed, unless the change feed is connected
+    // and will push the changes itself.
+    refresh(...updates) {
+        if (this.liveUpdates) return;
+        updates.forEach(update => update.call(this));
+    }
+
+    // Coalesces bursts of change events into one re-render per list.
+    scheduleRender(list) {
+        this.pendingRenders = this.pendingRenders || new Set();
+        this.pendingRenders.add(list);
+        if (this.renderTimer) return;
+        this.renderTimer = setTimeout(() => {
+            this.renderTimer = null;
+            const lists = this.pendingRenders;
+            this.pendingRenders = new Set();
+            if (lists.has('locations')) this.renderLocations(this.locations);
+            if (lists.has('edges')) this.renderEdges(this.edges);
+            // Orders show their driver's location and speed
+            if (lists.has('orders') || lists.has('drivers')) this.renderOrders(this.orders);
+            if (lists.has('drivers')) this.renderDrivers(this.drivers);
+        }, 100);
+    }
+
     async fetchJson(url, options = {}) {
         try {
             const response = await fetch(url, options);
@@ -129,7 +213,7 @@ class DeliveryUI {
                 body: JSON.stringify({ id, name, x, y })
             });
             alert('Location added successfully!');
-            this.updateLocations();
+            this.refresh(this.updateLocations);
             document.getElementById('add-location-form').reset();
         } catch (error) {
             alert(`Error: ${error.message}`);
@@ -143,23 +227,20 @@ class DeliveryUI {
         // Only calculate if both source and destination are selected
         if (sourceId && destId) {
             // Find the location objects
-            this.fetchJson(`${API_BASE}/locations`)
-                .then(locations => {
-                    const source = locations.find(loc => loc.id == sourceId);
-                    const dest = locations.find(loc => loc.id == destId);
-                    
-                    if (source && dest) {
-                        // Calculate the distance
-                        const distance = this.calculateDistance(
-                            source.x, source.y, 
-                            dest.x, dest.y
-                        );
-                        
-                        // Round to 1 decimal place and set the value
-                        document.getElementById('edge-distance').value = distance.toFixed(1);
-                    }
-                })
-                .catch(error => console.error('Error calculating distance:', error));
+            const locations = this.locations || [];
+            const source = locations.find(loc => loc.id == sourceId);
+            const dest = locations.find(loc => loc.id == destId);
+            
+            if (source && dest) {
+                // Calculate the distance
+                const distance = this.calculateDistance(
+                    source.x, source.y, 
+                    dest.x, dest.y
+                );
+                
+                // Round to 1 decimal place and set the value
+                document.getElementById('edge-distance').value = distance.toFixed(1);
+            }
         }
     }
 
@@ -191,8 +272,7 @@ class DeliveryUI {
             }
             
             alert(message);
-            this.updateOrders();
-            this.updateDrivers();
+            this.refresh(this.updateOrders, this.updateDrivers);
             document.getElementById('place-order-form').reset();
         } catch (error) {
             alert(`Error: ${error.message}`);
@@ -209,7 +289,7 @@ class DeliveryUI {
                 body: JSON.stringify({ speed })
             });
             alert(`Driver #${response.driverId} added successfully!`);
-            this.updateDrivers();
+            this.refresh(this.updateDrivers);
             document.getElementById('add-driver-form').reset();
         } catch (error) {
             alert(`Error: ${error.message}`);
@@ -247,6 +327,7 @@ class DeliveryUI {
     async updateLocations() {
         try {
             const locations = await this.fetchJson(`${API_BASE}/locations`);
+            this.locations = locations;
             this.renderLocations(locations);
         } catch (error) {
             console.error("Failed to load locations:", error);
@@ -256,6 +337,7 @@ class DeliveryUI {
     async updateOrders() {
         try {
             const orders = await this.fetchJson(`${API_BASE}/orders`);
+            this.orders = orders;
             this.renderOrders(orders);
         } catch (error) {
             console.error("Failed to load orders:", error);
@@ -265,7 +347,9 @@ class DeliveryUI {
     async updateDrivers() {
         try {
             const drivers = await this.fetchJson(`${API_BASE}/drivers`);
+            this.drivers = drivers;
             this.renderDrivers(drivers);
+            if (this.orders) this.renderOrders(this.orders);
         } catch (error) {
             console.error("Failed to load drivers:", error);
         }
@@ -306,80 +390,74 @@ class DeliveryUI {
     renderOrders(orders) {
         const ordersList = document.getElementById('orders-list');
         
-        // Get drivers for lookup
-        this.fetchJson(`${API_BASE}/drivers`)
-            .then(drivers => {
-                const driversMap = {};
-                drivers.forEach(driver => {
-                    driversMap[driver.id] = driver;
-                });
+        // Drivers for lookup
+        const driversMap = {};
+        (this.drivers || []).forEach(driver => {
+            driversMap[driver.id] = driver;
+        });
+        
+        ordersList.innerHTML = orders.length ? orders.map(order => {
+            let driverInfo = '';
+            let actionButtons = '';
+            
+            // Show driver info if assigned
+            if (order.assignedDriverId && driversMap[order.assignedDriverId]) {
+                const driver = driversMap[order.assignedDriverId];
+                driverInfo = `
+                    <div class="driver-info">
+                        <span class="label">Assigned to:</span> Driver #${driver.id} 
+                        (at location ${driver.currentLocation}, speed: ${driver.speed})
+                    </div>
+                `;
                 
-                ordersList.innerHTML = orders.length ? orders.map(order => {
-                    let driverInfo = '';
-                    let actionButtons = '';
-                    
-                    // Show driver info if assigned
-                    if (order.assignedDriverId && driversMap[order.assignedDriverId]) {
-                        const driver = driversMap[order.assignedDriverId];
-                        driverInfo = `
-                            <div class="driver-info">
-                                <span class="label">Assigned to:</span> Driver #${driver.id} 
-                                (at location ${driver.currentLocation}, speed: ${driver.speed})
-                            </div>
-                        `;
-                        
-                        // Show complete and route buttons for assigned orders
-                        if (order.status !== 'Delivered') {
-                            actionButtons = `
-                                <button class="complete-btn" data-id="${order.id}">Mark Delivered</button>
-                                <button class="show-route-btn" data-driver="${order.assignedDriverId}">Show Route</button>
-                            `;
-                        }
-                    } else if (order.status === 'Pending') {
-                        // Show "Try Again" button for pending orders
-                        actionButtons = `
-                            <button class="try-again-btn" data-id="${order.id}">Try Again</button>
-                        `;
-                    }
-                    
-                    let statusClass = order.status.toLowerCase().replace(/ /g, '-');
-                    
-                    return `
-                        <div class="item">
-                            <strong>Order #${order.id}</strong><br>
-                            Restaurant: ${order.restaurantId}, 
-                            Customer: ${order.customerLocationId}<br>
-                            Status: <span class="status-${statusClass}">${order.status}</span>
-                            ${driverInfo}
-                            ${actionButtons}
-                        </div>
+                // Show complete and route buttons for assigned orders
+                if (order.status !== 'Delivered') {
+                    actionButtons = `
+                        <button class="complete-btn" data-id="${order.id}">Mark Delivered</button>
+                        <button class="show-route-btn" data-driver="${order.assignedDriverId}">Show Route</button>
                     `;
-                }).join('') : '<p>No orders placed yet</p>';
-                
-                // Add event listeners to buttons
-                document.querySelectorAll('.complete-btn').forEach(btn => {
-                    btn.addEventListener('click', () => {
-                        this.completeOrder(parseInt(btn.getAttribute('data-id')));
-                    });
-                });
-                
-                document.querySelectorAll('.show-route-btn').forEach(btn => {
-                    btn.addEventListener('click', async () => {
-                        const driverId = parseInt(btn.getAttribute('data-driver'));
-                        await this.showDriverRoute(driverId);
-                    });
-                });
-                
-                document.querySelectorAll('.try-again-btn').forEach(btn => {
-                    btn.addEventListener('click', async () => {
-                        const orderId = parseInt(btn.getAttribute('data-id'));
-                        await this.tryAssignDriverAgain(orderId);
-                    });
-                });
-            })
-            .catch(err => {
-                console.error('Error fetching drivers:', err);
+                }
+            } else if (order.status === 'Pending') {
+                // Show "Try Again" button for pending orders
+                actionButtons = `
+                    <button class="try-again-btn" data-id="${order.id}">Try Again</button>
+                `;
+            }
+            
+            let statusClass = order.status.toLowerCase().replace(/ /g, '-');
+            
+            return `
+                <div class="item">
+                    <strong>Order #${order.id}</strong><br>
+                    Restaurant: ${order.restaurantId}, 
+                    Customer: ${order.customerLocationId}<br>
+                    Status: <span class="status-${statusClass}">${order.status}</span>
+                    ${driverInfo}
+                    ${actionButtons}
+                </div>
+            `;
+        }).join('') : '<p>No orders placed yet</p>';
+        
+        // Add event listeners to buttons
+        document.querySelectorAll('.complete-btn').forEach(btn => {
+            btn.addEventListener('click', () => {
+                this.completeOrder(parseInt(btn.getAttribute('data-id')));
+            });
+        });
+        
+        document.querySelectorAll('.show-route-btn').forEach(btn => {
+            btn.addEventListener('click', async () => {
+                const driverId = parseInt(btn.getAttribute('data-driver'));
+                await this.showDriverRoute(driverId);
+            });
+        });
+        
+        document.querySelectorAll('.try-again-btn').forEach(btn => {
+            btn.addEventListener('click', async () => {
+                const orderId = parseInt(btn.getAttribute('data-id'));
+                await this.tryAssignDriverAgain(orderId);
             });
+        });
     }
     
 
@@ -433,8 +511,7 @@ class DeliveryUI {
                 body: JSON.stringify({ orderId })
             });
             alert(`Order #${orderId} marked as delivered!`);
-            this.updateOrders();
-            this.updateDrivers();
+            this.refresh(this.updateOrders, this.updateDrivers);
         } catch (error) {
             alert(`Error: ${error.message}`);
         }
@@ -471,8 +548,7 @@ class DeliveryUI {
                 alert(`Still no suitable driver available for Order #${orderId}`);
             }
             
-            this.updateOrders();
-            this.updateDrivers();
+            this.refresh(this.updateOrders, this.updateDrivers);
         } catch (error) {
             alert(`Error: ${error.message}`);
         }
@@ -482,7 +558,7 @@ class DeliveryUI {
 async showDriverRoute(driverId) {
     try {
         const route = await this.getDriverRoute(driverId);
-        const locations = await this.fetchJson(`${API_BASE}/locations`);
+        const locations = this.locations || [];
         
         if (route && route.length > 0) {
             // Create a map of location IDs to names
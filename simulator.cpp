@@ -0,0 +1,463 @@
+// Discrete-event simulator and load generator for the delivery system.
+// Builds a synthetic city, feeds it order arrivals and drives the real
+// DeliverySystem in-process: drivers travel their planned routes hop by hop
+// in simulated time, picking up and delivering as they reach each stop.
+// Reports dispatch and routing latency (wall clock) and delivery metrics
+// (simulated minutes).
+#define DELIVERY_SYSTEM_NO_MAIN
+#include "main.cpp"
+
+#include <random>
+
+namespace {
+
+struct SimConfig {
+    int locations = 400;
+    int neighbours = 4;                 // roads from each location to its nearest others
+    double citySize = 100.0;            // locations lie in [0, citySize]^2
+    double restaurantShare = 0.1;       // share of locations that are restaurants
+    int drivers = 50;
+    double minSpeed = 1.0;              // distance units per simulated minute
+    double maxSpeed = 3.0;
+    int orders = 2000;
+    double rate = 2.0;                  // mean order arrivals per simulated minute
+    std::string arrivals = "poisson";   // poisson, uniform or burst
+    int burstSize = 20;
+    double hotspotShare = 0.0;          // share of orders from the busiest 10% of restaurants
+    unsigned seed = 1;
+    std::string database = ":memory:";
+    ScoringPolicy scoring = ScoringPolicy::Default;
+    long routeBudgetUs = 2000;
+};
+
+struct SimOrder {
+    int restaurant;
+    int customer;
+    double placedAt;
+    double assignedAt = -1;
+    double pickedUpAt = -1;
+    double deliveredAt = -1;
+};
+
+struct SimDriver {
+    int id;
+    int location;
+    double speed;
+    bool moving = false;                // a hop is scheduled
+    int target = -1;                    // stop the cached path leads to
+    std::vector<int> path;
+    size_t pathIndex = 0;
+};
+
+struct Event {
+    double time;
+    uint64_t sequence;                  // keeps simultaneous events in scheduling order
+    bool arrival;                       // order arrival, else a driver reaching a location
+    int id;                             // arrival number or driver index
+    int location;
+
+    bool operator>(const Event& other) const {
+        return time != other.time ? time > other.time : sequence > other.sequence;
+    }
+};
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * values.size()));
+    return values[std::min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+double mean(const std::vector<double>& values) {
+    double total = 0;
+    for (double value : values) {
+        total += value;
+    }
+    return values.empty() ? 0 : total / values.size();
+}
+
+class Simulator {
+private:
+    SimConfig config;
+    DeliverySystem system;
+    std::mt19937 rng;
+    std::vector<int> restaurants;
+    std::map<std::pair<int, int>, double> roadLength;
+    std::vector<SimDriver> drivers;
+    std::unordered_map<int, size_t> driverIndexById;
+    std::map<int, SimOrder> orders;
+    std::set<int> unassigned;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    uint64_t nextSequence = 0;
+    double now = 0;
+
+    std::vector<double> assignmentMicros;
+    std::vector<double> routingMicros;
+
+    void schedule(double time, bool arrival, int id, int location = -1) {
+        events.push({time, nextSequence++, arrival, id, location});
+    }
+
+    template <typename Fn>
+    static double timeMicros(Fn&& fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void buildCity() {
+        std::uniform_real_distribution<double> coordinate(0, config.citySize);
+        std::uniform_real_distribution<double> winding(1.0, 1.3);
+        std::vector<std::pair<double, double>> points;
+        for (int id = 1; id <= config.locations; ++id) {
+            points.push_back({coordinate(rng), coordinate(rng)});
+            system.addLocation(id, "L" + std::to_string(id), points.back().first, points.back().second);
+        }
+        // Two-way roads to each location's nearest neighbours, a little longer than the straight line
+        for (int a = 0; a < config.locations; ++a) {
+            std::vector<std::pair<double, int>> byDistance;
+            for (int b = 0; b < config.locations; ++b) {
+                if (a != b) {
+                    double dx = points[a].first - points[b].first;
+                    double dy = points[a].second - points[b].second;
+                    byDistance.push_back({std::sqrt(dx * dx + dy * dy), b});
+                }
+            }
+            size_t k = std::min<size_t>(config.neighbours, byDistance.size());
+            std::partial_sort(byDistance.begin(), byDistance.begin() + k, byDistance.end());
+            for (size_t i = 0; i < k; ++i) {
+                int from = a + 1, to = byDistance[i].second + 1;
+                if (roadLength.count({from, to}) == 0) {
+                    double length = byDistance[i].first * winding(rng);
+                    roadLength[{from, to}] = roadLength[{to, from}] = length;
+                    system.addEdge(from, to, length);
+                    system.addEdge(to, from, length);
+                }
+            }
+        }
+
+        int restaurantCount = std::max(1, static_cast<int>(config.locations * config.restaurantShare));
+        std::vector<int> ids(config.locations);
+        for (int i = 0; i < config.locations; ++i) {
+            ids[i] = i + 1;
+        }
+        std::shuffle(ids.begin(), ids.end(), rng);
+        restaurants.assign(ids.begin(), ids.begin() + std::min(restaurantCount, config.locations));
+
+        std::uniform_int_distribution<int> anywhere(1, config.locations);
+        std::uniform_real_distribution<double> speed(config.minSpeed, config.maxSpeed);
+        for (int i = 0; i < config.drivers; ++i) {
+            SimDriver driver;
+            driver.location = anywhere(rng);
+            driver.speed = speed(rng);
+            driver.id = system.addDriver(driver.speed, driver.location);
+            driverIndexById[driver.id] = drivers.size();
+            drivers.push_back(driver);
+        }
+    }
+
+    void scheduleArrivals() {
+        std::exponential_distribution<double> gap(config.rate);
+        double time = 0;
+        for (int i = 0; i < config.orders; ++i) {
+            if (config.arrivals == "uniform") {
+                time = i / config.rate;
+            } else if (config.arrivals == "burst") {
+                // Whole bursts at once, spaced to keep the same mean rate
+                time = (i / config.burstSize) * config.burstSize / config.rate;
+            } else {
+                time += gap(rng);
+            }
+            schedule(time, true, i);
+        }
+    }
+
+    int pickRestaurant() {
+        std::uniform_real_distribution<double> unit(0, 1);
+        size_t hot = std::max<size_t>(1, restaurants.size() / 10);
+        if (unit(rng) < config.hotspotShare) {
+            return restaurants[std::uniform_int_distribution<size_t>(0, hot - 1)(rng)];
+        }
+        return restaurants[std::uniform_int_distribution<size_t>(0, restaurants.size() - 1)(rng)];
+    }
+
+    void placeOrder() {
+        int restaurant = pickRestaurant();
+        int customer = std::uniform_int_distribution<int>(1, config.locations)(rng);
+        int orderId = system.placeOrder(restaurant, customer);
+        if (orderId < 0) {
+            return;
+        }
+        SimOrder order;
+        order.restaurant = restaurant;
+        order.customer = customer;
+        order.placedAt = now;
+        orders[orderId] = order;
+
+        int driverId = -1;
+        assignmentMicros.push_back(timeMicros([&] { driverId = system.assignDriverToOrder(orderId); }));
+        if (driverId >= 0) {
+            orders[orderId].assignedAt = now;
+            wake(driverId);
+        } else {
+            unassigned.insert(orderId);
+        }
+    }
+
+    // Start an idle driver towards its next stop
+    void wake(int driverId) {
+        auto it = driverIndexById.find(driverId);
+        if (it != driverIndexById.end() && !drivers[it->second].moving) {
+            drivers[it->second].moving = true;
+            schedule(now, false, static_cast<int>(it->second), drivers[it->second].location);
+        }
+    }
+
+    // Orders left Pending are assigned later by the system's own retry thread
+    void collectLateAssignments() {
+        for (auto it = unassigned.begin(); it != unassigned.end();) {
+            Order order;
+            if (system.getOrderById(*it, order) && order.status == "Assigned") {
+                orders[*it].assignedAt = now;
+                for (const auto& candidate : system.getAllDrivers()) {
+                    if (std::find(candidate.assignedOrders.begin(), candidate.assignedOrders.end(), *it) != candidate.assignedOrders.end()) {
+                        wake(candidate.id);
+                        break;
+                    }
+                }
+                it = unassigned.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Pick up and deliver whatever the driver has waiting at its location
+    void serveStops(SimDriver& driver, const Driver& state) {
+        for (int orderId : state.assignedOrders) {
+            auto it = orders.find(orderId);
+            if (it == orders.end()) {
+                continue;
+            }
+            SimOrder& order = it->second;
+            if (order.pickedUpAt < 0 && order.restaurant == driver.location) {
+                order.pickedUpAt = now;
+            }
+            if (order.pickedUpAt >= 0 && order.deliveredAt < 0 && order.customer == driver.location) {
+                order.deliveredAt = now;
+                system.completeOrder(orderId);
+            }
+        }
+    }
+
+    // First location on the planned route where the driver still has something to do
+    int nextStop(const SimDriver& driver) {
+        Driver state;
+        if (!system.getDriverById(driver.id, state)) {
+            return -1;
+        }
+        for (int location : system.getDriverRoute(driver.id)) {
+            for (int orderId : state.assignedOrders) {
+                auto it = orders.find(orderId);
+                if (it == orders.end()) {
+                    continue;
+                }
+                const SimOrder& order = it->second;
+                if ((order.pickedUpAt < 0 && order.restaurant == location) ||
+                    (order.pickedUpAt >= 0 && order.customer == location)) {
+                    return location;
+                }
+            }
+        }
+        return -1;
+    }
+
+    void arrive(SimDriver& driver, int location) {
+        if (location != driver.location) {
+            driver.location = location;
+            system.updateDriverLocation(driver.id, location);
+        }
+        Driver state;
+        if (system.getDriverById(driver.id, state)) {
+            serveStops(driver, state);
+        }
+
+        int target = nextStop(driver);
+        if (target < 0) {
+            driver.moving = false;
+            driver.target = -1;
+            return;
+        }
+        if (target != driver.target || driver.pathIndex + 1 >= driver.path.size() ||
+            driver.path[driver.pathIndex] != driver.location) {
+            driver.target = target;
+            driver.pathIndex = 0;
+            routingMicros.push_back(timeMicros([&] { driver.path = system.findShortestPath(driver.location, target); }));
+        }
+
+        // One hop along the road path; straight to the stop if there is none
+        int next = target;
+        double length = system.calculateDistance(driver.location, target);
+        if (driver.pathIndex + 1 < driver.path.size()) {
+            next = driver.path[++driver.pathIndex];
+            auto road = roadLength.find({driver.location, next});
+            length = road != roadLength.end() ? road->second : system.calculateDistance(driver.location, next);
+        } else {
+            driver.path.clear();
+        }
+        schedule(now + length / driver.speed, false, static_cast<int>(&driver - drivers.data()), next);
+    }
+
+public:
+    explicit Simulator(const SimConfig& config)
+        : config(config), system(config.database), rng(config.seed) {
+        system.setScoringPolicy(config.scoring);
+        system.setRouteOptimizationBudget(std::chrono::microseconds(config.routeBudgetUs));
+    }
+
+    void run() {
+        auto setupStart = std::chrono::steady_clock::now();
+        buildCity();
+        double setupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - setupStart).count();
+        scheduleArrivals();
+
+        auto runStart = std::chrono::steady_clock::now();
+        while (true) {
+            if (events.empty()) {
+                // Give the retry thread a moment to place what is still Pending
+                bool woke = false;
+                for (int tries = 0; tries < 50 && events.empty() && !unassigned.empty(); ++tries) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    collectLateAssignments();
+                    woke = !events.empty();
+                }
+                if (!woke) {
+                    break;
+                }
+            }
+            Event event = events.top();
+            events.pop();
+            now = event.time;
+            if (event.arrival) {
+                placeOrder();
+            } else {
+                arrive(drivers[event.id], event.location);
+            }
+            if (!unassigned.empty()) {
+                collectLateAssignments();
+            }
+        }
+        double runSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+        report(setupSeconds, runSeconds);
+    }
+
+    void report(double setupSeconds, double runSeconds) {
+        std::vector<double> waitForDriver, deliveryTime;
+        size_t delivered = 0;
+        for (const auto& entry : orders) {
+            const SimOrder& order = entry.second;
+            if (order.assignedAt >= 0) {
+                waitForDriver.push_back(order.assignedAt - order.placedAt);
+            }
+            if (order.deliveredAt >= 0) {
+                deliveryTime.push_back(order.deliveredAt - order.placedAt);
+                ++delivered;
+            }
+        }
+
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << "City: " << config.locations << " locations, " << roadLength.size() / 2 << " two-way roads, "
+                  << restaurants.size() << " restaurants, " << drivers.size() << " drivers"
+                  << " (built in " << setupSeconds << " s)\n";
+        std::cout << "Orders: " << orders.size() << " placed, " << delivered << " delivered, "
+                  << orders.size() - delivered << " undelivered\n";
+        std::cout << "Simulated time: " << now << " min; wall clock " << runSeconds << " s\n";
+        std::cout << "Throughput: " << (runSeconds > 0 ? orders.size() / runSeconds : 0) << " orders/s wall clock, "
+                  << (now > 0 ? delivered * 60.0 / now : 0) << " deliveries per simulated hour\n";
+        std::cout << "Assignment latency (us): p50 " << percentile(assignmentMicros, 50)
+                  << "  p90 " << percentile(assignmentMicros, 90)
+                  << "  p99 " << percentile(assignmentMicros, 99)
+                  << "  max " << percentile(assignmentMicros, 100) << "\n";
+        std::cout << "Path query latency (us): p50 " << percentile(routingMicros, 50)
+                  << "  p90 " << percentile(routingMicros, 90)
+                  << "  p99 " << percentile(routingMicros, 99)
+                  << "  (" << routingMicros.size() << " queries)\n";
+        std::cout << "Wait for a driver (min): mean " << mean(waitForDriver)
+                  << "  p50 " << percentile(waitForDriver, 50)
+                  << "  p90 " << percentile(waitForDriver, 90)
+                  << "  p99 " << percentile(waitForDriver, 99) << "\n";
+        std::cout << "Delivery time (min): mean " << mean(deliveryTime)
+                  << "  p50 " << percentile(deliveryTime, 50)
+                  << "  p90 " << percentile(deliveryTime, 90)
+                  << "  p99 " << percentile(deliveryTime, 99) << "\n";
+    }
+};
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    SimConfig config;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--locations" && hasValue) {
+            config.locations = std::stoi(argv[++i]);
+        } else if (arg == "--neighbours" && hasValue) {
+            config.neighbours = std::stoi(argv[++i]);
+        } else if (arg == "--city-size" && hasValue) {
+            config.citySize = std::stod(argv[++i]);
+        } else if (arg == "--restaurants" && hasValue) {
+            config.restaurantShare = std::stod(argv[++i]);
+        } else if (arg == "--drivers" && hasValue) {
+            config.drivers = std::stoi(argv[++i]);
+        } else if (arg == "--speed" && hasValue) {
+            std::string range = argv[++i];
+            size_t split = range.find(',');
+            config.minSpeed = std::stod(range.substr(0, split));
+            config.maxSpeed = split == std::string::npos ? config.minSpeed : std::stod(range.substr(split + 1));
+        } else if (arg == "--orders" && hasValue) {
+            config.orders = std::stoi(argv[++i]);
+        } else if (arg == "--rate" && hasValue) {
+            config.rate = std::stod(argv[++i]);
+        } else if (arg == "--arrivals" && hasValue) {
+            config.arrivals = argv[++i];
+        } else if (arg == "--burst-size" && hasValue) {
+            config.burstSize = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--hotspots" && hasValue) {
+            config.hotspotShare = std::stod(argv[++i]);
+        } else if (arg == "--seed" && hasValue) {
+            config.seed = static_cast<unsigned>(std::stoul(argv[++i]));
+        } else if (arg == "--db" && hasValue) {
+            config.database = argv[++i];
+        } else if (arg == "--scoring" && hasValue) {
+            try {
+                config.scoring = parseScoringPolicy(argv[++i]);
+            } catch (const std::invalid_argument& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        } else if (arg == "--route-budget-us" && hasValue) {
+            config.routeBudgetUs = std::stol(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--locations N] [--neighbours N] [--city-size D] [--restaurants SHARE]"
+                      << " [--drivers N] [--speed MIN,MAX] [--orders N] [--rate PER_MINUTE]"
+                      << " [--arrivals poisson|uniform|burst] [--burst-size N] [--hotspots SHARE]"
+                      << " [--seed N] [--db PATH] [--scoring default|eta|load] [--route-budget-us N]" << std::endl;
+            return 1;
+        }
+    }
+    if (config.arrivals != "poisson" && config.arrivals != "uniform" && config.arrivals != "burst") {
+        std::cerr << "Unknown arrival pattern: " << config.arrivals << std::endl;
+        return 1;
+    }
+    if (config.locations < 2 || config.drivers < 1 || config.rate <= 0) {
+        std::cerr << "Need at least 2 locations, 1 driver and a positive order rate" << std::endl;
+        return 1;
+    }
+
+    Simulator(config).run();
+    return 0;
+}
@@ -0,0 +1,208 @@
+// Regression tests for the HTTP API and its helpers. Runs the request router
+// in-process against an in-memory database; registered with CTest, exits
+// non-zero if any check fails.
+#define DELIVERY_SYSTEM_NO_MAIN
+#include "main.cpp"
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAIL: " << what << std::endl;
+        ++failures;
+    }
+}
+
+struct Response {
+    int status = 0;
+    std::string body;
+};
+
+Response request(DeliverySystem& system, const std::string& method, const std::string& path, const std::string& body) {
+    std::string raw = handleApiRequest(system, method, path, body);
+    Response response;
+    response.status = std::atoi(raw.c_str() + raw.find(' ') + 1);
+    size_t end = raw.find("\r\n\r\n");
+    response.body = end == std::string::npos ? "" : raw.substr(end + 4);
+    return response;
+}
+
+// The "error" member of a response body, or nullopt if the body is not a JSON object carrying one
+std::optional<std::string> errorMessage(const std::string& body) {
+    try {
+        std::string message;
+        JsonFields().required("error", message).parse(body);
+        return message;
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+}
+
+// Parse errors quote characters such as '"' and '\'; every 400 body must still be JSON
+void testMalformedBodiesGiveJsonErrors() {
+    DeliverySystem system(":memory:");
+    const char* paths[] = {"/api/locations", "/api/orders", "/api/drivers", "/api/edges", "/api/route",
+                           "/api/trace", "/api/stats/queries", "/api/drivers/limits", "/api/matrix",
+                           "/api/orders/complete", "/api/orders/assign"};
+    const char* bodies[] = {"{restaurantId: 1}", "{\"id\":1", "[1,2]", "{\"id\":1}x"};
+    for (const char* path : paths) {
+        for (const char* body : bodies) {
+            Response response = request(system, "POST", path, body);
+            std::string label = std::string(path) + " " + body;
+            check(response.status == 400, label + ": status " + std::to_string(response.status));
+            check(errorMessage(response.body).has_value(), label + ": unreadable error body: " + response.body);
+        }
+    }
+
+    Response badEscape = request(system, "POST", "/api/locations", "{\"id\":1,\"name\":\"\\u12\",\"x\":0,\"y\":0}");
+    check(badEscape.status == 400, "bad \\u escape: status " + std::to_string(badEscape.status));
+    check(errorMessage(badEscape.body) == std::optional<std::string>("Invalid JSON: bad \\u escape"),
+          "bad \\u escape: unreadable error body: " + badEscape.body);
+}
+
+// Booleans sent as "true"/"false" strings are still accepted, as before the typed parser
+void testStringBooleans() {
+    DeliverySystem system(":memory:");
+    check(request(system, "POST", "/api/stats/queries", "{\"enabled\":\"true\",\"clear\":\"true\"}").status == 200,
+          "string booleans on /api/stats/queries");
+    check(request(system, "POST", "/api/trace", "{\"rate\":0,\"clear\":\"false\"}").status == 200,
+          "string booleans on /api/trace");
+    check(request(system, "POST", "/api/trace", "{\"clear\":\"yes\"}").status == 400,
+          "non-boolean string rejected on /api/trace");
+}
+
+// Changes are retained only while subscribed; resuming across unrecorded changes resets
+void testChangeFeedRecordsOnlyWhileSubscribed() {
+    ChangeFeed feed;
+    feed.setListener([] {});
+    uint64_t before = feed.latest();
+    feed.publish("order", "{\"id\":1}");
+    check(!feed.active(), "feed records with no subscribers");
+
+    std::string out;
+    uint64_t cursor = before;
+    feed.appendSince(cursor, out);
+    check(out.find("event: reset") != std::string::npos, "resume across an unrecorded change: " + out);
+
+    feed.subscribe();
+    check(feed.active(), "feed not recording with a subscriber");
+    uint64_t token = feed.latest();
+    feed.publish("order", "{\"id\":2}");
+    feed.publish("driver", "{\"id\":3}");
+    out.clear();
+    cursor = token;
+    feed.appendSince(cursor, out);
+    check(out.find("event: order\ndata: {\"id\":2}") != std::string::npos &&
+          out.find("event: driver\ndata: {\"id\":3}") != std::string::npos && cursor == feed.latest(),
+          "subscribed changes not replayed: " + out);
+    feed.unsubscribe();
+    check(!feed.active(), "feed still recording after the last subscriber left");
+}
+
+// Histogram bucket labels must name the exact bounds, not a rounded form such as 1.04858e+06
+void testMetricsBucketLabelsAreExact() {
+    metrics().recordCandidatesScored(1);
+    metrics().recordStatement(std::chrono::microseconds(1));
+    std::string text = metrics().render();
+    check(text.find("delivery_dispatch_candidates_scored_bucket{le=\"1048576\"}") != std::string::npos,
+          "candidates bucket 1048576 not labelled exactly");
+    check(text.find("delivery_sqlite_statement_duration_seconds_bucket{le=\"1.572864\"}") != std::string::npos,
+          "statement bucket 1.572864 s not labelled exactly");
+    check(text.find("e+") == std::string::npos, "exponent in metrics output");
+}
+
+// Retrying an order no driver can take leaves it Pending without rewriting it or publishing a change
+void testPendingRetryWritesNothing() {
+    DeliverySystem system(":memory:");
+    request(system, "POST", "/api/locations", "{\"id\":1,\"name\":\"Restaurant\",\"x\":0,\"y\":0}");
+    request(system, "POST", "/api/locations", "{\"id\":2,\"name\":\"Customer\",\"x\":3,\"y\":4}");
+    int driverId = system.addDriver(1.0, 1);
+    request(system, "POST", "/api/drivers/limits", "{\"driverId\":" + std::to_string(driverId) + ",\"maxOrders\":0}");
+    int orderId = system.placeOrder(1, 2);
+    check(system.assignDriverToOrder(orderId) == -1, "order assigned to a driver with no capacity");
+
+    system.changeFeed().subscribe();
+    uint64_t before = system.changeFeed().latest();
+    check(!system.retryPendingOrder(orderId), "retry reported a Pending order as done");
+    Order order;
+    check(system.getOrderById(orderId, order) && order.status == "Pending", "retry changed the order status");
+    check(system.changeFeed().latest() == before, "retry published a change for an order left Pending");
+    system.changeFeed().unsubscribe();
+}
+
+// Numbers in the order body are written like everywhere else, not as fixed six-decimal text
+void testPlacedOrderBody() {
+    DeliverySystem system(":memory:");
+    request(system, "POST", "/api/locations", "{\"id\":1,\"name\":\"Restaurant\",\"x\":0,\"y\":0}");
+    request(system, "POST", "/api/locations", "{\"id\":2,\"name\":\"Customer\",\"x\":3,\"y\":4}");
+    system.addDriver(1.5, 1);
+    Response response = request(system, "POST", "/api/orders", "{\"restaurantId\":1,\"customerLocationId\":2}");
+    check(response.status == 201, "order not created: " + response.body);
+    check(response.body.find("\"driverSpeed\":1.5,") != std::string::npos, "driver speed misformatted: " + response.body);
+}
+
+#ifdef __linux__
+// A client that shuts down its sending side straight after a request must still
+// get the whole response, even when it is too big to leave in one write
+void testHalfClosedClientGetsWholeResponse() {
+    const std::string body(32 * 1024 * 1024, 'x');
+    SimpleHttpServer server(0, 1);
+    std::thread loop([&] {
+        server.start([&](const std::string&, const std::string&, const std::string&) -> std::string {
+            return "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                   "\r\n" + body;
+        });
+    });
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(server.boundPort());
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::string received;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        const std::string request = "GET /large HTTP/1.1\r\nHost: test\r\n\r\n";
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+        shutdown(fd, SHUT_WR);
+        // Read late, so the response is still queued when the server sees the shutdown
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        char buffer[65536];
+        ssize_t count;
+        while ((count = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            received.append(buffer, count);
+        }
+    }
+    close(fd);
+    server.stop();
+    loop.join();
+
+    size_t headerEnd = received.find("\r\n\r\n");
+    size_t bodyBytes = headerEnd == std::string::npos ? 0 : received.size() - headerEnd - 4;
+    check(bodyBytes == body.size(), "half-closed client got " + std::to_string(bodyBytes) + " of " +
+                                    std::to_string(body.size()) + " body bytes");
+}
+#endif
+
+} // namespace
+
+int main() {
+    testMalformedBodiesGiveJsonErrors();
+    testStringBooleans();
+    testChangeFeedRecordsOnlyWhileSubscribed();
+    testMetricsBucketLabelsAreExact();
+    testPendingRetryWritesNothing();
+    testPlacedOrderBody();
+#ifdef __linux__
+    testHalfClosedClientGetsWholeResponse();
+#endif
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all tests passed" << std::endl;
+    return 0;
+}